@@ -0,0 +1,200 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+// Support for the C programs generated by relox --emit-c (see emit.c). Every
+// Lox function becomes a C function with the signature of native code (see
+// jit.h), and every instruction one of the macros below, which follow vm_run
+// closely so that the semantics stay the same. Calls go through jit_call, like
+// calls from native code compiled at run time.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hamt.h"
+#include "jit.h"
+#include "value.h"
+#include "vm.h"
+
+#define PUSH(x) (*sp++ = (x))
+#define DROP() (sp -= 1)
+#define PEEK(i) (sp[-1 - (i)])
+#define POKE(i, x) (sp[-1 - (i)] = (x))
+
+#define ERROR(...) do { \
+    vm_runtime_error(vm, __VA_ARGS__); \
+    return 0; \
+} while (0)
+#define UNDEFINED(n) \
+    ERROR("undefined var \"%s\"", value_to_cstring(vm->global_names.items[n]))
+
+#define CHECK_NUMBERS(kind) do { \
+    if (!VALUE_IS_NUMBER(PEEK(1))) { \
+        ERROR("First operand of " kind " operation is not a number."); \
+    } \
+    if (!VALUE_IS_NUMBER(PEEK(0))) { \
+        ERROR("Second operand of " kind " operation is not a number."); \
+    } \
+} while (0)
+#define BINARY_OP_NUMBER(op) do { \
+    CHECK_NUMBERS("arithmetic"); \
+    DROP(); \
+    POKE(0, VALUE_FROM_NUMBER(PEEK(0).as_double op sp[0].as_double)); \
+} while (0)
+#define BINARY_OP_BOOLEAN(op) do { \
+    CHECK_NUMBERS("comparison"); \
+    DROP(); \
+    POKE(0, (PEEK(0).as_double op sp[0].as_double) ? VALUE_TRUE : VALUE_FALSE); \
+} while (0)
+
+#define FALSY(p) (VALUE_IS_FALSE(p) || VALUE_IS_EPSILON(p) || (p).as_double == 0)
+
+#define NEGATE() do { \
+    if (!VALUE_IS_NUMBER(PEEK(0))) { \
+        ERROR("Operand for negate is not a number."); \
+    } \
+    POKE(0, VALUE_FROM_NUMBER(-PEEK(0).as_double)); \
+} while (0)
+#define ADD() BINARY_OP_NUMBER(+)
+#define SUBTRACT() BINARY_OP_NUMBER(-)
+// The stack pointer is saved before adding a string to the VM, since the
+// garbage collector may run then.
+#define MULTIPLY() do { \
+    if (VALUE_IS_STRING(PEEK(0)) && VALUE_IS_STRING(PEEK(1))) { \
+        vm->sp = sp; \
+        DROP(); \
+        POKE(0, vm_add_string(vm, value_concatenate_strings(PEEK(0), sp[0]), PEEK(0), sp[0])); \
+    } else { \
+        BINARY_OP_NUMBER(*); \
+    } \
+} while (0)
+#define DIVIDE() BINARY_OP_NUMBER(/)
+#define EXPONENT() do { \
+    if (!VALUE_IS_NUMBER(PEEK(0))) { \
+        ERROR("Exponent is not a number."); \
+    } \
+    double exponent = PEEK(0).as_double; \
+    DROP(); \
+    if (VALUE_IS_NUMBER(PEEK(0))) { \
+        POKE(0, VALUE_FROM_NUMBER(pow(PEEK(0).as_double, exponent))); \
+    } else if (VALUE_IS_STRING(PEEK(0))) { \
+        vm->sp = sp; \
+        POKE(0, vm_add_string(vm, value_string_exponent(PEEK(0), exponent), PEEK(0), PEEK(0))); \
+    } else { \
+        ERROR("Base of exponent is not a number or a string."); \
+    } \
+} while (0)
+#define NOT() \
+    POKE(0, (VALUE_IS_FALSE(PEEK(0)) || VALUE_IS_NIL(PEEK(0))) ? VALUE_TRUE : VALUE_FALSE)
+#define EQ() do { \
+    DROP(); \
+    POKE(0, value_equal(PEEK(0), sp[0]) ? VALUE_TRUE : VALUE_FALSE); \
+} while (0)
+#define NE() do { \
+    DROP(); \
+    POKE(0, value_equal(PEEK(0), sp[0]) ? VALUE_FALSE : VALUE_TRUE); \
+} while (0)
+#define GT() BINARY_OP_BOOLEAN(>)
+#define GE() BINARY_OP_BOOLEAN(>=)
+#define LT() BINARY_OP_BOOLEAN(<)
+#define LE() BINARY_OP_BOOLEAN(<=)
+#define BARS() do { \
+    Value v = PEEK(0); \
+    if (VALUE_IS_STRING(v)) { \
+        POKE(0, VALUE_FROM_NUMBER(VALUE_IS_EPSILON(v) ? 0 : \
+            VALUE_IS_SHORT_STRING(v) ? VALUE_SHORT_STRING_LENGTH(v) : \
+            (VALUE_TO_STRING(v)->length))); \
+    } else if (VALUE_IS_NUMBER(v)) { \
+        POKE(0, VALUE_FROM_NUMBER(fabs(v.as_double))); \
+    } else { \
+        ERROR("Bars apply to number or string."); \
+    } \
+} while (0)
+#define QUOTE() do { \
+    vm->sp = sp; \
+    POKE(0, vm_add_string(vm, value_stringify(PEEK(0)), PEEK(0), PEEK(0))); \
+} while (0)
+#define CONCAT(n) do { \
+    vm->sp = sp; \
+    sp[-(n)] = vm_add_string(vm, value_interpolate(n, sp - (n)), sp[-(n)], sp[-(n)]); \
+    sp -= (n) - 1; \
+} while (0)
+#define PRINT() do { \
+    DROP(); \
+    value_print(sp[0]); \
+    puts(""); \
+} while (0)
+#define DUP() do { \
+    sp[0] = sp[-1]; \
+    sp += 1; \
+} while (0)
+
+#define DEFINE_GLOBAL(n) do { \
+    DROP(); \
+    vm->globals.items[n] = sp[0]; \
+} while (0)
+#define GET_GLOBAL(n) do { \
+    if (VALUE_IS_NONE(vm->globals.items[n])) { \
+        UNDEFINED(n); \
+    } \
+    PUSH(vm->globals.items[n]); \
+} while (0)
+#define SET_GLOBAL(n) do { \
+    if (VALUE_IS_NONE(vm->globals.items[n])) { \
+        UNDEFINED(n); \
+    } \
+    vm->globals.items[n] = PEEK(0); \
+} while (0)
+#define GET_LOCAL(n) PUSH(slots[n])
+#define SET_LOCAL(n) (slots[n] = PEEK(0))
+
+#define JUMP(label) goto label
+#define JUMP_TRUE(label) do { \
+    if (!FALSY(PEEK(0))) { \
+        goto label; \
+    } \
+} while (0)
+#define JUMP_FALSE(label) do { \
+    if (FALSY(PEEK(0))) { \
+        goto label; \
+    } \
+} while (0)
+
+#define CALL(n) do { \
+    sp = jit_call(vm, sp, n); \
+    if (!sp) { \
+        return 0; \
+    } \
+} while (0)
+#define TAIL_CALL(n) do { \
+    sp = jit_tail_call(vm, sp, n); \
+    if (!sp || ((uintptr_t)sp & JIT_TAIL_CALL)) { \
+        return sp; \
+    } \
+} while (0)
+#define RETURN() do { \
+    slots[0] = PEEK(0); \
+    return slots + 1; \
+} while (0)
+// The top-level function has nothing to return.
+#define END() return sp
+
+// Setting up the VM before running the top-level function.
+#define STRING(chars, length) vm_add_object(vm, value_copy_string(chars, length))
+#define GLOBAL(name, mutable) (void)vm_add_global(vm, name, mutable)
+#define FUNCTION(f, native_code, arity_, name_) do { \
+    f = function_new(); \
+    f->arity = arity_; \
+    f->name = name_; \
+    *(Native**)&f->native = native_code; \
+    vm_add_object(vm, VALUE_FROM_FUNCTION(f)); \
+} while (0)
+// Constants are also added to the chunk of their function so that the garbage
+// collector finds them.
+#define CONSTANTS(f, constants) do { \
+    for (size_t i_ = 0; i_ < sizeof(constants) / sizeof(Value); ++i_) { \
+        value_array_push(&(f)->chunk->values, constants[i_]); \
+    } \
+} while (0)
+
+#endif
@@ -40,8 +40,11 @@ void number_array_init(NumberArray* array) {
 void number_array_push(NumberArray* array, size_t n) {
     size_t size = array->count * sizeof(size_t);
     if (size == array->capacity) {
+        // Keep the capacity a multiple of the item size so that it can be
+        // reached again by the count.
         size_t min_size = ARRAY_MIN_CAPACITY * sizeof(size_t);
-        array->capacity = size < min_size ? min_size : ARRAY_GROW_FACTOR * size;
+        array->capacity = size < min_size ? min_size :
+            (size_t)(ARRAY_GROW_FACTOR * array->count) * sizeof(size_t);
         array->items = realloc(array->items, array->capacity);
 #ifdef DEBUG
         fprintf(stderr, "+++ number_array_push() growing %p to %zu bytes.\n",
@@ -71,7 +74,8 @@ void value_array_push(ValueArray* array, Value v) {
     size_t size = array->count * sizeof(Value);
     if (size == array->capacity) {
         size_t min_size = ARRAY_MIN_CAPACITY * sizeof(Value);
-        array->capacity = size < min_size ? min_size : ARRAY_GROW_FACTOR * size;
+        array->capacity = size < min_size ? min_size :
+            (size_t)(ARRAY_GROW_FACTOR * array->count) * sizeof(Value);
         array->items = realloc(array->items, array->capacity);
 #ifdef DEBUG
         fprintf(stderr, "+++ value_array_push() growing %p to %zu bytes.\n",
@@ -0,0 +1,129 @@
+// Generated by relox --emit-c.
+
+#include "aot.h"
+
+static Value constants_0[2];
+
+// Top-level function
+static Value* function_0(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_0[0]);
+    DEFINE_GLOBAL(4);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(5);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(6);
+    PUSH(VALUE_FROM_NUMBER(1));
+    DEFINE_GLOBAL(7);
+l13:
+    GET_GLOBAL(7);
+    PUSH(constants_0[1]);
+    LT(); JUMP_FALSE(l61); DROP();
+    JUMP(l32);
+l23:
+    GET_GLOBAL(7);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_GLOBAL(7);
+    DROP(); JUMP(l13);
+l32:
+    GET_GLOBAL(4);
+    GET_GLOBAL(7);
+    CALL(1);
+    GET_LOCAL(0);
+    GET_GLOBAL(5);
+    GT(); JUMP_FALSE(l57); DROP();
+    GET_LOCAL(0);
+    SET_GLOBAL(5);
+    DROP();
+    GET_GLOBAL(7);
+    SET_GLOBAL(6);
+    DROP(); JUMP(l58);
+l57:
+    DROP();
+l58:
+    DROP(); JUMP(l23);
+l61:
+    DROP();
+    GET_GLOBAL(6);
+    PRINT();
+    GET_GLOBAL(5);
+    PRINT();
+    END();
+}
+
+static Value constants_1[2];
+
+// steps/1
+static Value* function_1(VM* vm, Value* slots, Value* sp) {
+    PUSH(VALUE_FROM_NUMBER(0));
+l1:
+    GET_LOCAL(1);
+    PUSH(VALUE_FROM_NUMBER(1));
+    GT(); JUMP_FALSE(l60); DROP();
+    GET_LOCAL(1);
+l9:
+    GET_LOCAL(3); PUSH(constants_1[0]);
+    GE(); JUMP_FALSE(l24); DROP();
+    GET_LOCAL(3); PUSH(constants_1[0]);
+    SUBTRACT();
+    SET_LOCAL(3); DROP();
+    JUMP(l9);
+l24:
+    DROP();
+    GET_LOCAL(3);
+    PUSH(VALUE_FROM_NUMBER(0));
+    EQ();
+    JUMP_FALSE(l41); DROP();
+    GET_LOCAL(1); PUSH(constants_1[0]);
+    DIVIDE();
+    SET_LOCAL(1); DROP();
+    JUMP(l51);
+l41:
+    DROP();
+    PUSH(constants_1[1]);
+    GET_LOCAL(1);
+    MULTIPLY();
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_LOCAL(1); DROP();
+l51:
+    GET_LOCAL(2);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_LOCAL(2); DROP();
+    DROP(); JUMP(l1);
+l60:
+    DROP();
+    GET_LOCAL(2);
+    RETURN();
+    DROP();
+    PUSH(VALUE_NIL);
+    RETURN();
+    DROP();
+    DROP();
+}
+
+int main(void) {
+    static VM machine;
+    VM* vm = &machine;
+    vm->backend = backend_stack;
+    vm->jit = false;
+    vm->frames_max = 16384;
+    vm_init(vm);
+    GLOBAL(STRING("steps", 5), false);
+    GLOBAL(STRING("best", 4), true);
+    GLOBAL(STRING("best_n", 6), true);
+    GLOBAL(STRING("n", 1), true);
+    Function* functions[2];
+    FUNCTION(functions[0], function_0, 0, VALUE_NONE);
+    FUNCTION(functions[1], function_1, 1, STRING("steps", 5));
+    constants_0[0] = VALUE_FROM_FUNCTION(functions[1]);
+    constants_0[1] = VALUE_FROM_NUMBER(1000);
+    CONSTANTS(functions[0], constants_0);
+    constants_1[0] = VALUE_FROM_NUMBER(2);
+    constants_1[1] = VALUE_FROM_NUMBER(3);
+    CONSTANTS(functions[1], constants_1);
+    Result result = vm_run_function(vm, functions[0]);
+    vm_free(vm);
+    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,70 @@
+// Generated by relox --emit-c.
+
+#include "aot.h"
+
+static Value constants_0[2];
+
+// Top-level function
+static Value* function_0(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_0[0]);
+    DEFINE_GLOBAL(4);
+    PUSH(VALUE_EPSILON);
+    DEFINE_GLOBAL(5);
+    PUSH(VALUE_EPSILON);
+    DEFINE_GLOBAL(6);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(7);
+l13:
+    GET_GLOBAL(7);
+    PUSH(constants_0[1]);
+    LT(); JUMP_FALSE(l50); DROP();
+    JUMP(l32);
+l23:
+    GET_GLOBAL(7);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_GLOBAL(7);
+    DROP(); JUMP(l13);
+l32:
+    GET_GLOBAL(5);
+    GET_GLOBAL(4);
+    MULTIPLY();
+    SET_GLOBAL(5);
+    DROP();
+    GET_GLOBAL(4);
+    GET_GLOBAL(6);
+    MULTIPLY();
+    SET_GLOBAL(6);
+    DROP(); JUMP(l23);
+l50:
+    DROP();
+    GET_GLOBAL(5);
+    BARS();
+    PRINT();
+    GET_GLOBAL(5);
+    GET_GLOBAL(6);
+    EQ();
+    PRINT();
+    END();
+}
+
+int main(void) {
+    static VM machine;
+    VM* vm = &machine;
+    vm->backend = backend_stack;
+    vm->jit = false;
+    vm->frames_max = 16384;
+    vm_init(vm);
+    GLOBAL(STRING("line", 4), false);
+    GLOBAL(STRING("log", 3), true);
+    GLOBAL(STRING("reversed", 8), true);
+    GLOBAL(STRING("i", 1), true);
+    Function* functions[1];
+    FUNCTION(functions[0], function_0, 0, VALUE_NONE);
+    constants_0[0] = STRING("0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789", 100);
+    constants_0[1] = VALUE_FROM_NUMBER(100000);
+    CONSTANTS(functions[0], constants_0);
+    Result result = vm_run_function(vm, functions[0]);
+    vm_free(vm);
+    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,64 @@
+// Generated by relox --emit-c.
+
+#include "aot.h"
+
+static Value constants_0[2];
+
+// Top-level function
+static Value* function_0(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_0[0]);
+    DEFINE_GLOBAL(4);
+    GET_GLOBAL(4);
+    PUSH(constants_0[1]);
+    CALL(1);
+    PRINT();
+    END();
+}
+
+static Value constants_1[1];
+
+// fib/1
+static Value* function_1(VM* vm, Value* slots, Value* sp) {
+    GET_LOCAL(1); PUSH(constants_1[0]);
+    LT(); JUMP_FALSE(l12); DROP();
+    GET_LOCAL(1);
+    RETURN();
+    JUMP(l13);
+l12:
+    DROP();
+l13:
+    GET_GLOBAL(4);
+    GET_LOCAL(1);
+    PUSH(VALUE_FROM_NUMBER(1));
+    SUBTRACT();
+    CALL(1);
+    GET_GLOBAL(4);
+    GET_LOCAL(1); PUSH(constants_1[0]);
+    SUBTRACT();
+    CALL(1);
+    ADD();
+    RETURN();
+    DROP();
+    DROP();
+}
+
+int main(void) {
+    static VM machine;
+    VM* vm = &machine;
+    vm->backend = backend_stack;
+    vm->jit = false;
+    vm->frames_max = 16384;
+    vm_init(vm);
+    GLOBAL(STRING("fib", 3), false);
+    Function* functions[2];
+    FUNCTION(functions[0], function_0, 0, VALUE_NONE);
+    FUNCTION(functions[1], function_1, 1, STRING("fib", 3));
+    constants_0[0] = VALUE_FROM_FUNCTION(functions[1]);
+    constants_0[1] = VALUE_FROM_NUMBER(32);
+    CONSTANTS(functions[0], constants_0);
+    constants_1[0] = VALUE_FROM_NUMBER(2);
+    CONSTANTS(functions[1], constants_1);
+    Result result = vm_run_function(vm, functions[0]);
+    vm_free(vm);
+    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,90 @@
+// Generated by relox --emit-c.
+
+#include "aot.h"
+
+static Value constants_0[2];
+
+// Top-level function
+static Value* function_0(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_0[0]);
+    DEFINE_GLOBAL(4);
+    GET_GLOBAL(4);
+    PUSH(constants_0[1]);
+    CALL(1);
+    PRINT();
+    END();
+}
+
+static Value constants_1[2];
+
+// loop/1
+static Value* function_1(VM* vm, Value* slots, Value* sp) {
+    PUSH(VALUE_FROM_NUMBER(0));
+    PUSH(VALUE_FROM_NUMBER(0));
+l2:
+    GET_LOCAL(3); GET_LOCAL(1);
+    LT(); JUMP_FALSE(l60); DROP();
+    JUMP(l20);
+l11:
+    GET_LOCAL(3);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_LOCAL(3); DROP();
+    JUMP(l2);
+l20:
+    PUSH(VALUE_FROM_NUMBER(0));
+l21:
+    GET_LOCAL(4); PUSH(constants_1[0]);
+    LT(); JUMP_FALSE(l56); DROP();
+    JUMP(l39);
+l30:
+    GET_LOCAL(4);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_LOCAL(4); DROP();
+    JUMP(l21);
+l39:
+    GET_LOCAL(2); GET_LOCAL(3);
+    GET_LOCAL(4);
+    MULTIPLY();
+    ADD();
+    GET_LOCAL(4); PUSH(constants_1[1]);
+    DIVIDE();
+    SUBTRACT();
+    SET_LOCAL(2); DROP();
+    JUMP(l30);
+l56:
+    DROP(); DROP();
+    JUMP(l11);
+l60:
+    DROP();
+    GET_LOCAL(2);
+    RETURN();
+    DROP(); DROP();
+    PUSH(VALUE_NIL);
+    RETURN();
+    DROP();
+    DROP();
+}
+
+int main(void) {
+    static VM machine;
+    VM* vm = &machine;
+    vm->backend = backend_stack;
+    vm->jit = false;
+    vm->frames_max = 16384;
+    vm_init(vm);
+    GLOBAL(STRING("loop", 4), false);
+    Function* functions[2];
+    FUNCTION(functions[0], function_0, 0, VALUE_NONE);
+    FUNCTION(functions[1], function_1, 1, STRING("loop", 4));
+    constants_0[0] = VALUE_FROM_FUNCTION(functions[1]);
+    constants_0[1] = VALUE_FROM_NUMBER(100000);
+    CONSTANTS(functions[0], constants_0);
+    constants_1[0] = VALUE_FROM_NUMBER(100);
+    constants_1[1] = VALUE_FROM_NUMBER(2);
+    CONSTANTS(functions[1], constants_1);
+    Result result = vm_run_function(vm, functions[0]);
+    vm_free(vm);
+    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,155 @@
+// Generated by relox --emit-c.
+
+#include "aot.h"
+
+static Value constants_0[6];
+
+// Top-level function
+static Value* function_0(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_0[0]);
+    DEFINE_GLOBAL(4);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(5);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(6);
+l10:
+    GET_GLOBAL(6);
+    PUSH(constants_0[1]);
+    LT(); JUMP_FALSE(l88); DROP();
+    JUMP(l29);
+l20:
+    GET_GLOBAL(6);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_GLOBAL(6);
+    DROP(); JUMP(l10);
+l29:
+    PUSH(VALUE_FROM_NUMBER(0));
+l30:
+    GET_LOCAL(0); PUSH(constants_0[2]);
+    LT(); JUMP_FALSE(l84); DROP();
+    JUMP(l48);
+l39:
+    GET_LOCAL(0);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_LOCAL(0); DROP();
+    JUMP(l30);
+l48:
+    GET_GLOBAL(4);
+    GET_LOCAL(0); PUSH(constants_0[3]);
+    DIVIDE();
+    PUSH(constants_0[4]);
+    SUBTRACT();
+    GET_GLOBAL(6);
+    PUSH(constants_0[5]);
+    DIVIDE();
+    PUSH(VALUE_FROM_NUMBER(1));
+    SUBTRACT();
+    CALL(2);
+    PUSH(VALUE_FALSE);
+    EQ();
+    JUMP_FALSE(l80); DROP();
+    GET_GLOBAL(5);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_GLOBAL(5);
+    DROP(); JUMP(l81);
+l80:
+    DROP();
+l81:
+    JUMP(l39);
+l84:
+    DROP(); DROP();
+    JUMP(l20);
+l88:
+    DROP();
+    GET_GLOBAL(5);
+    PRINT();
+    END();
+}
+
+static Value constants_1[3];
+
+// escapes/2
+static Value* function_1(VM* vm, Value* slots, Value* sp) {
+    PUSH(VALUE_FROM_NUMBER(0));
+    PUSH(VALUE_FROM_NUMBER(0));
+    PUSH(VALUE_FROM_NUMBER(0));
+l3:
+    GET_LOCAL(5); PUSH(constants_1[0]);
+    LT(); JUMP_FALSE(l64); DROP();
+    GET_LOCAL(3); GET_LOCAL(3);
+    MULTIPLY();
+    GET_LOCAL(4); GET_LOCAL(4);
+    MULTIPLY();
+    GET_LOCAL(6); GET_LOCAL(7);
+    ADD();
+    PUSH(constants_1[1]);
+    GT(); JUMP_FALSE(l31); DROP();
+    PUSH(VALUE_TRUE);
+    RETURN();
+    JUMP(l32);
+l31:
+    DROP();
+l32:
+    PUSH(constants_1[2]);
+    GET_LOCAL(3);
+    MULTIPLY();
+    GET_LOCAL(4);
+    MULTIPLY();
+    GET_LOCAL(2);
+    ADD();
+    SET_LOCAL(4); DROP();
+    GET_LOCAL(6); GET_LOCAL(7);
+    SUBTRACT();
+    GET_LOCAL(1);
+    ADD();
+    SET_LOCAL(3); DROP();
+    GET_LOCAL(5);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_LOCAL(5); DROP();
+    DROP(); DROP();
+    JUMP(l3);
+l64:
+    DROP();
+    PUSH(VALUE_FALSE);
+    RETURN();
+    DROP(); DROP();
+    DROP();
+    PUSH(VALUE_NIL);
+    RETURN();
+    DROP();
+    DROP();
+    DROP();
+}
+
+int main(void) {
+    static VM machine;
+    VM* vm = &machine;
+    vm->backend = backend_stack;
+    vm->jit = false;
+    vm->frames_max = 16384;
+    vm_init(vm);
+    GLOBAL(STRING("escapes", 7), false);
+    GLOBAL(STRING("inside", 6), true);
+    GLOBAL(STRING("y", 1), true);
+    Function* functions[2];
+    FUNCTION(functions[0], function_0, 0, VALUE_NONE);
+    FUNCTION(functions[1], function_1, 2, STRING("escapes", 7));
+    constants_0[0] = VALUE_FROM_FUNCTION(functions[1]);
+    constants_0[1] = VALUE_FROM_NUMBER(240);
+    constants_0[2] = VALUE_FROM_NUMBER(320);
+    constants_0[3] = VALUE_FROM_NUMBER(128);
+    constants_0[4] = VALUE_FROM_NUMBER(2);
+    constants_0[5] = VALUE_FROM_NUMBER(120);
+    CONSTANTS(functions[0], constants_0);
+    constants_1[0] = VALUE_FROM_NUMBER(200);
+    constants_1[1] = VALUE_FROM_NUMBER(4);
+    constants_1[2] = VALUE_FROM_NUMBER(2);
+    CONSTANTS(functions[1], constants_1);
+    Result result = vm_run_function(vm, functions[0]);
+    vm_free(vm);
+    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,98 @@
+// Generated by relox --emit-c.
+
+#include "aot.h"
+
+static Value constants_0[2];
+
+// Top-level function
+static Value* function_0(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_0[0]);
+    DEFINE_GLOBAL(4);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(5);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(6);
+l10:
+    GET_GLOBAL(6);
+    PUSH(constants_0[1]);
+    LT(); JUMP_FALSE(l55); DROP();
+    JUMP(l29);
+l20:
+    GET_GLOBAL(6);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_GLOBAL(6);
+    DROP(); JUMP(l10);
+l29:
+    GET_GLOBAL(4);
+    GET_GLOBAL(6);
+    CALL(1);
+    GET_LOCAL(0);
+    BARS();
+    GET_GLOBAL(5);
+    GT(); JUMP_FALSE(l51); DROP();
+    GET_LOCAL(0);
+    BARS();
+    SET_GLOBAL(5);
+    DROP(); JUMP(l52);
+l51:
+    DROP();
+l52:
+    DROP(); JUMP(l20);
+l55:
+    DROP();
+    GET_GLOBAL(5);
+    PRINT();
+    END();
+}
+
+static Value constants_1[7];
+
+// line/1
+static Value* function_1(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_1[0]);
+    GET_LOCAL(1); PUSH(constants_1[1]);
+    GET_LOCAL(1); PUSH(constants_1[2]);
+    MULTIPLY();
+    PUSH(constants_1[3]);
+    GET_LOCAL(1); PUSH(constants_1[4]);
+    DIVIDE();
+    PUSH(constants_1[5]);
+    GET_LOCAL(1); GET_LOCAL(1);
+    MULTIPLY();
+    PUSH(constants_1[6]);
+    MULTIPLY();
+    CONCAT(8);
+    RETURN();
+    DROP();
+    DROP();
+}
+
+int main(void) {
+    static VM machine;
+    VM* vm = &machine;
+    vm->backend = backend_stack;
+    vm->jit = false;
+    vm->frames_max = 16384;
+    vm_init(vm);
+    GLOBAL(STRING("line", 4), false);
+    GLOBAL(STRING("width", 5), true);
+    GLOBAL(STRING("i", 1), true);
+    Function* functions[2];
+    FUNCTION(functions[0], function_0, 0, VALUE_NONE);
+    FUNCTION(functions[1], function_1, 1, STRING("line", 4));
+    constants_0[0] = VALUE_FROM_FUNCTION(functions[1]);
+    constants_0[1] = VALUE_FROM_NUMBER(200000);
+    CONSTANTS(functions[0], constants_0);
+    constants_1[0] = STRING("item ", 5);
+    constants_1[1] = STRING(": ", 2);
+    constants_1[2] = VALUE_FROM_NUMBER(3);
+    constants_1[3] = STRING(" units at ", 10);
+    constants_1[4] = VALUE_FROM_NUMBER(4);
+    constants_1[5] = STRING(" each, total ", 13);
+    constants_1[6] = VALUE_FROM_NUMBER(0.75);
+    CONSTANTS(functions[1], constants_1);
+    Result result = vm_run_function(vm, functions[0]);
+    vm_free(vm);
+    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,80 @@
+// Generated by relox --emit-c.
+
+#include "aot.h"
+
+static Value constants_0[5];
+
+// Top-level function
+static Value* function_0(VM* vm, Value* slots, Value* sp) {
+    PUSH(constants_0[0]);
+    PUSH(constants_0[1]);
+    EXPONENT();
+    DEFINE_GLOBAL(4);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(5);
+    PUSH(VALUE_FROM_NUMBER(0));
+    DEFINE_GLOBAL(6);
+l13:
+    GET_GLOBAL(6);
+    PUSH(constants_0[2]);
+    LT(); JUMP_FALSE(l73); DROP();
+    JUMP(l32);
+l23:
+    GET_GLOBAL(6);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_GLOBAL(6);
+    DROP(); JUMP(l13);
+l32:
+    GET_GLOBAL(3);
+    GET_GLOBAL(4);
+    GET_GLOBAL(6);
+    GET_GLOBAL(6);
+    PUSH(constants_0[1]);
+    ADD();
+    CALL(3);
+    GET_GLOBAL(3);
+    GET_LOCAL(0); PUSH(constants_0[3]);
+    PUSH(constants_0[1]);
+    CALL(3);
+    PUSH(constants_0[4]);
+    EQ();
+    JUMP_FALSE(l69); DROP();
+    GET_GLOBAL(5);
+    PUSH(VALUE_FROM_NUMBER(1));
+    ADD();
+    SET_GLOBAL(5);
+    DROP(); JUMP(l70);
+l69:
+    DROP();
+l70:
+    DROP(); JUMP(l23);
+l73:
+    DROP();
+    GET_GLOBAL(5);
+    PRINT();
+    END();
+}
+
+int main(void) {
+    static VM machine;
+    VM* vm = &machine;
+    vm->backend = backend_stack;
+    vm->jit = false;
+    vm->frames_max = 16384;
+    vm_init(vm);
+    GLOBAL(STRING("text", 4), false);
+    GLOBAL(STRING("count", 5), true);
+    GLOBAL(STRING("i", 1), true);
+    Function* functions[1];
+    FUNCTION(functions[0], function_0, 0, VALUE_NONE);
+    constants_0[0] = STRING("The quick brown fox jumps over the lazy dog; ", 45);
+    constants_0[1] = VALUE_FROM_NUMBER(10000);
+    constants_0[2] = VALUE_FROM_NUMBER(400000);
+    constants_0[3] = VALUE_FROM_NUMBER(9996);
+    constants_0[4] = STRING("dog;", 4);
+    CONSTANTS(functions[0], constants_0);
+    Result result = vm_run_function(vm, functions[0]);
+    vm_free(vm);
+    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
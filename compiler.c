@@ -2,8 +2,10 @@
 
 #include "array.h"
 #include "compiler.h"
+#include "fuse.h"
 #include "hamt.h"
 #include "lexer.h"
+#include "registers.h"
 #include "value.h"
 #include "vm.h"
 
@@ -43,6 +45,8 @@ typedef struct Compiler {
     Lexer* lexer;
     Token previous_token;
     Token current_token;
+    // Position of the last call, to find calls in tail position.
+    size_t last_call;
     bool error;
 } Compiler;
 
@@ -141,8 +145,13 @@ static bool compiler_parse_statement(Compiler* compiler) {
     return !compiler->error;
 }
 
+// Characters around the string in a string token (quotes and braces).
+static size_t compiler_string_trim(Token* token) {
+    return token->type == token_string_prefix || token->type == token_string_infix ? 3 : 2;
+}
+
 static void compiler_string_constant(Compiler* compiler, Token* token) {
-    size_t trim = token->type == token_string_prefix || token->type == token_string_infix ? 3 : 2;
+    size_t trim = compiler_string_trim(token);
     if (token->length == trim) {
         compiler_emit_byte(compiler, op_epsilon);
         return;
@@ -153,6 +162,12 @@ static void compiler_string_constant(Compiler* compiler, Token* token) {
     compiler_emit_bytes(compiler, op_constant, n);
 }
 
+// Free the scope of a block (its nodes may be shared with others).
+static void compiler_free_scope(HAMT* scope) {
+    hamt_free(scope);
+    free(scope);
+}
+
 static Var* compiler_declare_var(Compiler* compiler, Token* token, bool mutable) {
     Value string = value_copy_string(token->start, token->length);
     Value v = vm_add_object(compiler->function->chunk->vm, string);
@@ -176,9 +191,13 @@ static Var* compiler_declare_var(Compiler* compiler, Token* token, bool mutable)
 
     Var* var = vm_var_new(compiler->function->chunk->vm, compiler->locals_count, mutable, false);
     compiler->locals_count += 1;
-    scope = hamt_with(scope, v, VALUE_FROM_POINTER(var));
-    scope = hamt_with(scope, VALUE_FROM_INT(var->index), v);
-    compiler->scopes.items[i] = VALUE_FROM_POINTER(scope);
+    if (scope == VALUE_TO_HAMT(compiler->scopes.items[i - 1])) {
+        // The first var of this block gets its own scope, which is then
+        // updated in place.
+        scope = hamt_transient(scope);
+        compiler->scopes.items[i] = VALUE_FROM_POINTER(scope);
+    }
+    hamt_set(scope, v, VALUE_FROM_POINTER(var));
     return var;
 }
 
@@ -197,16 +216,34 @@ static Var* compiler_find_var(Compiler* compiler, Token* token) {
     return (Var*)VALUE_TO_POINTER(w);
 }
 
-static void compiler_string_interpolation(Compiler* compiler) {
-    if (compiler_parse_expression(compiler, precedence_interpolation)) {
-        if (compiler->current_token.type == token_string_infix ||
-            compiler->current_token.type == token_string_suffix) {
-            compiler_emit_byte(compiler, op_quote);
-            compiler_emit_byte(compiler, op_multiply);
-        } else {
-            compiler_error(compiler, &compiler->current_token, "expected a continuing string");
+#define COMPILER_CONCAT_MAX 32
+
+// Count a new part of an interpolated string on the stack; parts are
+// concatenated as soon as there are COMPILER_CONCAT_MAX of them, so that they
+// also fit in the registers of the register VM.
+static size_t compiler_string_part(Compiler* compiler, size_t n) {
+    if (++n == COMPILER_CONCAT_MAX) {
+        compiler_emit_bytes(compiler, op_concat, COMPILER_CONCAT_MAX);
+        return 1;
+    }
+    return n;
+}
+
+// Finish the chunk of the function being compiled for the backend of the VM,
+// with depth values on the stack when the function starts.
+static void compiler_finish_function(Compiler* compiler, size_t depth) {
+    if (compiler->error) {
+        return;
+    }
+    if (compiler->function->chunk->vm->backend == backend_registers) {
+        if (!function_to_registers(compiler->function, depth)) {
+            compiler->error = true;
         }
+        return;
     }
+#ifndef NO_SUPERINSTRUCTIONS
+    chunk_fuse(compiler->function->chunk);
+#endif
 }
 
 static size_t compiler_stub_jump(Compiler* compiler, Opcode op) {
@@ -223,7 +260,9 @@ static void compiler_patch_jump(Compiler* compiler, size_t dest) {
 }
 
 static size_t compiler_enter_scope(Compiler* compiler) {
-    HAMT* parent_scope = VALUE_TO_HAMT(compiler->scopes.items[compiler->scopes.count - 1]);
+    // The scope of the parent block is shared by the new block until it
+    // declares its own vars.
+    HAMT* parent_scope = hamt_persist(VALUE_TO_HAMT(compiler->scopes.items[compiler->scopes.count - 1]));
     size_t parent_count = compiler->locals_count;
     value_array_push(&compiler->scopes, VALUE_FROM_POINTER(parent_scope));
     return parent_count;
@@ -236,7 +275,7 @@ static void compiler_exit_scope(Compiler* compiler, size_t parent_count) {
     HAMT* child_scope = VALUE_TO_HAMT(value_array_pop(&compiler->scopes));
     HAMT* parent_scope = VALUE_TO_HAMT(compiler->scopes.items[compiler->scopes.count - 1]);
     if (child_scope != parent_scope) {
-        hamt_free(child_scope);
+        compiler_free_scope(child_scope);
     }
 }
 
@@ -260,16 +299,16 @@ static void statement_if(Compiler* compiler) {
         compiler_emit_byte(compiler, op_pop);
         compiler_consume(compiler, token_open_brace, "expected { after if and predicate");
         statement_block(compiler);
+        // The predicate is still on the stack when jumping over the
+        // consequent so it needs to be popped even when there is no else.
+        size_t jump_over_alternate = compiler_stub_jump(compiler, op_jump);
+        compiler_patch_jump(compiler, jump_over_consequent);
+        compiler_emit_byte(compiler, op_pop);
         if (!compiler->error && compiler_match(compiler, token_else)) {
             compiler_consume(compiler, token_open_brace, "expected { after else");
-            size_t jump_over_alternate = compiler_stub_jump(compiler, op_jump);
-            compiler_patch_jump(compiler, jump_over_consequent);
-            compiler_emit_byte(compiler, op_pop);
             statement_block(compiler);
-            compiler_patch_jump(compiler, jump_over_alternate);
-        } else {
-            compiler_patch_jump(compiler, jump_over_consequent);
         }
+        compiler_patch_jump(compiler, jump_over_alternate);
     }
 }
 
@@ -287,12 +326,13 @@ static void statement_switch(Compiler* compiler) {
     ValueArray breaks;
     value_array_init(&breaks);
 
+    // The value of the switch expression stays on the stack while testing
+    // cases; when a case matches, both the value and the result of the
+    // comparison are popped before the statements of the case. Otherwise
+    // only the result of the comparison is popped before the next case.
     size_t skip, fallthrough = 0;
     bool did_fallthrough = false;
     while (compiler_match(compiler, token_case)) {
-        if (breaks.count > 0) {
-            compiler_emit_byte(compiler, op_pop);
-        }
         compiler_emit_byte(compiler, op_dup);
         compiler_parse_expression(compiler, precedence_none);
         compiler_consume(compiler, token_colon, "expected : after case");
@@ -313,35 +353,30 @@ static void statement_switch(Compiler* compiler) {
         if (compiler_match(compiler, token_fallthrough)) {
             compiler_consume(compiler, token_semicolon, "expected ; after fallthrough");
             did_fallthrough = true;
+            fallthrough = compiler_stub_jump(compiler, op_jump);
         } else {
             size_t jump = compiler_stub_jump(compiler, op_jump);
             value_array_push(&breaks, VALUE_FROM_INT(jump));
         }
         compiler_patch_jump(compiler, skip);
-        if (did_fallthrough) {
-            fallthrough = compiler_stub_jump(compiler, op_jump);
-        }
+        compiler_emit_byte(compiler, op_pop);
+    }
+
+    // No case matched so pop the value; a fallthrough from the last case
+    // lands after this pop, with the stack in the same state.
+    compiler_emit_byte(compiler, op_pop);
+    if (did_fallthrough) {
+        did_fallthrough = false;
+        compiler_patch_jump(compiler, fallthrough);
     }
 
     if (compiler_match(compiler, token_default)) {
-        if (breaks.count > 0) {
-            compiler_emit_byte(compiler, op_pop);
-        }
         compiler_consume(compiler, token_colon, "expected : after default");
-        if (did_fallthrough) {
-            did_fallthrough = false;
-            compiler_patch_jump(compiler, fallthrough);
-        }
         do {
             compiler_parse_statement(compiler);
         } while (!compiler->error && compiler->current_token.type != token_close_brace);
     }
 
-    if (did_fallthrough) {
-        did_fallthrough = false;
-        compiler_patch_jump(compiler, fallthrough);
-    }
-
     for (size_t i = 0; i < breaks.count; ++i) {
         compiler_patch_jump(compiler, VALUE_TO_INT(breaks.items[i]));
     }
@@ -360,6 +395,7 @@ static void statement_while(Compiler* compiler) {
         statement_block(compiler);
         compiler_emit_jump(compiler, predicate);
         compiler_patch_jump(compiler, jump);
+        compiler_emit_byte(compiler, op_pop);
     }
 }
 
@@ -395,10 +431,15 @@ static void statement_function_declaration(Compiler* compiler) {
     Var* var = compiler_declare_var(compiler, name_token, false);
     var->initialized = true;
 
+    // Constants are deduplicated per function since every chunk has its own
+    // values.
     Function* outerFunction = compiler->function;
+    HAMT outer_constants = compiler->constants;
+    hamt_init(&compiler->constants);
     compiler->function = function_new();
-    compiler->function->name = value_copy_string(name_token->start, name_token->length);
     compiler->function->chunk->vm = outerFunction->chunk->vm;
+    compiler->function->name = vm_add_object(compiler->function->chunk->vm,
+        value_copy_string(name_token->start, name_token->length));
     size_t parent_count = compiler_enter_scope(compiler);
     compiler->locals_count += 1;
 
@@ -417,13 +458,16 @@ static void statement_function_declaration(Compiler* compiler) {
     if (compiler->function->chunk->bytes.items[compiler->function->chunk->bytes.count - 1] != op_return) {
         compiler_emit_bytes(compiler, op_nil, op_return);
     }
-    Value function = VALUE_FROM_FUNCTION(compiler->function);
+    compiler_finish_function(compiler, compiler->function->arity + 1);
+    Value function = vm_add_object(compiler->function->chunk->vm, VALUE_FROM_FUNCTION(compiler->function));
 
 #ifdef DEBUG
     chunk_debug(compiler->function->chunk, value_to_cstring(compiler->function->name));
 #endif
 
     compiler_exit_scope(compiler, parent_count);
+    hamt_free(&compiler->constants);
+    compiler->constants = outer_constants;
     compiler->function = outerFunction;
     uint8_t n = chunk_add_constant(compiler->function->chunk, &compiler->constants, function);
     compiler_emit_bytes(compiler, op_constant, n);
@@ -472,8 +516,13 @@ static void statement_return(Compiler* compiler) {
         if (compiler->scopes.count == 1) {
             compiler_error(compiler, &compiler->current_token, "Cannot return a value from a script");
         }
+        compiler->last_call = SIZE_MAX;
         compiler_parse_expression(compiler, precedence_none);
         compiler_consume(compiler, token_semicolon, "expected ; to end print statement");
+        ByteArray* bytes = &compiler->function->chunk->bytes;
+        if (compiler->last_call != SIZE_MAX && compiler->last_call + 2 == bytes->count) {
+            bytes->items[compiler->last_call] = op_tail_call;
+        }
         compiler_emit_byte(compiler, op_return);
     }
 }
@@ -505,17 +554,32 @@ static void nud_string(Compiler* compiler) {
     compiler_string_constant(compiler, &compiler->previous_token);
 }
 
+// "a${x}b${y}c" is a prefix, then expressions separated by infixes, and a
+// suffix. All the parts (but empty strings) are pushed, then concatenated at
+// once by a single instruction that also quotes the values of expressions.
 static void nud_string_prefix(Compiler* compiler) {
-    compiler_string_constant(compiler, &compiler->previous_token);
-    compiler_string_interpolation(compiler);
-}
-
-static void led_string_suffix(Compiler* compiler) {
-    compiler_string_constant(compiler, &compiler->previous_token);
-    compiler_emit_byte(compiler, op_multiply);
-    if (compiler->previous_token.type == token_string_infix) {
-        compiler_string_interpolation(compiler);
+    size_t n = 0;
+    while (true) {
+        Token* token = &compiler->previous_token;
+        if (token->length > compiler_string_trim(token)) {
+            compiler_string_constant(compiler, token);
+            n = compiler_string_part(compiler, n);
+        }
+        if (token->type == token_string_suffix) {
+            break;
+        }
+        if (!compiler_parse_expression(compiler, precedence_interpolation)) {
+            return;
+        }
+        n = compiler_string_part(compiler, n);
+        if (compiler->current_token.type != token_string_infix &&
+            compiler->current_token.type != token_string_suffix) {
+            compiler_error(compiler, &compiler->current_token, "expected a continuing string");
+            return;
+        }
+        compiler_advance(compiler);
     }
+    compiler_emit_bytes(compiler, op_concat, (uint8_t)n);
 }
 
 static void nud_identifier(Compiler* compiler) {
@@ -581,6 +645,7 @@ static void led_call(Compiler* compiler) {
         } while (compiler_match(compiler, token_comma));
     }
     compiler_consume(compiler, token_close_paren, "expected ) after function arguments");
+    compiler->last_call = compiler->function->chunk->bytes.count;
     compiler_emit_bytes(compiler, op_call, arg_count);
 }
 
@@ -656,8 +721,8 @@ Rule rules[] = {
     [token_bar] = { nud_bars, 0, precedence_none },
     [token_string] = { nud_string, 0, precedence_none },
     [token_string_prefix] = { nud_string_prefix, 0, precedence_none },
-    [token_string_infix] = { 0, led_string_suffix, precedence_interpolation },
-    [token_string_suffix] = { 0, led_string_suffix, precedence_interpolation },
+    [token_string_infix] = { 0, 0, precedence_interpolation },
+    [token_string_suffix] = { 0, 0, precedence_interpolation },
     [token_star_star] = { 0, led_right_op, precedence_exponentiation },
     [token_infinity] = { nud_number, 0, precedence_none },
     [token_identifier] = { nud_identifier, 0, precedence_none },
@@ -680,12 +745,14 @@ bool compile_function(const char* source, Function* function) {
     value_array_push(&compiler.scopes, VALUE_FROM_POINTER(&function->chunk->vm->global_scope));
     compiler.locals_count = 0;
     compiler.lexer = &lexer;
+    compiler.last_call = SIZE_MAX;
     compiler.error = false;
     compiler_advance(&compiler);
     do {
         compiler_parse_statement(&compiler);
     } while (!compiler.error && !compiler_match(&compiler, token_eof));
     compiler_emit_byte(&compiler, op_return);
+    compiler_finish_function(&compiler, 0);
     hamt_free(&compiler.constants);
     return !compiler.error;
 }
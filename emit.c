@@ -0,0 +1,307 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "compiler.h"
+#include "emit.h"
+#include "hamt.h"
+#include "vm.h"
+
+// Ahead-of-time compilation of a script to a C program that runs with the
+// macros of aot.h: one C function per Lox function, and one macro per
+// instruction, with a label for every jump target. The program sets up the
+// same globals, functions and constants as the compiler did before running
+// the top-level function.
+
+typedef struct {
+    FILE* output;
+    // All functions, starting with the top-level function; functions are
+    // named after their index in this array.
+    ValueArray functions;
+} Emitter;
+
+static size_t emitter_function_index(Emitter* emitter, Value v) {
+    for (size_t i = 0; i < emitter->functions.count; ++i) {
+        if (VALUE_EQUAL(emitter->functions.items[i], v)) {
+            return i;
+        }
+    }
+    value_array_push(&emitter->functions, v);
+    return emitter->functions.count - 1;
+}
+
+static void emitter_string(Emitter* emitter, Value v) {
+    const char* chars = value_to_cstring(v);
+    size_t length = strlen(chars);
+    fputs("STRING(\"", emitter->output);
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(emitter->output, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            fprintf(emitter->output, "\\%03o", c);
+        } else {
+            fputc(c, emitter->output);
+        }
+    }
+    fprintf(emitter->output, "\", %zu)", length);
+}
+
+static void emitter_value(Emitter* emitter, Value v) {
+    if (VALUE_IS_STRING(v)) {
+        emitter_string(emitter, v);
+    } else if (VALUE_IS_FUNCTION(v) && !VALUE_IS_FOREIGN_FUNCTION(v)) {
+        fprintf(emitter->output, "VALUE_FROM_FUNCTION(functions[%zu])", emitter_function_index(emitter, v));
+    } else if (VALUE_IS_NUMBER(v) && isfinite(v.as_double)) {
+        fprintf(emitter->output, "VALUE_FROM_NUMBER(%.17g)", v.as_double);
+    } else {
+        fprintf(emitter->output, "(Value){ .as_int = 0x%016" PRIx64 " }", v.as_int);
+    }
+}
+
+static size_t emitter_target(uint8_t* bytes, size_t i) {
+    return i + 3 + (int16_t)((bytes[i + 1] << 8) | bytes[i + 2]);
+}
+
+static bool emitter_function(Emitter* emitter, size_t index) {
+    Function* function = VALUE_TO_FUNCTION(emitter->functions.items[index]);
+    Chunk* chunk = function->chunk;
+    uint8_t* bytes = chunk->bytes.items;
+    size_t count = chunk->bytes.count;
+    FILE* output = emitter->output;
+
+    // Register functions that are constants of this one.
+    for (size_t i = 0; i < chunk->values.count; ++i) {
+        Value v = chunk->values.items[i];
+        if (VALUE_IS_FUNCTION(v) && !VALUE_IS_FOREIGN_FUNCTION(v)) {
+            (void)emitter_function_index(emitter, v);
+        }
+    }
+
+    bool* targets = calloc(count, sizeof(bool));
+    for (size_t i = 0; i < count; i += opcode_size(bytes[i])) {
+        switch (bytes[i]) {
+            case op_jump:
+            case op_jump_true:
+            case op_jump_false:
+            case op_pop_jump:
+            case op_jump_false_pop:
+            case op_lt_jump_false:
+            case op_le_jump_false:
+            case op_gt_jump_false:
+            case op_ge_jump_false:
+            case op_lt_jump_false_nn:
+            case op_le_jump_false_nn:
+            case op_gt_jump_false_nn:
+            case op_ge_jump_false_nn:
+                targets[emitter_target(bytes, i)] = true;
+                break;
+        }
+    }
+
+    if (VALUE_IS_NONE(function->name)) {
+        fputs("// Top-level function\n", output);
+    } else {
+        fprintf(output, "// %s/%zu\n", value_to_cstring(function->name), function->arity);
+    }
+    fprintf(output, "static Value* function_%zu(VM* vm, Value* slots, Value* sp) {\n", index);
+
+    bool supported = true;
+    for (size_t i = 0; supported && i < count; i += opcode_size(bytes[i])) {
+        if (targets[i]) {
+            fprintf(output, "l%zu:\n", i);
+        }
+        fputs("    ", output);
+        uint8_t opcode = bytes[i];
+        switch (opcode) {
+            case op_nil: fputs("PUSH(VALUE_NIL);", output); break;
+            case op_zero: fputs("PUSH(VALUE_FROM_NUMBER(0));", output); break;
+            case op_one: fputs("PUSH(VALUE_FROM_NUMBER(1));", output); break;
+            case op_infinity: fputs("PUSH(VALUE_FROM_NUMBER(INFINITY));", output); break;
+            case op_epsilon: fputs("PUSH(VALUE_EPSILON);", output); break;
+            case op_false: fputs("PUSH(VALUE_FALSE);", output); break;
+            case op_true: fputs("PUSH(VALUE_TRUE);", output); break;
+            case op_constant:
+                fprintf(output, "PUSH(constants_%zu[%d]);", index, bytes[i + 1]);
+                break;
+            case op_negate: fputs("NEGATE();", output); break;
+            case op_add:
+            case op_add_nn:
+                fputs("ADD();", output);
+                break;
+            case op_subtract:
+            case op_subtract_nn:
+                fputs("SUBTRACT();", output);
+                break;
+            case op_multiply:
+            case op_multiply_nn:
+            case op_multiply_ss:
+                fputs("MULTIPLY();", output);
+                break;
+            case op_divide:
+            case op_divide_nn:
+                fputs("DIVIDE();", output);
+                break;
+            case op_exponent: fputs("EXPONENT();", output); break;
+            case op_not: fputs("NOT();", output); break;
+            case op_eq: fputs("EQ();", output); break;
+            case op_ne: fputs("NE();", output); break;
+            case op_gt:
+            case op_gt_nn:
+                fputs("GT();", output);
+                break;
+            case op_ge:
+            case op_ge_nn:
+                fputs("GE();", output);
+                break;
+            case op_lt:
+            case op_lt_nn:
+                fputs("LT();", output);
+                break;
+            case op_le:
+            case op_le_nn:
+                fputs("LE();", output);
+                break;
+            case op_bars: fputs("BARS();", output); break;
+            case op_quote: fputs("QUOTE();", output); break;
+            case op_concat: fprintf(output, "CONCAT(%d);", bytes[i + 1]); break;
+            case op_print: fputs("PRINT();", output); break;
+            case op_pop: fputs("DROP();", output); break;
+            case op_pop_2: fputs("DROP(); DROP();", output); break;
+            case op_dup: fputs("DUP();", output); break;
+            case op_define_global: fprintf(output, "DEFINE_GLOBAL(%d);", bytes[i + 1]); break;
+            case op_get_global: fprintf(output, "GET_GLOBAL(%d);", bytes[i + 1]); break;
+            case op_set_global: fprintf(output, "SET_GLOBAL(%d);", bytes[i + 1]); break;
+            case op_get_local: fprintf(output, "GET_LOCAL(%d);", bytes[i + 1]); break;
+            case op_set_local: fprintf(output, "SET_LOCAL(%d);", bytes[i + 1]); break;
+            case op_set_local_pop: fprintf(output, "SET_LOCAL(%d); DROP();", bytes[i + 1]); break;
+            case op_get_local_2:
+                fprintf(output, "GET_LOCAL(%d); GET_LOCAL(%d);", bytes[i + 1], bytes[i + 2]);
+                break;
+            case op_get_local_constant:
+                fprintf(output, "GET_LOCAL(%d); PUSH(constants_%zu[%d]);", bytes[i + 1], index,
+                    bytes[i + 2]);
+                break;
+            case op_jump: fprintf(output, "JUMP(l%zu);", emitter_target(bytes, i)); break;
+            case op_jump_true: fprintf(output, "JUMP_TRUE(l%zu);", emitter_target(bytes, i)); break;
+            case op_jump_false: fprintf(output, "JUMP_FALSE(l%zu);", emitter_target(bytes, i)); break;
+            // Superinstructions are split back into the instructions that
+            // they were fused from; the C compiler fuses them again.
+            case op_pop_jump: fprintf(output, "DROP(); JUMP(l%zu);", emitter_target(bytes, i)); break;
+            case op_jump_false_pop:
+                fprintf(output, "JUMP_FALSE(l%zu); DROP();", emitter_target(bytes, i));
+                break;
+            case op_lt_jump_false:
+            case op_lt_jump_false_nn:
+                fprintf(output, "LT(); JUMP_FALSE(l%zu); DROP();", emitter_target(bytes, i));
+                break;
+            case op_le_jump_false:
+            case op_le_jump_false_nn:
+                fprintf(output, "LE(); JUMP_FALSE(l%zu); DROP();", emitter_target(bytes, i));
+                break;
+            case op_gt_jump_false:
+            case op_gt_jump_false_nn:
+                fprintf(output, "GT(); JUMP_FALSE(l%zu); DROP();", emitter_target(bytes, i));
+                break;
+            case op_ge_jump_false:
+            case op_ge_jump_false_nn:
+                fprintf(output, "GE(); JUMP_FALSE(l%zu); DROP();", emitter_target(bytes, i));
+                break;
+            case op_call: fprintf(output, "CALL(%d);", bytes[i + 1]); break;
+            case op_tail_call: fprintf(output, "TAIL_CALL(%d);", bytes[i + 1]); break;
+            case op_return: fputs(index == 0 ? "END();" : "RETURN();", output); break;
+            case op_nop: fputs(";", output); break;
+            default:
+                supported = false;
+        }
+        fputs("\n", output);
+    }
+    fputs("}\n\n", output);
+    free(targets);
+    return supported;
+}
+
+static bool emit_c(VM* vm, Function* function, FILE* output) {
+    Emitter emitter = { .output = output };
+    value_array_init(&emitter.functions);
+    value_array_push(&emitter.functions, VALUE_FROM_FUNCTION(function));
+
+    fputs("// Generated by relox --emit-c.\n\n#include \"aot.h\"\n\n", output);
+
+    // Functions are found while emitting their callers.
+    bool supported = true;
+    for (size_t i = 0; supported && i < emitter.functions.count; ++i) {
+        Function* f = VALUE_TO_FUNCTION(emitter.functions.items[i]);
+        if (f->chunk->values.count > 0) {
+            fprintf(output, "static Value constants_%zu[%zu];\n\n", i, f->chunk->values.count);
+        }
+        supported = emitter_function(&emitter, i);
+    }
+
+    fputs("int main(void) {\n", output);
+    fputs("    static VM machine;\n", output);
+    fputs("    VM* vm = &machine;\n", output);
+    fputs("    vm->backend = backend_stack;\n", output);
+    fputs("    vm->jit = false;\n", output);
+    fprintf(output, "    vm->frames_max = %zu;\n", vm->frames_max);
+    fputs("    vm_init(vm);\n", output);
+
+    // Foreign functions are already defined by vm_init.
+    for (size_t i = 0; i < vm->globals.count; ++i) {
+        if (VALUE_IS_FOREIGN_FUNCTION(vm->globals.items[i])) {
+            continue;
+        }
+        Value name = vm->global_names.items[i];
+        Var* var = (Var*)VALUE_TO_POINTER(hamt_get(&vm->global_scope, name));
+        fputs("    GLOBAL(", output);
+        emitter_string(&emitter, name);
+        fprintf(output, ", %s);\n", var->mutable ? "true" : "false");
+    }
+
+    fprintf(output, "    Function* functions[%zu];\n", emitter.functions.count);
+    for (size_t i = 0; i < emitter.functions.count; ++i) {
+        Function* f = VALUE_TO_FUNCTION(emitter.functions.items[i]);
+        fprintf(output, "    FUNCTION(functions[%zu], function_%zu, %zu, ", i, i, f->arity);
+        if (VALUE_IS_NONE(f->name)) {
+            fputs("VALUE_NONE", output);
+        } else {
+            emitter_string(&emitter, f->name);
+        }
+        fputs(");\n", output);
+    }
+    for (size_t i = 0; i < emitter.functions.count; ++i) {
+        ValueArray* values = &VALUE_TO_FUNCTION(emitter.functions.items[i])->chunk->values;
+        for (size_t j = 0; j < values->count; ++j) {
+            fprintf(output, "    constants_%zu[%zu] = ", i, j);
+            emitter_value(&emitter, values->items[j]);
+            fputs(";\n", output);
+        }
+        if (values->count > 0) {
+            fprintf(output, "    CONSTANTS(functions[%zu], constants_%zu);\n", i, i);
+        }
+    }
+
+    fputs("    Result result = vm_run_function(vm, functions[0]);\n", output);
+    fputs("    vm_free(vm);\n", output);
+    fputs("    return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;\n", output);
+    fputs("}\n", output);
+
+    value_array_free(&emitter.functions);
+    return supported;
+}
+
+Result vm_compile_and_emit_c(VM* vm, const char* source, FILE* output) {
+    Function* function = function_new();
+    function->chunk->vm = vm;
+    vm->backend = backend_stack;
+    vm_init(vm);
+    if (!compile_function(source, function)) {
+        function_free(function);
+        return result_compile_error;
+    }
+    bool emitted = emit_c(vm, function, output);
+    function_free(function);
+    return emitted ? result_ok : result_compile_error;
+}
@@ -0,0 +1,10 @@
+#ifndef __EMIT_H__
+#define __EMIT_H__
+
+#include <stdio.h>
+
+#include "vm.h"
+
+Result vm_compile_and_emit_c(VM*, const char*, FILE*);
+
+#endif
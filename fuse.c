@@ -0,0 +1,145 @@
+#include <stdlib.h>
+
+#include "array.h"
+#include "fuse.h"
+#include "vm.h"
+
+// Superinstructions replace short sequences of instructions with a single
+// instruction doing the work of the whole sequence, saving dispatches. The
+// sequences were chosen from the most frequent opcode pairs when running the
+// scripts in bench/ with a PROFILE build (get/local followed by constant,
+// set/local by pop, pop by jump, jump/false by pop, &c.)
+//
+// The operands of a superinstruction are the operands of the instructions
+// of the sequence, in order; at most one of these is a jump, and its offset
+// is always last.
+
+typedef struct {
+    uint8_t opcodes[3];
+    size_t count;
+    Opcode fused;
+} Pattern;
+
+// Longer patterns come first so that they are tried first.
+static const Pattern patterns[] = {
+    { { op_lt, op_jump_false, op_pop }, 3, op_lt_jump_false },
+    { { op_le, op_jump_false, op_pop }, 3, op_le_jump_false },
+    { { op_gt, op_jump_false, op_pop }, 3, op_gt_jump_false },
+    { { op_ge, op_jump_false, op_pop }, 3, op_ge_jump_false },
+    { { op_get_local, op_get_local }, 2, op_get_local_2 },
+    { { op_get_local, op_constant }, 2, op_get_local_constant },
+    { { op_set_local, op_pop }, 2, op_set_local_pop },
+    { { op_pop, op_pop }, 2, op_pop_2 },
+    { { op_pop, op_jump }, 2, op_pop_jump },
+    { { op_jump_false, op_pop }, 2, op_jump_false_pop },
+};
+
+#define PATTERNS_COUNT (sizeof(patterns) / sizeof(Pattern))
+
+static bool is_jump(uint8_t opcode) {
+    return opcode == op_jump || opcode == op_jump_true || opcode == op_jump_false;
+}
+
+static size_t jump_target(uint8_t* bytes, size_t i) {
+    size_t next = i + opcode_size(bytes[i]);
+    return next + (int16_t)((bytes[next - 2] << 8) | bytes[next - 1]);
+}
+
+// Match a pattern at i; none of the instructions but the first may be the
+// target of a jump. Return the size of the matched sequence or 0.
+static size_t pattern_match(const Pattern* pattern, uint8_t* bytes, size_t count, bool* targets,
+    size_t i) {
+    size_t j = i;
+    for (size_t k = 0; k < pattern->count; ++k) {
+        if (j >= count || bytes[j] != pattern->opcodes[k] || (k > 0 && targets[j])) {
+            return 0;
+        }
+        j += opcode_size(bytes[j]);
+    }
+    return j - i;
+}
+
+// Rewrite the bytes of the chunk, fusing sequences of instructions into
+// superinstructions. Jump offsets are fixed after rewriting since the code
+// gets shorter; the line of a superinstruction is that of its first
+// instruction.
+void chunk_fuse(Chunk* chunk) {
+    uint8_t* bytes = chunk->bytes.items;
+    size_t count = chunk->bytes.count;
+
+    // Line of every byte, and targets of all jumps.
+    size_t* lines = malloc(count * sizeof(size_t));
+    for (size_t i = 0, j = 0; j < chunk->line_numbers.count; j += 2) {
+        for (size_t k = 0; k < chunk->line_numbers.items[j + 1]; ++k) {
+            lines[i++] = chunk->line_numbers.items[j];
+        }
+    }
+    bool* targets = calloc(count + 1, sizeof(bool));
+    for (size_t i = 0; i < count; i += opcode_size(bytes[i])) {
+        if (is_jump(bytes[i])) {
+            targets[jump_target(bytes, i)] = true;
+        }
+    }
+
+    // New position of every instruction, and jumps to fix as pairs of (new
+    // position of the offset, original target).
+    size_t* positions = malloc((count + 1) * sizeof(size_t));
+    NumberArray jumps;
+    number_array_init(&jumps);
+    ByteArray fused;
+    byte_array_init(&fused);
+    NumberArray fused_lines;
+    number_array_init(&fused_lines);
+
+    for (size_t i = 0; i < count;) {
+        size_t size = 0;
+        const Pattern* pattern = 0;
+        for (size_t p = 0; p < PATTERNS_COUNT && size == 0; ++p) {
+            pattern = &patterns[p];
+            size = pattern_match(pattern, bytes, count, targets, i);
+        }
+        positions[i] = fused.count;
+        if (size > 0) {
+            byte_array_push(&fused, pattern->fused);
+            number_array_push(&fused_lines, lines[i]);
+        } else {
+            pattern = 0;
+            size = opcode_size(bytes[i]);
+        }
+        for (size_t j = i; j < i + size; j += opcode_size(bytes[j])) {
+            positions[j] = positions[i];
+            size_t n = opcode_size(bytes[j]);
+            for (size_t k = pattern ? 1 : 0; k < n; ++k) {
+                byte_array_push(&fused, bytes[j + k]);
+                number_array_push(&fused_lines, lines[i]);
+            }
+            if (is_jump(bytes[j])) {
+                number_array_push(&jumps, fused.count - 2);
+                number_array_push(&jumps, jump_target(bytes, j));
+            }
+        }
+        i += size;
+    }
+    positions[count] = fused.count;
+
+    for (size_t j = 0; j < jumps.count; j += 2) {
+        size_t at = jumps.items[j];
+        ptrdiff_t offset = positions[jumps.items[j + 1]] - (at + 2);
+        fused.items[at] = (uint8_t)(offset >> 8);
+        fused.items[at + 1] = (uint8_t)offset;
+    }
+
+    // Replace the bytes and line numbers of the chunk.
+    byte_array_free(&chunk->bytes);
+    number_array_free(&chunk->line_numbers);
+    for (size_t i = 0; i < fused.count; ++i) {
+        chunk_add_byte(chunk, fused.items[i], fused_lines.items[i]);
+    }
+
+    byte_array_free(&fused);
+    number_array_free(&fused_lines);
+    number_array_free(&jumps);
+    free(positions);
+    free(targets);
+    free(lines);
+}
@@ -0,0 +1,8 @@
+#ifndef __FUSE_H__
+#define __FUSE_H__
+
+#include "vm.h"
+
+void chunk_fuse(Chunk*);
+
+#endif
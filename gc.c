@@ -0,0 +1,305 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gc.h"
+#include "hamt.h"
+#include "intern.h"
+
+// A precise mark-and-sweep collector for the objects of the VM (long strings,
+// functions and vars), which are all kept in vm->objects. Collections only
+// happen while a script is running, when a new object is added (see
+// vm_add_object), so the compiler has no roots of its own; the roots are the
+// stack up to vm->sp (with the register backend, registers that the current
+// frame has not written yet are nil, see vm_run_registers), the globals, the
+// global scope, and the functions of the frames. A function marks its name
+// and its constants, which include the functions that it defines.
+//
+// The string table used for interning does not keep strings alive: the strings
+// that were not marked are removed from it before the sweep.
+//
+// Strings made while running start out in the nursery, a bump allocated
+// buffer (see string_new), and are not objects of the VM yet. Once the
+// nursery is full, a minor collection promotes the nursery strings that are
+// still reachable to the heap, where they are interned (other strings made
+// while running are not, see vm_add_object), and empties it. Only the stack,
+// the globals and the ropes and slices made since the last minor collection
+// can refer to these strings (other objects in the heap are made by the
+// compiler and never refer to strings made later), so these are the only
+// roots of a minor collection, and they are updated in place.
+
+void gc_init(VM* vm) {
+    vm->gc = (GC){ .heap_next = GC_HEAP_MIN };
+    vm->nursery.start = malloc(GC_NURSERY_SIZE);
+    vm->nursery.top = vm->nursery.start;
+    vm->nursery.end = vm->nursery.start + GC_NURSERY_SIZE;
+    vm->nursery.full = false;
+}
+
+void gc_free(VM* vm) {
+    free(vm->nursery.start);
+}
+
+// Size of an object in the heap; values that are not objects have no size.
+size_t gc_object_size(Value v) {
+    if (VALUE_IS_STRING(v)) {
+        // The characters of a rope or a slice are not counted, since they are
+        // only copied later (if ever).
+        return VALUE_IS_EPSILON(v) || VALUE_IS_SHORT_STRING(v) ? 0 :
+            VALUE_TO_STRING(v)->rope ? sizeof(Rope) : VALUE_TO_STRING(v)->slice ? sizeof(Slice) :
+            sizeof(String) + VALUE_TO_STRING(v)->length + 1;
+    }
+    if (VALUE_IS_FUNCTION(v)) {
+        return VALUE_IS_FOREIGN_FUNCTION(v) ? 0 : sizeof(Function) + sizeof(Chunk);
+    }
+    return VALUE_IS_POINTER(v) ? sizeof(Var) : 0;
+}
+
+// Keep track of a new object in the heap, which the collector can then free.
+void gc_track(VM* vm, Value v) {
+    value_array_push(&vm->objects, v);
+    vm->gc.objects_allocated += 1;
+    vm->gc.heap_size += gc_object_size(v);
+    if (vm->gc.heap_size > vm->gc.heap_peak) {
+        vm->gc.heap_peak = vm->gc.heap_size;
+    }
+}
+
+static double gc_time_since(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void gc_pause(VM* vm, double pause) {
+    vm->gc.pause_total += pause;
+    if (pause > vm->gc.pause_max) {
+        vm->gc.pause_max = pause;
+    }
+}
+
+// Move a string from the nursery to the heap, or to the equal string that is
+// already interned (which may have just been promoted from the same string.)
+static Value gc_promote(VM* vm, Value v) {
+    if (!VALUE_IS_STRING(v) || VALUE_IS_EPSILON(v) || VALUE_IS_SHORT_STRING(v) ||
+        !NURSERY_CONTAINS(&vm->nursery, VALUE_TO_STRING(v))) {
+        return v;
+    }
+    String* string = VALUE_TO_STRING(v);
+    Value interned = intern_get(&vm->strings, string);
+    if (VALUE_IS_STRING(interned)) {
+        return interned;
+    }
+    size_t size = sizeof(String) + string->length + 1;
+    String* promoted = malloc(size);
+    memcpy(promoted, string, size);
+    promoted->marked = false;
+    Value w = VALUE_FROM_STRING(promoted);
+    intern_add(&vm->strings, w);
+    gc_track(vm, w);
+    vm->gc.promoted_bytes += size;
+    return w;
+}
+
+// Minor collection, keeping v alive; return v, which may have been promoted.
+Value gc_collect_nursery(VM* vm, Value v) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Ropes and slices are the only objects in the heap that can refer to
+    // strings in the nursery, if they were made since the last minor
+    // collection.
+    for (size_t i = 0; i < vm->remembered.count; ++i) {
+        Rope* rope = (Rope*)VALUE_TO_STRING(vm->remembered.items[i]);
+        if (rope->rope) {
+            rope->left = gc_promote(vm, rope->left);
+            rope->right = gc_promote(vm, rope->right);
+        }
+    }
+    v = gc_promote(vm, v);
+    for (Value* sp = vm->stack; sp < vm->sp; ++sp) {
+        *sp = gc_promote(vm, *sp);
+    }
+    for (size_t i = 0; i < vm->globals.count; ++i) {
+        vm->globals.items[i] = gc_promote(vm, vm->globals.items[i]);
+    }
+    // The parent of a slice is not promoted for it, since the slice may well
+    // be garbage already: if the parent was not promoted as part of something
+    // else, the slice gets its own characters, which are fewer.
+    for (size_t i = 0; i < vm->remembered.count; ++i) {
+        Slice* slice = (Slice*)VALUE_TO_STRING(vm->remembered.items[i]);
+        if (slice->slice && !slice->chars && NURSERY_CONTAINS(&vm->nursery, VALUE_TO_STRING(slice->parent))) {
+            Value promoted = intern_get(&vm->strings, VALUE_TO_STRING(slice->parent));
+            if (VALUE_IS_STRING(promoted)) {
+                slice->parent = promoted;
+            } else {
+                string_chars((String*)slice);
+            }
+        }
+    }
+    vm->remembered.count = 0;
+    vm->gc.nursery_bytes += vm->nursery.top - vm->nursery.start;
+    vm->nursery.top = vm->nursery.start;
+    vm->nursery.full = false;
+
+    double pause = gc_time_since(&start);
+    vm->gc.minor_collections += 1;
+    gc_pause(vm, pause);
+#ifdef DEBUG
+    fprintf(stderr, "--- gc_collect_nursery() heap: %zu bytes, pause: %.3f ms\n", vm->gc.heap_size, pause * 1e3);
+#endif
+    return v;
+}
+
+static void gc_mark(Value);
+
+static void gc_mark_function(Function* f) {
+    if (f->marked) {
+        return;
+    }
+    f->marked = true;
+    gc_mark(f->name);
+    for (size_t i = 0; i < f->chunk->values.count; ++i) {
+        gc_mark(f->chunk->values.items[i]);
+    }
+}
+
+// Mark a string and the parts of a rope, going down the deeper part in a loop
+// (like value_string_write.) The parent of a slice is not marked (see
+// gc_detach_slice).
+static void gc_mark_string(Value v) {
+    // Strings from a HAMT file are always marked, and read-only (see
+    // hamt_file_write).
+    while (!VALUE_IS_EPSILON(v) && !VALUE_IS_SHORT_STRING(v) && !VALUE_TO_STRING(v)->marked) {
+        VALUE_TO_STRING(v)->marked = true;
+        if (STRING_DEPTH(v) == 0) {
+            return;
+        }
+        Rope* rope = (Rope*)VALUE_TO_STRING(v);
+        if (STRING_DEPTH(rope->left) < STRING_DEPTH(rope->right)) {
+            gc_mark_string(rope->left);
+            v = rope->right;
+        } else {
+            gc_mark_string(rope->right);
+            v = rope->left;
+        }
+    }
+}
+
+static void gc_mark(Value v) {
+    if (VALUE_IS_STRING(v)) {
+        gc_mark_string(v);
+    } else if (VALUE_IS_FUNCTION(v)) {
+        if (!VALUE_IS_FOREIGN_FUNCTION(v)) {
+            gc_mark_function(VALUE_TO_FUNCTION(v));
+        }
+    } else if (VALUE_IS_POINTER(v)) {
+        ((Var*)VALUE_TO_POINTER(v))->marked = true;
+    }
+}
+
+static void gc_mark_entry(Value key, Value value, void* unused) {
+    gc_mark(key);
+    gc_mark(value);
+}
+
+// Once everything that is reachable is marked, a slice whose parent is not
+// gets its own characters, before the parent is freed.
+static void gc_detach_slice(Value v) {
+    if (!VALUE_IS_STRING(v) || VALUE_IS_EPSILON(v) || VALUE_IS_SHORT_STRING(v) || !VALUE_TO_STRING(v)->slice) {
+        return;
+    }
+    Slice* slice = (Slice*)VALUE_TO_STRING(v);
+    if (slice->marked && !slice->chars && !VALUE_TO_STRING(slice->parent)->marked) {
+        string_chars((String*)slice);
+    }
+}
+
+// Clear the mark of an object, returning whether it was set.
+static bool gc_unmark(Value v) {
+    bool* marked = VALUE_IS_STRING(v) ? &VALUE_TO_STRING(v)->marked :
+        VALUE_IS_FUNCTION(v) ? &VALUE_TO_FUNCTION(v)->marked : &((Var*)VALUE_TO_POINTER(v))->marked;
+    bool was_marked = *marked;
+    *marked = false;
+    return was_marked;
+}
+
+// Free the objects that were not marked, keeping the others in order.
+static void gc_sweep(VM* vm) {
+    size_t j = 0;
+    for (size_t i = 0; i < vm->objects.count; ++i) {
+        Value v = vm->objects.items[i];
+        if (gc_unmark(v)) {
+            vm->objects.items[j++] = v;
+            continue;
+        }
+        size_t size = gc_object_size(v);
+        vm->gc.heap_size -= size;
+        vm->gc.bytes_freed += size;
+        vm->gc.objects_freed += 1;
+        value_free_object(v);
+    }
+    vm->objects.count = j;
+}
+
+// Collect garbage, keeping v (a new object that is not yet reachable) alive.
+void gc_collect(VM* vm, Value v) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    gc_mark(v);
+    for (Value* sp = vm->stack; sp < vm->sp; ++sp) {
+        gc_mark(*sp);
+    }
+    for (size_t i = 0; i < vm->globals.count; ++i) {
+        gc_mark(vm->globals.items[i]);
+    }
+    hamt_each(&vm->global_scope, gc_mark_entry, 0);
+    for (size_t i = 0; i < vm->frame_count; ++i) {
+        gc_mark_function(vm->frames[i].function);
+    }
+    gc_detach_slice(v);
+    for (size_t i = 0; i < vm->objects.count; ++i) {
+        gc_detach_slice(vm->objects.items[i]);
+    }
+    // Ropes and slices that are about to be freed are forgotten.
+    size_t j = 0;
+    for (size_t i = 0; i < vm->remembered.count; ++i) {
+        if (VALUE_TO_STRING(vm->remembered.items[i])->marked) {
+            vm->remembered.items[j++] = vm->remembered.items[i];
+        }
+    }
+    vm->remembered.count = j;
+    intern_sweep(&vm->strings);
+    gc_sweep(vm);
+    // The top-level function is not an object of the VM, and neither is v yet,
+    // so they are not swept; a rope that stayed marked would hide its parts
+    // from the next collection.
+    vm->frames[0].function->marked = false;
+    if (gc_object_size(v) > 0) {
+        gc_unmark(v);
+    }
+
+    double pause = gc_time_since(&start);
+    vm->gc.collections += 1;
+    gc_pause(vm, pause);
+    vm->gc.heap_next = vm->gc.heap_size * GC_HEAP_GROWTH;
+    if (vm->gc.heap_next < GC_HEAP_MIN) {
+        vm->gc.heap_next = GC_HEAP_MIN;
+    }
+#ifdef DEBUG
+    fprintf(stderr, "--- gc_collect() heap: %zu bytes, next collection at %zu bytes, pause: %.3f ms\n",
+        vm->gc.heap_size, vm->gc.heap_next, pause * 1e3);
+#endif
+}
+
+void gc_report(VM* vm, FILE* stream) {
+    GC* gc = &vm->gc;
+    fprintf(stream, "GC: %zu collections, allocated %zu objects, freed %zu objects (%zu bytes); "
+        "heap: %zu bytes (peak: %zu bytes)\n", gc->collections, gc->objects_allocated, gc->objects_freed,
+        gc->bytes_freed, gc->heap_size, gc->heap_peak);
+    fprintf(stream, "GC: %zu minor collections, nursery: %zu bytes, promoted: %zu bytes; "
+        "pauses: %.3f ms (max: %.3f ms)\n", gc->minor_collections,
+        gc->nursery_bytes + (vm->nursery.top - vm->nursery.start), gc->promoted_bytes,
+        gc->pause_total * 1e3, gc->pause_max * 1e3);
+}
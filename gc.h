@@ -0,0 +1,24 @@
+#ifndef __GC_H__
+#define __GC_H__
+
+#include <stdio.h>
+
+#include "vm.h"
+
+// Collect garbage once the heap has grown past GC_HEAP_GROWTH times its size
+// after the last collection, and never below GC_HEAP_MIN bytes.
+#define GC_HEAP_MIN (1 << 20)
+#define GC_HEAP_GROWTH 2
+
+// Size of the nursery for new strings, in bytes (see string_new).
+#define GC_NURSERY_SIZE (256 << 10)
+
+void gc_init(VM*);
+size_t gc_object_size(Value);
+void gc_track(VM*, Value);
+Value gc_collect_nursery(VM*, Value);
+void gc_collect(VM*, Value);
+void gc_report(VM*, FILE*);
+void gc_free(VM*);
+
+#endif
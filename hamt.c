@@ -1,297 +1,1336 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "hamt.h"
 
-// Initialize the HAMT.
+// A map starts with a header holding its bitmaps (an entry and a sub-map cannot
+// have the same bit), followed by its entries in the order of their bits, then
+// by pointers to its sub-maps in the order of their bits. A collision bucket
+// has a count of entries instead of an entry bitmap and no sub-maps; there is
+// nothing in the bucket itself to tell it from a map, but buckets are always
+// found past the last bits of the hash (shift >= 64).
+//
+// Maps are allocated from a pool with a free list for every size class (room
+// for 2, 3, 4, 6, 8, 12, 16, 24, 32, 48 and 64 words, a word being the size of
+// a Value: an entry takes two words and a sub-map one), and are carved out of
+// larger slabs when the free list is empty. A map gets the smallest class that
+// fits, so some insertions can happen in place, and no more than a third of a
+// map is wasted (larger maps, for collision buckets and the root, are simply
+// malloc'ed). Maps are shared between persistent HAMTs (see hamt_transient)
+// and are reference counted; the reference counts become atomic once versions
+// of a HAMT are shared between threads (see hamt_shared_init). Every thread has
+// its own pool, shared by all HAMTs (a map can go back to the pool of another
+// thread than the one that allocated it), and slabs are kept for the life of
+// the process.
+#define HAMT_SIZE_CLASSES 11
+#define HAMT_SLAB_SIZE (64 << 10)
+
+typedef struct HAMTMap {
+    union {
+        struct {
+            uint32_t datamap;
+            uint32_t nodemap;
+        };
+        uint32_t count;
+        struct HAMTMap* next;
+    };
+    uint32_t refcount;
+    uint32_t size_class;
+    HAMTNode entries[];
+} HAMTMap;
+
+static _Thread_local struct {
+    HAMTMap* free_lists[HAMT_SIZE_CLASSES];
+    char* slab;
+    char* slab_end;
+    void* slabs;
+} hamt_pool;
+
+#define HAMT_MAP(p) ((HAMTMap*)((char*)(p) - offsetof(HAMTMap, entries)))
+
+// Number of words that fit in a map of a size class (even classes are powers of
+// two, and odd classes halfway between).
+#define HAMT_CLASS_WORDS(size_class) ((size_t)((size_class) & 1 ? 3 : 2) << ((size_class) >> 1))
+
+// Get a new map with room for at least n words, with a reference count of 1 and
+// empty bitmaps.
+static HAMTMap* hamt_map_new(size_t n) {
+    // For 2^k < n <= 2^(k+1), the class is 2k, or 2k - 1 if n fits in 3 * 2^(k-1).
+    uint32_t k = n <= 2 ? 0 : 63 - __builtin_clzll(n - 1);
+    uint32_t size_class = n <= 2 ? 0 : n <= (size_t)3 << (k - 1) ? 2 * k - 1 : 2 * k;
+    size_t size = sizeof(HAMTMap) + HAMT_CLASS_WORDS(size_class) * sizeof(Value);
+    HAMTMap* map = size_class < HAMT_SIZE_CLASSES ? hamt_pool.free_lists[size_class] : malloc(size);
+    if (size_class >= HAMT_SIZE_CLASSES) {
+        // Not from the pool.
+    } else if (map) {
+        hamt_pool.free_lists[size_class] = map->next;
+    } else {
+        if ((size_t)(hamt_pool.slab_end - hamt_pool.slab) < size) {
+            // The previous slab is linked from the start of the new one.
+            void** slab = malloc(HAMT_SLAB_SIZE);
+            *slab = hamt_pool.slabs;
+            hamt_pool.slabs = slab;
+            hamt_pool.slab = (char*)slab + sizeof(HAMTMap);
+            hamt_pool.slab_end = (char*)slab + HAMT_SLAB_SIZE;
+        }
+        map = (HAMTMap*)hamt_pool.slab;
+        hamt_pool.slab += size;
+    }
+    map->datamap = 0;
+    map->nodemap = 0;
+    map->refcount = 1;
+    map->size_class = size_class;
+    return map;
+}
+
+// Number of bytes that fit in a map.
+static size_t hamt_map_capacity(HAMTMap* map) {
+    return HAMT_CLASS_WORDS(map->size_class) * sizeof(Value);
+}
+
+// Return a map to the pool (its sub-maps are not released).
+static void hamt_map_release(HAMTMap* map) {
+    if (map->size_class >= HAMT_SIZE_CLASSES) {
+        free(map);
+        return;
+    }
+    map->next = hamt_pool.free_lists[map->size_class];
+    hamt_pool.free_lists[map->size_class] = map;
+}
+
+// Number of entries of a map, or of a collision bucket.
+static size_t hamt_map_count(HAMTMap* map, uint32_t shift) {
+    return shift >= 64 ? map->count : (size_t)__builtin_popcount(map->datamap);
+}
+
+// Number of bytes used by the entries and sub-maps of a map.
+static size_t hamt_map_size(HAMTMap* map, uint32_t shift) {
+    return hamt_map_count(map, shift) * sizeof(HAMTNode) + __builtin_popcount(map->nodemap) * sizeof(HAMTMap*);
+}
+
+// The sub-maps of a map, after its entries.
+static HAMTMap** hamt_map_nodes(HAMTMap* map) {
+    return (HAMTMap**)(map->entries + __builtin_popcount(map->datamap));
+}
+
+// The entry or the sub-map of a map for a bit, if any. The position in the
+// entries or the sub-maps is the popcount of the bits up to the bit in the
+// bitmap; bit - 1 turns a bit like 00100000 into a mask like 00011111.
+static HAMTNode* hamt_map_entry(HAMTMap* map, uint32_t bit) {
+    return map->datamap & bit ? &map->entries[__builtin_popcount(map->datamap & (bit - 1))] : 0;
+}
+
+static HAMTMap* hamt_map_node(HAMTMap* map, uint32_t bit) {
+    return map->nodemap & bit ? hamt_map_nodes(map)[__builtin_popcount(map->nodemap & (bit - 1))] : 0;
+}
+
+// The bit for the next 5 bits of a hash from shift.
+#define HAMT_BIT(hash, shift) ((uint32_t)1 << (((hash) >> (shift)) & 0x1f))
+
+// Open a gap of size bytes at offset in a map using used bytes, moving it to a
+// larger map if it does not fit; return the map.
+static HAMTMap* hamt_map_open(HAMTMap* map, size_t used, size_t offset, size_t size) {
+    char* bytes = (char*)map->entries;
+    if (used + size <= hamt_map_capacity(map)) {
+        memmove(bytes + offset + size, bytes + offset, used - offset);
+        return map;
+    }
+    HAMTMap* newm = hamt_map_new((used + size) / sizeof(Value));
+    newm->datamap = map->datamap;
+    newm->nodemap = map->nodemap;
+    memcpy(newm->entries, bytes, offset);
+    memcpy((char*)newm->entries + offset + size, bytes + offset, used - offset);
+    hamt_map_release(map);
+    return newm;
+}
+
+// Close a gap of size bytes at offset in a map using used bytes.
+static void hamt_map_close(HAMTMap* map, size_t used, size_t offset, size_t size) {
+    char* bytes = (char*)map->entries;
+    memmove(bytes + offset, bytes + offset + size, used - offset - size);
+}
+
+static bool hamt_atomic;
+
+// Share a map with another parent.
+static void hamt_map_retain(HAMTMap* map) {
+    if (hamt_atomic) {
+        __atomic_add_fetch(&map->refcount, 1, __ATOMIC_RELAXED);
+    } else {
+        map->refcount += 1;
+    }
+}
+
+static void hamt_map_free(HAMTMap*);
+
+// Make sure that a map is not shared before it is updated in place, copying it
+// if necessary (and sharing its sub-maps with the copy).
+static void hamt_own(HAMTMap** map, uint32_t shift) {
+    if (__atomic_load_n(&(*map)->refcount, __ATOMIC_ACQUIRE) == 1) {
+        return;
+    }
+    size_t size = hamt_map_size(*map, shift);
+    HAMTMap* newm = hamt_map_new(size / sizeof(Value));
+    newm->datamap = (*map)->datamap;
+    newm->nodemap = (*map)->nodemap;
+    memcpy(newm->entries, (*map)->entries, size);
+    HAMTMap** nodes = hamt_map_nodes(newm);
+    for (int i = 0; i < __builtin_popcount(newm->nodemap); ++i) {
+        hamt_map_retain(nodes[i]);
+    }
+    // The original may have stopped being shared in the meantime.
+    hamt_map_free(*map);
+    *map = newm;
+}
+
+// Share the map of a slot of the root, if any.
+static void hamt_retain(HAMTNode* slot) {
+    if (VALUE_IS_HAMT_NODE(slot->key)) {
+        hamt_map_retain(slot->content.map);
+    }
+}
+
+// Initialize the HAMT. The root is only allocated with the first entry.
 void hamt_init(HAMT* hamt) {
     hamt->count = 0;
-    hamt->root.key = VALUE_HAMT_NODE;
-    hamt->root.content.nodes = 0;
-    hamt->root.refcount = 1;
+    hamt->root_bits = HAMT_ROOT_BITS_MIN;
+    hamt->root = 0;
+}
+
+// A new root with all its slots empty.
+static HAMTNode* hamt_root_new(uint32_t root_bits) {
+    size_t n = (size_t)1 << root_bits;
+    HAMTNode* root = hamt_map_new(n * sizeof(HAMTNode) / sizeof(Value))->entries;
+    for (size_t i = 0; i < n; ++i) {
+        root[i].key = VALUE_NONE;
+    }
+    return root;
+}
+
+// The slot of the root for a hash, using its lowest bits.
+#define HAMT_SLOT(hamt, hash) (&(hamt)->root[(hash) & (((uint64_t)1 << (hamt)->root_bits) - 1)])
+
+// Find the entry for a key in a collision bucket.
+static HAMTNode* hamt_bucket_find(HAMTMap* bucket, Value key) {
+    for (size_t i = 0; i < bucket->count; ++i) {
+        if (VALUE_EQUAL(bucket->entries[i].key, key)) {
+            return &bucket->entries[i];
+        }
+    }
+    return 0;
+}
+
+// Find the entry for a key under a map, using the hash of the key from shift.
+static HAMTNode* hamt_map_find(HAMTMap* map, Value key, uint64_t hash, uint32_t shift) {
+    for (; ; shift += 5) {
+        if (shift >= 64) {
+            return hamt_bucket_find(map, key);
+        }
+        uint32_t bit = HAMT_BIT(hash, shift);
+        if (map->datamap & bit) {
+            // There is an entry for these bits, so if the keys match then it
+            // was found.
+            HAMTNode* entry = hamt_map_entry(map, bit);
+            return VALUE_EQUAL(entry->key, key) ? entry : 0;
+        }
+        if ((map->nodemap & bit) == 0) {
+            // Neither bit is set so the key is not present in the trie.
+            return 0;
+        }
+        // Keep going down with the next 5 bits of the hash.
+        map = hamt_map_node(map, bit);
+    }
+}
+
+// Find the entry for a key in the HAMT, if any.
+static HAMTNode* hamt_find(HAMT* hamt, Value key) {
+    if (!hamt->root) {
+        return 0;
+    }
+    uint64_t hash = value_hash(key);
+    HAMTNode* slot = HAMT_SLOT(hamt, hash);
+    if (VALUE_IS_HAMT_NODE(slot->key)) {
+        return hamt_map_find(slot->content.map, key, hash, hamt->root_bits);
+    }
+    // This is an entry (or an empty slot), so if the keys match then it was
+    // found.
+    return VALUE_EQUAL(slot->key, key) ? slot : 0;
 }
 
 // Get the value for a key from the HAMT; return VALUE_NONE if it was not found.
-// TODO handle hash collisions.
 Value hamt_get(HAMT* hamt, Value key) {
-    uint32_t hash = value_hash(key);
-    HAMTNode node = hamt->root;
-    for (size_t i = 0; i < 6; ++i) {
-        // Get 5 bits of hash and make a mask for the position in the bitmap.
-        uint32_t mask = 1 << (hash & 0x1f);
-        uint32_t bitmap = VALUE_TO_HAMT_NODE_BITMAP(node.key);
-        if ((bitmap & mask) == 0) {
-            // The bit is 0 so the key is not present in the trie.
-            return VALUE_NONE;
+    HAMTNode* entry = hamt_find(hamt, key);
+    return entry ? entry->content.value : VALUE_NONE;
+}
+
+// Get the values for n keys at once (VALUE_NONE for keys that were not found),
+// walking down the trie with HAMT_GET_MANY keys at a time: at every level, the
+// next map of every key is prefetched before any of them is read, so that the
+// cache misses of these keys overlap instead of happening one after the other.
+#define HAMT_GET_MANY 16
+
+void hamt_get_many(HAMT* hamt, size_t n, const Value* keys, Value* values) {
+    if (!hamt->root) {
+        for (size_t i = 0; i < n; ++i) {
+            values[i] = VALUE_NONE;
         }
-        // Get the position in the map from the popcount of the bits up to
-        // the position of the hash value. mask - 1 turns a mask like
-        // 00100000 into 00011111.
-        size_t j = __builtin_popcount(bitmap & (mask - 1));
-        node = node.content.nodes[j];
-        if (!VALUE_IS_HAMT_NODE(node.key)) {
-            // This is an entry, so if the keys match then a value was found.
-            return VALUE_EQUAL(node.key, key) ? node.content.value : VALUE_NONE;
+        return;
+    }
+    for (; n > 0; ) {
+        size_t m = n < HAMT_GET_MANY ? n : HAMT_GET_MANY;
+        uint64_t hashes[HAMT_GET_MANY];
+        HAMTMap* maps[HAMT_GET_MANY];
+        for (size_t i = 0; i < m; ++i) {
+            hashes[i] = value_hash(keys[i]);
+            __builtin_prefetch(HAMT_SLOT(hamt, hashes[i]));
         }
-        // Keep going down with the next 5 bits of the hash.
-        hash >>= 5;
+        // Keys that are still going down, as bits.
+        uint32_t pending = 0;
+        for (size_t i = 0; i < m; ++i) {
+            HAMTNode* slot = HAMT_SLOT(hamt, hashes[i]);
+            if (VALUE_IS_HAMT_NODE(slot->key)) {
+                maps[i] = slot->content.map;
+                __builtin_prefetch(maps[i]);
+                pending |= 1 << i;
+            } else {
+                values[i] = VALUE_EQUAL(slot->key, keys[i]) ? slot->content.value : VALUE_NONE;
+            }
+        }
+        for (uint32_t shift = hamt->root_bits; pending; shift += 5) {
+            for (uint32_t p = pending; p; p &= p - 1) {
+                int i = __builtin_ctz(p);
+                HAMTNode* entry;
+                if (shift >= 64) {
+                    entry = hamt_bucket_find(maps[i], keys[i]);
+                } else {
+                    uint32_t bit = HAMT_BIT(hashes[i], shift);
+                    if (maps[i]->nodemap & bit) {
+                        maps[i] = hamt_map_node(maps[i], bit);
+                        __builtin_prefetch(maps[i]);
+                        continue;
+                    }
+                    entry = hamt_map_entry(maps[i], bit);
+                    entry = entry && VALUE_EQUAL(entry->key, keys[i]) ? entry : 0;
+                }
+                values[i] = entry ? entry->content.value : VALUE_NONE;
+                pending &= ~(1 << i);
+            }
+        }
+        keys += m;
+        values += m;
+        n -= m;
     }
-    return VALUE_NONE;
 }
 
 // Get the value for a string from the trie (comparing the actual strings and
 // not just the value; this is used for string interning before a new string
 // is added).
 Value hamt_get_string(HAMT* hamt, String* string) {
-    uint32_t hash = string->hash;
-    HAMTNode node = hamt->root;
-    for (size_t i = 0; i < 6; ++i) {
-        uint32_t mask = 1 << (hash & 0x1f);
-        uint32_t bitmap = VALUE_TO_HAMT_NODE_BITMAP(node.key);
-        if ((bitmap & mask) == 0) {
+    if (!hamt->root) {
+        return VALUE_NONE;
+    }
+    uint64_t hash = string_hash(string);
+    HAMTNode* slot = HAMT_SLOT(hamt, hash);
+    if (VALUE_IS_NONE(slot->key)) {
+        return VALUE_NONE;
+    }
+    if (!VALUE_IS_HAMT_NODE(slot->key)) {
+        return string_equal(VALUE_TO_STRING(slot->content.value), string) ? slot->content.value : VALUE_NONE;
+    }
+    HAMTMap* map = slot->content.map;
+    for (uint32_t shift = hamt->root_bits; ; shift += 5) {
+        if (shift >= 64) {
+            for (size_t i = 0; i < map->count; ++i) {
+                if (string_equal(VALUE_TO_STRING(map->entries[i].content.value), string)) {
+                    return map->entries[i].content.value;
+                }
+            }
             return VALUE_NONE;
         }
-        size_t j = __builtin_popcount(bitmap & (mask - 1));
-        node = node.content.nodes[j];
-        if (!VALUE_IS_HAMT_NODE(node.key)) {
-            return string_equal(VALUE_TO_STRING(node.content.value), string) ?
-                node.content.value : VALUE_NONE;
+        uint32_t bit = HAMT_BIT(hash, shift);
+        if (map->datamap & bit) {
+            Value value = hamt_map_entry(map, bit)->content.value;
+            return string_equal(VALUE_TO_STRING(value), string) ? value : VALUE_NONE;
         }
-        hash >>= 5;
+        if ((map->nodemap & bit) == 0) {
+            return VALUE_NONE;
+        }
+        map = hamt_map_node(map, bit);
     }
-    return VALUE_NONE;
 }
 
-// Reverse lookup: find a key for a value.
-static Value hamt_find_key_in_node(HAMTNode* node, Value value) {
-    size_t k = __builtin_popcount(VALUE_TO_HAMT_NODE_BITMAP(node->key));
-    for (size_t i = 0; i < k; ++i) {
-        HAMTNode* child_node = &node->content.nodes[i];
-        if (VALUE_IS_HAMT_NODE(child_node->key)) {
-            return hamt_find_key_in_node(child_node, value);
-        } else if (VALUE_EQUAL(value, child_node->content.value)) {
-            return child_node->key;
+// Start iterating over the entries of the HAMT (in no particular order).
+void hamt_iterator_init(HAMTIterator* iterator, HAMT* hamt) {
+    iterator->hamt = hamt;
+    iterator->slot = 0;
+    iterator->depth = 0;
+}
+
+// Get the next entry from an iterator; return false after the last one. The
+// path holds the maps from the current slot of the root down to the current
+// map, each with the index of its next entry or sub-map (sub-maps come after
+// the entries, like in the map).
+bool hamt_iterator_next(HAMTIterator* iterator, Value* key, Value* value) {
+    HAMT* hamt = iterator->hamt;
+    for (;;) {
+        if (iterator->depth > 0) {
+            size_t depth = iterator->depth - 1;
+            HAMTMap* map = iterator->path[depth].map;
+            size_t count = hamt_map_count(map, hamt->root_bits + 5 * depth);
+            size_t i = iterator->path[depth].index++;
+            if (i < count) {
+                *key = map->entries[i].key;
+                *value = map->entries[i].content.value;
+                return true;
+            }
+            if (i < count + __builtin_popcount(map->nodemap)) {
+                iterator->path[iterator->depth].map = hamt_map_nodes(map)[i - count];
+                iterator->path[iterator->depth].index = 0;
+                iterator->depth += 1;
+            } else {
+                iterator->depth -= 1;
+            }
+            continue;
+        }
+        if (!hamt->root || iterator->slot == (size_t)1 << hamt->root_bits) {
+            return false;
+        }
+        HAMTNode* slot = &hamt->root[iterator->slot++];
+        if (VALUE_IS_HAMT_NODE(slot->key)) {
+            iterator->path[0].map = slot->content.map;
+            iterator->path[0].index = 0;
+            iterator->depth = 1;
+        } else if (!VALUE_IS_NONE(slot->key)) {
+            *key = slot->key;
+            *value = slot->content.value;
+            return true;
         }
     }
-    return VALUE_NONE;
 }
 
+// Reverse lookup: find a key for a value.
 Value hamt_find_key(HAMT* hamt, Value value) {
-    return hamt_find_key_in_node(&hamt->root, value);
+    HAMTIterator iterator;
+    hamt_iterator_init(&iterator, hamt);
+    Value k;
+    Value v;
+    while (hamt_iterator_next(&iterator, &k, &v)) {
+        if (VALUE_EQUAL(v, value)) {
+            return k;
+        }
+    }
+    return VALUE_NONE;
 }
 
 // When inserting a new value, it may collide with a previously inserted entry.
-// Replace that entry with a new map by getting the next 5 bits of both hashes,
-// and keep going while there are collisions.
-// TODO rehash if the full hashes collide.
-static void hamt_resolve_collision(HAMTNode* node, HAMTNode* newn, Value key, Value value,
-    Value previous_key, Value previous_value, uint32_t hash, size_t i) {
-    if (i >= 6) {
-        exit(EXIT_FAILURE);
-    }
-
-    // Bit positions for new and previous values in the bitmap of the new node.
-    size_t new_mask = 1 << ((hash >> 5) & 0x1f);
-    size_t previous_mask = 1 << (value_hash(previous_key) >> (5 * (i + 1)));
-    // Update the bitmap in the node.
-    newn->key = VALUE_HAMT_NODE;
-    newn->key.as_int |= new_mask;
-    newn->key.as_int |= previous_mask;
-
-    if (new_mask == previous_mask) {
+// Replace that entry with a new map for both entries at shift, getting the next
+// 5 bits of both hashes, and keep going while these are the same. When the
+// full hashes collide, both entries go into a collision bucket.
+static HAMTMap* hamt_map_pair(Value key, Value value, uint64_t hash,
+    Value previous_key, Value previous_value, uint32_t shift) {
+    HAMTNode entry = { .key = key, .content = { .value = value } };
+    HAMTNode previous_entry = { .key = previous_key, .content = { .value = previous_value } };
+    if (shift >= 64) {
+        HAMTMap* bucket = hamt_map_new(2 * sizeof(HAMTNode) / sizeof(Value));
+        bucket->count = 2;
+        bucket->entries[0] = previous_entry;
+        bucket->entries[1] = entry;
+        return bucket;
+    }
+
+    // Bits for new and previous entries in the bitmaps of the new map.
+    uint32_t new_bit = HAMT_BIT(hash, shift);
+    uint32_t previous_bit = HAMT_BIT(value_hash(previous_key), shift);
+    if (new_bit == previous_bit) {
         // Both entries have the same position, so insert yet another map in
         // between.
-        node->content.nodes = malloc(sizeof(HAMTNode));
-        if (newn != node) {
-            newn->content.nodes = malloc(sizeof(HAMTNode));
-        }
-        hamt_resolve_collision(
-            node->content.nodes, newn->content.nodes,
-            key, value, previous_key, previous_value, hash >> 5, i + 1
-        );
-    } else {
-        // The entries have different positions, so add the two values to the
-        // new map.
-        size_t new_i = new_mask < previous_mask ? 0 : 1;
-        size_t previous_i = new_mask < previous_mask ? 1 : 0;
-        newn->content.nodes = calloc(sizeof(HAMTNode), 2);
-        newn->content.nodes[new_i].refcount = 1;
-        newn->content.nodes[new_i].key = key;
-        newn->content.nodes[new_i].content.value = value;
-        newn->content.nodes[previous_i].refcount = 1;
-        newn->content.nodes[previous_i].key = previous_key;
-        newn->content.nodes[previous_i].content.value = previous_value;
+        HAMTMap* map = hamt_map_new(1);
+        map->nodemap = new_bit;
+        hamt_map_nodes(map)[0] = hamt_map_pair(key, value, hash, previous_key, previous_value, shift + 5);
+        return map;
     }
+    // The entries have different positions, so add them to the new map.
+    HAMTMap* map = hamt_map_new(2 * sizeof(HAMTNode) / sizeof(Value));
+    map->datamap = new_bit | previous_bit;
+    map->entries[new_bit < previous_bit ? 0 : 1] = entry;
+    map->entries[new_bit < previous_bit ? 1 : 0] = previous_entry;
+    return map;
 }
 
-// Set a value for a key in the HAMT. If the key is already present, the value
-// is updated, otherwise a new entry is added, possibly creating intermediary
-// maps along the way.
-// TODO rehash in case of collision.
-void hamt_set(HAMT* hamt, Value key, Value value) {
-    uint32_t hash = value_hash(key);
-    HAMTNode* node = &hamt->root;
-    for (size_t i = 0; i < 6; ++i) {
-        uint32_t mask = 1 << (hash & 0x1f);
-        uint32_t bitmap = VALUE_TO_HAMT_NODE_BITMAP(node->key);
-        size_t j = __builtin_popcount(bitmap & (mask - 1));
-        if ((bitmap & mask) == 0) {
-            // A free slot was found so add a new entry in the map.
-            // Set the bit in the bitmap.
-            node->key.as_int |= (uint64_t)mask;
-            // Copy the k values to a new array to keep them in order.
-            size_t k = __builtin_popcount(bitmap);
-            HAMTNode* nodes = calloc(sizeof(HAMTNode), k + 1);
-            for (size_t ii = 0; ii < j; ++ii) {
-                nodes[ii] = node->content.nodes[ii];
-                nodes[ii].refcount += 1;
-            }
-            // Insert the new entry at the right position.
-            nodes[j] = (HAMTNode){ .refcount = 1, .key = key, .content = { .value = value } };
-            for (size_t ii = j + 1; ii <= k; ++ii) {
-                nodes[ii] = node->content.nodes[ii - 1];
-                nodes[ii].refcount += 1;
+// Set a value for a key in place; return true if the key was added (the count
+// is left to the caller). Maps along the way are copied first if they are
+// shared.
+static bool hamt_insert(HAMT* hamt, Value key, Value value) {
+    uint64_t hash = value_hash(key);
+    HAMTNode* slot = HAMT_SLOT(hamt, hash);
+    if (VALUE_IS_NONE(slot->key)) {
+        // An empty slot of the root.
+        *slot = (HAMTNode){ .key = key, .content = { .value = value } };
+        return true;
+    }
+    if (!VALUE_IS_HAMT_NODE(slot->key)) {
+        // This is an entry which needs to be updated if the keys match;
+        // otherwise, a new map needs to be inserted instead for both the
+        // previous entry and the new entry (see above).
+        if (VALUE_EQUAL(slot->key, key)) {
+            slot->content.value = value;
+            return false;
+        }
+        slot->content.map = hamt_map_pair(key, value, hash, slot->key, slot->content.value, hamt->root_bits);
+        slot->key = VALUE_HAMT_NODE;
+        return true;
+    }
+
+    HAMTMap** mapp = &slot->content.map;
+    for (uint32_t shift = hamt->root_bits; ; shift += 5) {
+        hamt_own(mapp, shift);
+        HAMTMap* map = *mapp;
+        size_t used = hamt_map_size(map, shift);
+        if (shift >= 64) {
+            HAMTNode* entry = hamt_bucket_find(map, key);
+            if (entry) {
+                entry->content.value = value;
+                return false;
             }
-            // TODO keep a pool of nodes instead of allocating/freeing.
-            free(node->content.nodes);
-            node->content.nodes = nodes;
-            hamt->count += 1;
-            return;
+            *mapp = map = hamt_map_open(map, used, used, sizeof(HAMTNode));
+            map->entries[map->count++] = (HAMTNode){ .key = key, .content = { .value = value } };
+            return true;
         }
 
-        // The slot is occupied by an entry or a map.
-        node = &node->content.nodes[j];
-        if (!VALUE_IS_HAMT_NODE(node->key)) {
-            // This is an entry which needs to be updated if the keys match;
-            // otherwise, a new map needs to be inserted instead for both the
-            // previous entry and the new entry (see above).
-            if (VALUE_EQUAL(node->key, key)) {
-                node->content.value = value;
-            } else {
-                hamt_resolve_collision(node, node, key, value, node->key, node->content.value, hash, i);
-                hamt->count += 1;
+        uint32_t bit = HAMT_BIT(hash, shift);
+        size_t i = __builtin_popcount(map->datamap & (bit - 1));
+        if (map->datamap & bit) {
+            HAMTNode* entry = &map->entries[i];
+            if (VALUE_EQUAL(entry->key, key)) {
+                entry->content.value = value;
+                return false;
             }
-            return;
+            // Move the entry to a new sub-map along with the new entry. The
+            // map does not grow as the entry is larger than the pointer.
+            HAMTMap* node = hamt_map_pair(key, value, hash, entry->key, entry->content.value, shift + 5);
+            hamt_map_close(map, used, i * sizeof(HAMTNode), sizeof(HAMTNode));
+            used -= sizeof(HAMTNode);
+            map->datamap &= ~bit;
+            size_t j = __builtin_popcount(map->nodemap & (bit - 1));
+            size_t offset = __builtin_popcount(map->datamap) * sizeof(HAMTNode) + j * sizeof(HAMTMap*);
+            hamt_map_open(map, used, offset, sizeof(HAMTMap*));
+            map->nodemap |= bit;
+            hamt_map_nodes(map)[j] = node;
+            return true;
+        }
+        if (map->nodemap & bit) {
+            // Keep going down with the next 5 bits of the hash.
+            mapp = &hamt_map_nodes(map)[__builtin_popcount(map->nodemap & (bit - 1))];
+            continue;
         }
+        // A free position was found so add a new entry in the map, keeping the
+        // entries in order and moving the map if it is full.
+        *mapp = map = hamt_map_open(map, used, i * sizeof(HAMTNode), sizeof(HAMTNode));
+        map->datamap |= bit;
+        map->entries[i] = (HAMTNode){ .key = key, .content = { .value = value } };
+        return true;
+    }
+}
 
-        // Keep going down with the next 5 bits of the hash.
-        hash >>= 5;
+// Insert all the entries under a map again (after the root was resized).
+static void hamt_reinsert(HAMT* hamt, HAMTMap* map, uint32_t shift) {
+    for (size_t i = 0; i < hamt_map_count(map, shift); ++i) {
+        hamt_insert(hamt, map->entries[i].key, map->entries[i].content.value);
+    }
+    HAMTMap** nodes = hamt_map_nodes(map);
+    for (int i = 0; i < __builtin_popcount(map->nodemap); ++i) {
+        hamt_reinsert(hamt, nodes[i], shift + 5);
     }
 }
 
-// Persistent add: create a new HAMT with this key/value, sharing as many nodes
-// with the original HAMT as possible.
-HAMT* hamt_with(HAMT* hamt, Value key, Value value) {
+// Double the size of the root while the HAMT has more entries than the root
+// has slots (up to HAMT_ROOT_BITS_MAX), moving all entries to the new root.
+static void hamt_grow_root(HAMT* hamt) {
+    uint32_t root_bits = hamt->root_bits;
+    while (hamt->count > (size_t)1 << root_bits && root_bits < HAMT_ROOT_BITS_MAX) {
+        root_bits += 1;
+    }
+    if (root_bits == hamt->root_bits) {
+        return;
+    }
+
+    HAMTNode* root = hamt->root;
+    uint32_t shift = hamt->root_bits;
+    size_t n = (size_t)1 << shift;
+    hamt->root = hamt_root_new(root_bits);
+    hamt->root_bits = root_bits;
+    for (size_t i = 0; i < n; ++i) {
+        if (VALUE_IS_HAMT_NODE(root[i].key)) {
+            hamt_reinsert(hamt, root[i].content.map, shift);
+            hamt_map_free(root[i].content.map);
+        } else if (!VALUE_IS_NONE(root[i].key)) {
+            hamt_insert(hamt, root[i].key, root[i].content.value);
+        }
+    }
+    hamt_map_release(HAMT_MAP(root));
+#ifdef DEBUG
+    fprintf(stderr, "+++ hamt_grow_root() %zu slots for %zu entries\n", (size_t)1 << root_bits, hamt->count);
+#endif
+}
+
+// Set a value for a key in the HAMT. If the key is already present, the value
+// is updated, otherwise a new entry is added, possibly creating intermediary
+// maps along the way.
+void hamt_set(HAMT* hamt, Value key, Value value) {
+    if (!hamt->root) {
+        hamt->root = hamt_root_new(hamt->root_bits);
+    }
+    if (hamt_insert(hamt, key, value)) {
+        hamt->count += 1;
+        hamt_grow_root(hamt);
+    }
+}
+
+// Transient copy of a HAMT: a new HAMT sharing all the maps of the original,
+// to be updated in place with hamt_set. Shared maps are copied the first time
+// that they are updated (see hamt_own) and then belong to the transient, so a
+// batch of updates copies every path only once.
+HAMT* hamt_transient(HAMT* hamt) {
     HAMT* newh = malloc(sizeof(HAMT));
     hamt_init(newh);
     newh->count = hamt->count;
+    newh->root_bits = hamt->root_bits;
+    if (hamt->root) {
+        size_t n = (size_t)1 << hamt->root_bits;
+        newh->root = hamt_map_new(n * sizeof(HAMTNode) / sizeof(Value))->entries;
+        memcpy(newh->root, hamt->root, n * sizeof(HAMTNode));
+        for (size_t i = 0; i < n; ++i) {
+            hamt_retain(&newh->root[i]);
+        }
+    }
+    return newh;
+}
 
-    uint32_t hash = value_hash(key);
-    HAMTNode* node = &hamt->root;
-    HAMTNode* newn = &newh->root;
-    for (size_t i = 0; i < 6; ++i) {
-        uint32_t mask = 1 << (hash & 0x1f);
-        uint32_t bitmap = VALUE_TO_HAMT_NODE_BITMAP(node->key);
-        size_t j = __builtin_popcount(bitmap & (mask - 1));
-        size_t k = __builtin_popcount(bitmap);
-        newn->key = node->key;
-
-        if ((bitmap & mask) == 0) {
-            // A free slot was found so add a new entry to the new map.
-            newn->key.as_int |= (uint64_t)mask;
-            // Copy the k values to a new array to keep them in order.
-            HAMTNode* nodes = calloc(sizeof(HAMTNode), k + 1);
-            for (size_t ii = 0; ii < j; ++ii) {
-                nodes[ii] = node->content.nodes[ii];
-                nodes[ii].refcount += 1;
-            }
-            // Insert the new entry at the right position.
-            nodes[j] = (HAMTNode){ .refcount = 1, .key = key, .content = { .value = value } };
-            for (size_t ii = j + 1; ii <= k; ++ii) {
-                nodes[ii] = node->content.nodes[ii - 1];
-                nodes[ii].refcount += 1;
-            }
-            newn->content.nodes = nodes;
-            newh->count += 1;
-            return newh;
+// End a batch of updates to a transient HAMT, which can then be shared with
+// hamt_with or hamt_transient. Maps are reference counted, so there is nothing
+// to freeze: updating maps that are shared again copies them first.
+HAMT* hamt_persist(HAMT* hamt) {
+    return hamt;
+}
+
+// Persistent add: create a new HAMT with this key/value, sharing as many maps
+// with the original HAMT as possible (only the path to the new entry and the
+// root are copied). The root does not grow here: only HAMTs that are updated in
+// place get a large root.
+HAMT* hamt_with(HAMT* hamt, Value key, Value value) {
+    HAMT* newh = hamt_transient(hamt);
+    if (!newh->root) {
+        newh->root = hamt_root_new(newh->root_bits);
+    }
+    if (hamt_insert(newh, key, value)) {
+        newh->count += 1;
+    }
+    return hamt_persist(newh);
+}
+
+// The entry of a map that has a single entry and no sub-maps, if any.
+static HAMTNode* hamt_map_single_entry(HAMTMap* map, uint32_t shift) {
+    return hamt_map_count(map, shift) == 1 && map->nodemap == 0 ? map->entries : 0;
+}
+
+// Remove a key that is present under a map in place, using the hash of the key
+// from shift. A sub-map that is left with a single entry and no sub-maps of its
+// own is replaced by that entry, which can then move further up; so a map
+// always has at least two entries, or a sub-map. Collision buckets themselves
+// stay at the bottom, as all their keys have the same hash.
+static void hamt_map_remove(HAMTMap** mapp, Value key, uint64_t hash, uint32_t shift) {
+    hamt_own(mapp, shift);
+    HAMTMap* map = *mapp;
+    size_t used = hamt_map_size(map, shift);
+    if (shift >= 64) {
+        size_t i = hamt_bucket_find(map, key) - map->entries;
+        hamt_map_close(map, used, i * sizeof(HAMTNode), sizeof(HAMTNode));
+        map->count -= 1;
+        return;
+    }
+
+    uint32_t bit = HAMT_BIT(hash, shift);
+    size_t i = __builtin_popcount(map->datamap & (bit - 1));
+    if (map->datamap & bit) {
+        hamt_map_close(map, used, i * sizeof(HAMTNode), sizeof(HAMTNode));
+        map->datamap &= ~bit;
+        return;
+    }
+    size_t j = __builtin_popcount(map->nodemap & (bit - 1));
+    HAMTMap** node = &hamt_map_nodes(map)[j];
+    hamt_map_remove(node, key, hash, shift + 5);
+    HAMTNode* entry = hamt_map_single_entry(*node, shift + 5);
+    if (entry) {
+        // Move the last entry of the sub-map to this map.
+        HAMTNode moved = *entry;
+        hamt_map_release(*node);
+        hamt_map_close(map, used, __builtin_popcount(map->datamap) * sizeof(HAMTNode) + j * sizeof(HAMTMap*),
+            sizeof(HAMTMap*));
+        used -= sizeof(HAMTMap*);
+        map->nodemap &= ~bit;
+        *mapp = map = hamt_map_open(map, used, i * sizeof(HAMTNode), sizeof(HAMTNode));
+        map->datamap |= bit;
+        map->entries[i] = moved;
+    }
+}
+
+// Remove a key in place; return true if it was present (the count is left to
+// the caller). Nothing is copied when the key is not present.
+static bool hamt_remove(HAMT* hamt, Value key) {
+    if (!hamt_find(hamt, key)) {
+        return false;
+    }
+    uint64_t hash = value_hash(key);
+    HAMTNode* slot = HAMT_SLOT(hamt, hash);
+    if (!VALUE_IS_HAMT_NODE(slot->key)) {
+        slot->key = VALUE_NONE;
+        return true;
+    }
+    hamt_map_remove(&slot->content.map, key, hash, hamt->root_bits);
+    HAMTNode* entry = hamt_map_single_entry(slot->content.map, hamt->root_bits);
+    if (entry) {
+        HAMTMap* map = slot->content.map;
+        *slot = *entry;
+        hamt_map_release(map);
+    }
+    return true;
+}
+
+// Persistent removal: create a new HAMT without this key, sharing as many maps
+// with the original HAMT as possible (only the path to the removed entry and
+// the root are copied).
+HAMT* hamt_without(HAMT* hamt, Value key) {
+    HAMT* newh = hamt_transient(hamt);
+    if (hamt_remove(newh, key)) {
+        newh->count -= 1;
+    }
+    return hamt_persist(newh);
+}
+
+// The entries of a map come first, and are contiguous.
+static void hamt_each_in_map(HAMTMap* map, uint32_t shift, void (*f)(Value, Value, void*), void* data) {
+    for (size_t i = 0; i < hamt_map_count(map, shift); ++i) {
+        f(map->entries[i].key, map->entries[i].content.value, data);
+    }
+    HAMTMap** nodes = hamt_map_nodes(map);
+    for (int i = 0; i < __builtin_popcount(map->nodemap); ++i) {
+        hamt_each_in_map(nodes[i], shift + 5, f, data);
+    }
+}
+
+// Call f with every key/value pair of the HAMT (in no particular order) and
+// some data.
+void hamt_each(HAMT* hamt, void (*f)(Value, Value, void*), void* data) {
+    for (size_t i = 0; hamt->root && i < (size_t)1 << hamt->root_bits; ++i) {
+        HAMTNode* slot = &hamt->root[i];
+        if (VALUE_IS_HAMT_NODE(slot->key)) {
+            hamt_each_in_map(slot->content.map, hamt->root_bits, f, data);
+        } else if (!VALUE_IS_NONE(slot->key)) {
+            f(slot->key, slot->content.value, data);
         }
+    }
+}
 
-        // Copy the original node.
-        newn->content.nodes = calloc(sizeof(HAMTNode), k);
-        for (size_t ii = 0; ii < k; ++ii) {
-            newn->content.nodes[ii] = node->content.nodes[ii];
-            newn->content.nodes[ii].refcount += 1;
+// Where hamt_diff reports differences, and the other HAMT to look keys up from
+// when two HAMTs cannot be compared map by map.
+typedef struct {
+    void (*f)(Value, Value, Value, void*);
+    void* data;
+    HAMT* other;
+} HAMTDiff;
+
+// Report an entry that is only in a, or only in b.
+static void hamt_diff_entry(HAMTDiff* diff, HAMTNode* entry, bool in_a) {
+    diff->f(entry->key, in_a ? entry->content.value : VALUE_NONE, in_a ? VALUE_NONE : entry->content.value,
+        diff->data);
+}
+
+// Report all the entries under a map (but the one for key, if any) as being
+// only in a, or only in b.
+static void hamt_diff_all(HAMTDiff* diff, HAMTMap* map, uint32_t shift, Value key, bool in_a) {
+    for (size_t i = 0; i < hamt_map_count(map, shift); ++i) {
+        if (!VALUE_EQUAL(map->entries[i].key, key)) {
+            hamt_diff_entry(diff, &map->entries[i], in_a);
         }
+    }
+    HAMTMap** nodes = hamt_map_nodes(map);
+    for (int i = 0; i < __builtin_popcount(map->nodemap); ++i) {
+        hamt_diff_all(diff, nodes[i], shift + 5, key, in_a);
+    }
+}
 
-        // The slot is occupied by an entry or a map.
-        node = &node->content.nodes[j];
-        newn = &newn->content.nodes[j];
+// Compare an entry of a (or b) with the map at the same position in b (or a).
+static void hamt_diff_entry_map(HAMTDiff* diff, HAMTNode* entry, HAMTMap* map, uint32_t shift, bool in_a) {
+    HAMTNode* other = hamt_map_find(map, entry->key, value_hash(entry->key), shift);
+    if (!other) {
+        hamt_diff_entry(diff, entry, in_a);
+    } else if (!VALUE_EQUAL(entry->content.value, other->content.value)) {
+        diff->f(entry->key, in_a ? entry->content.value : other->content.value,
+            in_a ? other->content.value : entry->content.value, diff->data);
+    }
+    hamt_diff_all(diff, map, shift, entry->key, !in_a);
+}
 
-        if (!VALUE_IS_HAMT_NODE(node->key)) {
-            // This is an entry which needs to be updated if the keys match;
-            // otherwise, a new map needs to be inserted instead for both the
-            // previous entry and the new entry (see above).
-            if (VALUE_EQUAL(node->key, key)) {
-                newn->content.value = value;
-            } else {
-                hamt_resolve_collision(node, newn, key, value, node->key, node->content.value, hash, i);
-                hamt->count += 1;
+static void hamt_diff_map(HAMTDiff*, HAMTMap*, HAMTMap*, uint32_t);
+
+// Compare what is at the same position in a and in b: an entry, a map (at
+// shift), or nothing.
+static void hamt_diff_at(HAMTDiff* diff, HAMTNode* a_entry, HAMTMap* a_map, HAMTNode* b_entry, HAMTMap* b_map,
+    uint32_t shift) {
+    if (a_map && b_map) {
+        hamt_diff_map(diff, a_map, b_map, shift);
+    } else if (a_entry && b_entry && VALUE_EQUAL(a_entry->key, b_entry->key)) {
+        if (!VALUE_EQUAL(a_entry->content.value, b_entry->content.value)) {
+            diff->f(a_entry->key, a_entry->content.value, b_entry->content.value, diff->data);
+        }
+    } else if (a_entry && b_map) {
+        hamt_diff_entry_map(diff, a_entry, b_map, shift, true);
+    } else if (a_map && b_entry) {
+        hamt_diff_entry_map(diff, b_entry, a_map, shift, false);
+    } else {
+        if (a_entry) {
+            hamt_diff_entry(diff, a_entry, true);
+        } else if (a_map) {
+            hamt_diff_all(diff, a_map, shift, VALUE_NONE, true);
+        }
+        if (b_entry) {
+            hamt_diff_entry(diff, b_entry, false);
+        } else if (b_map) {
+            hamt_diff_all(diff, b_map, shift, VALUE_NONE, false);
+        }
+    }
+}
+
+// Compare two maps at the same position in a and b. A map that is shared by
+// both has nothing to compare under it; otherwise, maps are compared position
+// by position, and collision buckets entry by entry.
+static void hamt_diff_map(HAMTDiff* diff, HAMTMap* a, HAMTMap* b, uint32_t shift) {
+    if (a == b) {
+        return;
+    }
+    if (shift >= 64) {
+        for (size_t i = 0; i < a->count; ++i) {
+            HAMTNode* other = hamt_bucket_find(b, a->entries[i].key);
+            if (!other || !VALUE_EQUAL(a->entries[i].content.value, other->content.value)) {
+                diff->f(a->entries[i].key, a->entries[i].content.value, other ? other->content.value : VALUE_NONE,
+                    diff->data);
             }
-            return newh;
         }
+        for (size_t i = 0; i < b->count; ++i) {
+            if (!hamt_bucket_find(a, b->entries[i].key)) {
+                hamt_diff_entry(diff, &b->entries[i], false);
+            }
+        }
+        return;
+    }
+    // Entries and sub-maps are in the order of their bits, so they are simply
+    // counted along the way.
+    HAMTNode* a_entries = a->entries;
+    HAMTNode* b_entries = b->entries;
+    HAMTMap** a_nodes = hamt_map_nodes(a);
+    HAMTMap** b_nodes = hamt_map_nodes(b);
+    for (uint32_t bits = a->datamap | a->nodemap | b->datamap | b->nodemap; bits; bits &= bits - 1) {
+        uint32_t bit = bits & -bits;
+        hamt_diff_at(diff, a->datamap & bit ? a_entries++ : 0, a->nodemap & bit ? *a_nodes++ : 0,
+            b->datamap & bit ? b_entries++ : 0, b->nodemap & bit ? *b_nodes++ : 0, shift + 5);
+    }
+}
 
-        // Keep going down with the next 5 bits of the hash.
-        hash >>= 5;
+static void hamt_diff_from_a(Value key, Value value, void* data) {
+    HAMTDiff* diff = data;
+    Value other = hamt_get(diff->other, key);
+    if (!VALUE_EQUAL(other, value)) {
+        diff->f(key, value, other, diff->data);
     }
+}
 
-    return newh;
+static void hamt_diff_from_b(Value key, Value value, void* data) {
+    HAMTDiff* diff = data;
+    if (!hamt_find(diff->other, key)) {
+        diff->f(key, VALUE_NONE, value, diff->data);
+    }
 }
 
-// Free a node and its children.
-static void hamt_free_node(HAMTNode* node) {
-    node->refcount -= 1;
-    if (node->refcount > 0) {
+// The entry or the map of a slot of the root, if any.
+#define HAMT_SLOT_ENTRY(slot) (VALUE_IS_NONE((slot)->key) || VALUE_IS_HAMT_NODE((slot)->key) ? 0 : (slot))
+#define HAMT_SLOT_MAP(slot) (VALUE_IS_HAMT_NODE((slot)->key) ? (slot)->content.map : 0)
+
+// Call f for every key that has a different value in a and in b, with the key,
+// its value in a, its value in b (VALUE_NONE when it is missing from either),
+// and some data. Two HAMTs with roots of the same size (like the versions of a
+// HAMT made by hamt_with, hamt_without or hamt_transient) are compared map by
+// map, skipping the maps that they share, so that the cost depends on the
+// differences and not on the size; otherwise all keys are looked up.
+void hamt_diff(HAMT* a, HAMT* b, void (*f)(Value, Value, Value, void*), void* data) {
+    HAMTDiff diff = { .f = f, .data = data };
+    if (a->root && b->root && a->root_bits == b->root_bits) {
+        for (size_t i = 0; i < (size_t)1 << a->root_bits; ++i) {
+            HAMTNode* a_slot = &a->root[i];
+            HAMTNode* b_slot = &b->root[i];
+            hamt_diff_at(&diff, HAMT_SLOT_ENTRY(a_slot), HAMT_SLOT_MAP(a_slot), HAMT_SLOT_ENTRY(b_slot),
+                HAMT_SLOT_MAP(b_slot), a->root_bits);
+        }
         return;
     }
+    diff.other = b;
+    hamt_each(a, hamt_diff_from_a, &diff);
+    diff.other = a;
+    hamt_each(b, hamt_diff_from_b, &diff);
+}
+
+static void hamt_merge_entry(Value key, Value a_value, Value b_value, void* data) {
+    if (!VALUE_IS_NONE(b_value)) {
+        hamt_set(data, key, b_value);
+    }
+}
+
+// Persistent merge: create a new HAMT with the entries of both a and b (the
+// values of b winning), starting from a transient of a to which the entries
+// that differ in b are added, so merging two versions of a HAMT costs time in
+// proportion to their differences.
+HAMT* hamt_merge(HAMT* a, HAMT* b) {
+    if (a->count == 0) {
+        return hamt_persist(hamt_transient(b));
+    }
+    HAMT* newh = hamt_transient(a);
+    hamt_diff(a, b, hamt_merge_entry, newh);
+    return hamt_persist(newh);
+}
+
+static size_t hamt_map_footprint(HAMTMap* map) {
+    size_t size = sizeof(HAMTMap) + hamt_map_capacity(map);
+    HAMTMap** nodes = hamt_map_nodes(map);
+    for (int i = 0; i < __builtin_popcount(map->nodemap); ++i) {
+        size += hamt_map_footprint(nodes[i]);
+    }
+    return size;
+}
 
-    size_t k = __builtin_popcount(VALUE_TO_HAMT_NODE_BITMAP(node->key));
-    for (size_t i = 0; i < k; ++i) {
-        HAMTNode* child_node = &node->content.nodes[i];
-        if (VALUE_IS_HAMT_NODE(child_node->key)) {
-            hamt_free_node(child_node);
+// Number of bytes used by the root and the maps of the HAMT, including their
+// headers and unused room (maps shared with other HAMTs are counted as well).
+size_t hamt_footprint(HAMT* hamt) {
+    if (!hamt->root) {
+        return 0;
+    }
+    size_t size = sizeof(HAMTMap) + hamt_map_capacity(HAMT_MAP(hamt->root));
+    for (size_t i = 0; i < (size_t)1 << hamt->root_bits; ++i) {
+        if (VALUE_IS_HAMT_NODE(hamt->root[i].key)) {
+            size += hamt_map_footprint(hamt->root[i].content.map);
         }
     }
-    free(node->content.nodes);
+    return size;
+}
+
+// Release a map, returning it to the pool along with its sub-maps once they
+// are not shared anymore.
+static void hamt_map_free(HAMTMap* map) {
+    if ((hamt_atomic ? __atomic_sub_fetch(&map->refcount, 1, __ATOMIC_ACQ_REL) : --map->refcount) > 0) {
+        return;
+    }
+    HAMTMap** nodes = hamt_map_nodes(map);
+    for (int i = 0; i < __builtin_popcount(map->nodemap); ++i) {
+        hamt_map_free(nodes[i]);
+    }
+    hamt_map_release(map);
 }
 
-// Free the HAMT and all its nodes.
+// Free the HAMT and all its maps.
 void hamt_free(HAMT* hamt) {
-    hamt_free_node(&hamt->root);
+    for (size_t i = 0; hamt->root && i < (size_t)1 << hamt->root_bits; ++i) {
+        if (VALUE_IS_HAMT_NODE(hamt->root[i].key)) {
+            hamt_map_free(hamt->root[i].content.map);
+        }
+    }
+    if (hamt->root) {
+        hamt_map_release(HAMT_MAP(hamt->root));
+    }
 #ifdef DEBUG
     fprintf(stderr, "--- hamt_free_node(): freed nodes (%zu)\n", hamt->count);
 #endif
     hamt_init(hamt);
 }
 
+// Sharing a HAMT between threads. Readers never lock nor write to the HAMT:
+// they publish the version that they are about to read in their hazard slot,
+// then check that it is still the current version (otherwise a writer may have
+// replaced it in the meantime, and they try again with the new one). Writers
+// make a new version from the current one (which they protect the same way)
+// with hamt_with and publish it with a compare-and-swap, trying again if another
+// writer got there first. A version that was replaced is freed once no hazard
+// slot refers to it anymore, so writers wait for the readers that are still
+// using it. Published versions are never updated in place since all their maps
+// are shared with a newer version or with the transient of a writer.
+
+// Reference counts are atomic from now on (which is slower), so this must be
+// called before starting the threads.
+void hamt_shared_init(HAMTShared* shared) {
+    hamt_atomic = true;
+    shared->current = malloc(sizeof(HAMT));
+    hamt_init(shared->current);
+    for (size_t i = 0; i < HAMT_SHARED_THREADS; ++i) {
+        shared->hazards[i].hamt = 0;
+    }
+}
+
+// Get the current version of a shared HAMT for a thread, which can read it
+// until it calls hamt_shared_release.
+HAMT* hamt_shared_acquire(HAMTShared* shared, size_t thread) {
+    HAMT* hamt = __atomic_load_n(&shared->current, __ATOMIC_SEQ_CST);
+    for (;;) {
+        __atomic_store_n(&shared->hazards[thread].hamt, hamt, __ATOMIC_SEQ_CST);
+        HAMT* current = __atomic_load_n(&shared->current, __ATOMIC_SEQ_CST);
+        if (current == hamt) {
+            return hamt;
+        }
+        hamt = current;
+    }
+}
+
+void hamt_shared_release(HAMTShared* shared, size_t thread) {
+    __atomic_store_n(&shared->hazards[thread].hamt, 0, __ATOMIC_RELEASE);
+}
+
+Value hamt_shared_get(HAMTShared* shared, size_t thread, Value key) {
+    Value value = hamt_get(hamt_shared_acquire(shared, thread), key);
+    hamt_shared_release(shared, thread);
+    return value;
+}
+
+// Free a version that was replaced, waiting for its readers to release it.
+static void hamt_shared_retire(HAMTShared* shared, HAMT* hamt) {
+    for (size_t i = 0; i < HAMT_SHARED_THREADS; ++i) {
+        while (__atomic_load_n(&shared->hazards[i].hamt, __ATOMIC_SEQ_CST) == hamt) {
+            sched_yield();
+        }
+    }
+    hamt_free(hamt);
+    free(hamt);
+}
+
+// The version stays protected until the new one is published so that its
+// address cannot be reused by another version in the meantime.
+void hamt_shared_set(HAMTShared* shared, size_t thread, Value key, Value value) {
+    for (;;) {
+        HAMT* hamt = hamt_shared_acquire(shared, thread);
+        HAMT* newh = hamt_with(hamt, key, value);
+        bool published = __atomic_compare_exchange_n(&shared->current, &hamt, newh, false, __ATOMIC_SEQ_CST,
+            __ATOMIC_SEQ_CST);
+        hamt_shared_release(shared, thread);
+        if (published) {
+            hamt_shared_retire(shared, hamt);
+            return;
+        }
+        hamt_free(newh);
+        free(newh);
+    }
+}
+
+// Free the current version, once no other thread uses the shared HAMT.
+void hamt_shared_free(HAMTShared* shared) {
+    hamt_free(shared->current);
+    free(shared->current);
+    shared->current = 0;
+}
+
+// HAMT files. A HAMT is written as it is in memory, with offsets from the start
+// of the file in place of pointers, so that the file can be mapped anywhere
+// (read-only) and queried in place: a lookup only touches the pages on its path
+// and nothing has to be loaded first. The file starts with a header, followed
+// by the long strings and the maps, every one of them after its strings and
+// its sub-maps, and ends with the root. Long strings are written as String
+// objects (once each, and always marked so that the garbage collector leaves
+// them alone, see gc_mark) and values refer to them by offset. Maps keep their
+// header, with their reference count and size class set to 0. Other objects
+// (functions and vars) cannot be written. Files use the byte order and the
+// layout of the machine that wrote them.
+#define HAMT_FILE_MAGIC "reloxHT4"
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t root_bits;
+    uint64_t root;
+    uint64_t size;
+} HAMTFileHeader;
+
+typedef struct {
+    FILE* stream;
+    uint64_t offset;
+    // Offsets of the strings already written.
+    HAMT strings;
+    bool ok;
+} HAMTWriter;
+
+// Whether a value is a string object rather than a string that fits in the
+// value itself.
+static bool hamt_is_string_object(Value v) {
+    return VALUE_IS_STRING(v) && !VALUE_IS_EPSILON(v) && !VALUE_IS_SHORT_STRING(v);
+}
+
+// Write bytes padded to a word; return their offset.
+static uint64_t hamt_file_put(HAMTWriter* writer, const void* bytes, size_t size) {
+    static const char padding[sizeof(Value)];
+    size_t n = -size & (sizeof(Value) - 1);
+    uint64_t offset = writer->offset;
+    if (fwrite(bytes, 1, size, writer->stream) != size || fwrite(padding, 1, n, writer->stream) != n) {
+        writer->ok = false;
+    }
+    writer->offset += size + n;
+    return offset;
+}
+
+// A value as it is in the file, writing its string the first time it is found.
+static Value hamt_file_value(HAMTWriter* writer, Value v) {
+    if (VALUE_IS_FUNCTION(v) || VALUE_IS_POINTER(v)) {
+        writer->ok = false;
+        return v;
+    }
+    if (!hamt_is_string_object(v)) {
+        return v;
+    }
+    Value offset = hamt_get(&writer->strings, v);
+    if (VALUE_IS_NONE(offset)) {
+        String* string = VALUE_TO_STRING(v);
+        size_t size = offsetof(String, chars) + string->length + 1;
+        String* copy = malloc(size);
+        copy->length = string->length;
+        copy->hash = string_hash(string);
+        copy->marked = true;
+        copy->rope = false;
+        copy->slice = false;
+        memcpy(copy->chars, string_bytes(string), string->length);
+        copy->chars[string->length] = 0;
+        offset = VALUE_FROM_INT(hamt_file_put(writer, copy, size));
+        free(copy);
+        hamt_set(&writer->strings, v, offset);
+    }
+    return VALUE_FROM_STRING((uintptr_t)offset.as_double);
+}
+
+// Write a map after its strings and its sub-maps; return its offset.
+static uint64_t hamt_file_map(HAMTWriter* writer, HAMTMap* map, uint32_t shift) {
+    size_t size = sizeof(HAMTMap) + hamt_map_size(map, shift);
+    HAMTMap* copy = malloc(size);
+    memcpy(copy, map, size);
+    copy->refcount = 0;
+    copy->size_class = 0;
+    for (size_t i = 0; i < hamt_map_count(copy, shift); ++i) {
+        copy->entries[i].key = hamt_file_value(writer, copy->entries[i].key);
+        copy->entries[i].content.value = hamt_file_value(writer, copy->entries[i].content.value);
+    }
+    HAMTMap** nodes = hamt_map_nodes(copy);
+    for (int i = 0; i < __builtin_popcount(copy->nodemap); ++i) {
+        nodes[i] = (HAMTMap*)(uintptr_t)hamt_file_map(writer, nodes[i], shift + 5);
+    }
+    uint64_t offset = hamt_file_put(writer, copy, size);
+    free(copy);
+    return offset;
+}
+
+// Write a HAMT to a file, which must be seekable since the header is written
+// last; return false if the HAMT holds values that cannot be written, or if
+// writing failed.
+bool hamt_file_write(HAMT* hamt, FILE* stream) {
+    HAMTFileHeader header = { .magic = HAMT_FILE_MAGIC, .count = hamt->count, .root_bits = hamt->root_bits };
+    HAMTWriter writer = { .stream = stream, .ok = true };
+    hamt_init(&writer.strings);
+    hamt_file_put(&writer, &header, sizeof(header));
+
+    size_t n = (size_t)1 << hamt->root_bits;
+    HAMTNode* root = malloc(n * sizeof(HAMTNode));
+    for (size_t i = 0; i < n; ++i) {
+        HAMTNode* slot = hamt->root ? &hamt->root[i] : &(HAMTNode){ .key = VALUE_NONE };
+        root[i].key = slot->key;
+        if (VALUE_IS_HAMT_NODE(slot->key)) {
+            root[i].content.map = (HAMTMap*)(uintptr_t)hamt_file_map(&writer, slot->content.map, hamt->root_bits);
+        } else if (!VALUE_IS_NONE(slot->key)) {
+            root[i].key = hamt_file_value(&writer, slot->key);
+            root[i].content.value = hamt_file_value(&writer, slot->content.value);
+        }
+    }
+    header.root = hamt_file_put(&writer, root, n * sizeof(HAMTNode));
+    header.size = writer.offset;
+    free(root);
+    hamt_free(&writer.strings);
+
+    if (fseek(stream, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, stream) != 1 ||
+        fflush(stream) != 0) {
+        return false;
+    }
 #ifdef DEBUG
-void hamt_debug_node(HAMTNode* node) {
-    size_t k = __builtin_popcount(VALUE_TO_HAMT_NODE_BITMAP(node->key));
-    for (size_t i = 0; i < k; ++i) {
-        HAMTNode* child_node = &node->content.nodes[i];
-        if (VALUE_IS_HAMT_NODE(child_node->key)) {
-            hamt_debug_node(child_node);
-        } else {
-            value_print_debug(stderr, child_node->key, true);
-            fputs(": ", stderr);
-            value_print_debug(stderr, child_node->content.value, true);
-            fputs(", ", stderr);
+    fprintf(stderr, "+++ hamt_file_write() %zu entries, %" PRIu64 " bytes\n", hamt->count, header.size);
+#endif
+    return writer.ok;
+}
+
+// Whether n bytes from an offset are in a HAMT file.
+static bool hamt_file_contains(HAMTFile* file, uint64_t offset, uint64_t n) {
+    return offset <= file->size && n <= file->size - offset;
+}
+
+// Map a HAMT file in memory; return false if it cannot be read or is not a HAMT
+// file. The header is checked so that the root is in the file; maps and strings
+// are checked as lookups reach them (see hamt_file_get).
+bool hamt_file_open(HAMTFile* file, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void* base = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(HAMTFileHeader) ?
+        mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    HAMTFileHeader* header = base;
+    file->base = base;
+    file->size = st.st_size;
+    if (memcmp(header->magic, HAMT_FILE_MAGIC, sizeof(header->magic)) != 0 || header->size != (size_t)st.st_size ||
+        header->root_bits < HAMT_ROOT_BITS_MIN || header->root_bits > HAMT_ROOT_BITS_MAX ||
+        header->root % sizeof(Value) != 0 ||
+        !hamt_file_contains(file, header->root, ((uint64_t)1 << header->root_bits) * sizeof(HAMTNode))) {
+        hamt_file_close(file);
+        return false;
+    }
+    file->count = header->count;
+    file->root_bits = header->root_bits;
+    file->root = (HAMTNode*)((char*)base + header->root);
+    return true;
+}
+
+// The map at an offset in a HAMT file, or null if the map or its entries are
+// not in the file.
+static HAMTMap* hamt_file_map_at(HAMTFile* file, uint64_t offset, uint32_t shift) {
+    if (offset % sizeof(Value) != 0 || !hamt_file_contains(file, offset, sizeof(HAMTMap))) {
+        return 0;
+    }
+    HAMTMap* map = (HAMTMap*)(file->base + offset);
+    return hamt_file_contains(file, offset + sizeof(HAMTMap), hamt_map_size(map, shift)) ? map : 0;
+}
+
+// The string object that a value from a HAMT file refers to, or null if it is
+// not in the file or was not written by hamt_file_write (the garbage collector
+// would write to one that is not marked, and follow the pointers of a rope).
+static String* hamt_file_string(HAMTFile* file, Value v) {
+    uint64_t offset = VALUE_TO_POINTER(v);
+    if (offset % sizeof(Value) != 0 || !hamt_file_contains(file, offset, offsetof(String, chars))) {
+        return 0;
+    }
+    // The flags are read as bytes, since a corrupt file may have any byte there.
+    unsigned char* bytes = (unsigned char*)file->base + offset;
+    String* string = (String*)bytes;
+    if (bytes[offsetof(String, marked)] != true || bytes[offsetof(String, rope)] != false ||
+        bytes[offsetof(String, slice)] != false ||
+        string->length >= file->size - offset - offsetof(String, chars)) {
+        return 0;
+    }
+    return string;
+}
+
+// Whether a key from a HAMT file is equal to a key being looked up, which is in
+// memory, comparing the characters of string objects.
+static bool hamt_file_key_equal(HAMTFile* file, Value file_key, Value key) {
+    if (!hamt_is_string_object(key)) {
+        return VALUE_EQUAL(file_key, key);
+    }
+    if (!hamt_is_string_object(file_key)) {
+        return false;
+    }
+    String* a = hamt_file_string(file, file_key);
+    String* b = VALUE_TO_STRING(key);
+    return a && a->hash == b->hash && a->length == b->length && memcmp(a->chars, string_bytes(b), a->length) == 0;
+}
+
+// Get the value for a key from a HAMT file, like hamt_get (strings in the
+// value are in the file, so they are only valid until it is closed); return
+// VALUE_NONE if it was not found, or if the file is corrupt on the way to it.
+Value hamt_file_get(HAMTFile* file, Value key) {
+    uint64_t hash = value_hash(key);
+    HAMTNode* entry = HAMT_SLOT(file, hash);
+    if (VALUE_IS_HAMT_NODE(entry->key)) {
+        HAMTMap* map = hamt_file_map_at(file, (uintptr_t)entry->content.map, file->root_bits);
+        for (uint32_t shift = file->root_bits; ; shift += 5) {
+            if (!map) {
+                return VALUE_NONE;
+            }
+            if (shift >= 64) {
+                for (size_t i = 0; i < map->count; ++i) {
+                    if (hamt_file_key_equal(file, map->entries[i].key, key)) {
+                        entry = &map->entries[i];
+                        break;
+                    }
+                }
+                // If it was not found, entry is still the slot of the root,
+                // which does not match.
+                break;
+            }
+            uint32_t bit = HAMT_BIT(hash, shift);
+            if (map->datamap & bit) {
+                entry = hamt_map_entry(map, bit);
+                break;
+            }
+            if ((map->nodemap & bit) == 0) {
+                return VALUE_NONE;
+            }
+            map = hamt_file_map_at(file, (uintptr_t)hamt_map_node(map, bit), shift + 5);
         }
     }
+    if (!hamt_file_key_equal(file, entry->key, key)) {
+        return VALUE_NONE;
+    }
+    Value value = entry->content.value;
+    if (VALUE_IS_FUNCTION(value) || VALUE_IS_POINTER(value)) {
+        // These cannot be written, so they cannot be in a valid file.
+        return VALUE_NONE;
+    }
+    if (hamt_is_string_object(value)) {
+        String* string = hamt_file_string(file, value);
+        return string ? VALUE_FROM_STRING(string) : VALUE_NONE;
+    }
+    return value;
+}
+
+void hamt_file_close(HAMTFile* file) {
+    munmap(file->base, file->size);
+    file->base = 0;
+}
+
+#ifdef DEBUG
+static void hamt_debug_entry(HAMTNode* entry) {
+    value_print_debug(stderr, entry->key, true);
+    fputs(": ", stderr);
+    value_print_debug(stderr, entry->content.value, true);
+    fputs(", ", stderr);
+}
+
+static void hamt_debug_map(HAMTMap* map, uint32_t shift) {
+    for (size_t i = 0; i < hamt_map_count(map, shift); ++i) {
+        hamt_debug_entry(&map->entries[i]);
+    }
+    HAMTMap** nodes = hamt_map_nodes(map);
+    for (int i = 0; i < __builtin_popcount(map->nodemap); ++i) {
+        hamt_debug_map(nodes[i], shift + 5);
+    }
 }
 
 // Dump the whole hash and its count.
 void hamt_debug(HAMT* hamt) {
     fputs("### { ", stderr);
-    hamt_debug_node(&hamt->root);
+    for (size_t i = 0; hamt->root && i < (size_t)1 << hamt->root_bits; ++i) {
+        if (VALUE_IS_HAMT_NODE(hamt->root[i].key)) {
+            hamt_debug_map(hamt->root[i].content.map, hamt->root_bits);
+        } else if (!VALUE_IS_NONE(hamt->root[i].key)) {
+            hamt_debug_entry(&hamt->root[i]);
+        }
+    }
     fprintf(stderr, "}, count: %zu\n", hamt->count);
 }
 #endif
@@ -3,34 +3,104 @@
 
 #include "value.h"
 
-// A node in the tree is either an entry (key/value pair) or a map with a
-// bitmap (stored in the key, which is of type VALUE_HAMT_NODE) and a list
-// of 1 to 32 child nodes. The bitmap indicates which slots have a node or
-// not to avoid storing 32 pointers in each node.
+// A node in the tree is either an entry (key/value pair) or a map. Following
+// CHAMP (Steindorfer and Vinju, "Optimizing Hash-Array Mapped Tries for Fast
+// and Lean Immutable JVM Collections"), a map has two bitmaps, one for the
+// entries that it holds inline and one for its sub-maps, so the entries are
+// packed together at the front and the sub-maps are simple pointers at the
+// back. Maps are allocated from a pool and reference counted (see hamt.c).
 typedef struct HAMTNode {
-    size_t refcount;
     Value key;
     union {
         Value value;
-        struct HAMTNode* nodes;
+        struct HAMTMap* map;
     } content;
 } HAMTNode;
 
-// The HAMT keeps its count and a regular root node (it is not resized as in
-// the original paper).
+// The root of the HAMT is a flat array of 2^root_bits slots (as in the
+// original paper), indexed by the lowest bits of the hash of a key, which
+// doubles in size as the count grows. A slot is either empty (its key is
+// VALUE_NONE), an entry, or a map (its key is VALUE_HAMT_NODE). Below the
+// root, the remaining bits of the 64-bit hash are used 5 at a time; keys with
+// the same hash share a collision bucket (a map with a count of entries instead
+// of bitmaps) past the last bits, at the bottom.
+#define HAMT_ROOT_BITS_MIN 5
+#define HAMT_ROOT_BITS_MAX 20
+
 typedef struct {
     size_t count;
-    HAMTNode root;
+    uint32_t root_bits;
+    HAMTNode* root;
 } HAMT;
 
+// An iterator over the entries of a HAMT, which must not be updated in place
+// while it is in use. Its path goes down from a slot of the root through the
+// maps for every 5 bits of the hash that remain, then to a collision bucket.
+#define HAMT_DEPTH_MAX ((64 - HAMT_ROOT_BITS_MIN) / 5 + 2)
+
+typedef struct {
+    HAMT* hamt;
+    size_t slot;
+    size_t depth;
+    struct {
+        struct HAMTMap* map;
+        size_t index;
+    } path[HAMT_DEPTH_MAX];
+} HAMTIterator;
+
 void hamt_init(HAMT*);
 Value hamt_get(HAMT*, Value);
+void hamt_get_many(HAMT*, size_t, const Value*, Value*);
 Value hamt_get_string(HAMT*, String*);
 Value hamt_find_key(HAMT*, Value);
 void hamt_set(HAMT*, Value, Value);
 HAMT* hamt_with(HAMT*, Value, Value);
+HAMT* hamt_transient(HAMT*);
+HAMT* hamt_persist(HAMT*);
+HAMT* hamt_without(HAMT*, Value);
+void hamt_each(HAMT*, void (*)(Value, Value, void*), void*);
+void hamt_iterator_init(HAMTIterator*, HAMT*);
+bool hamt_iterator_next(HAMTIterator*, Value*, Value*);
+void hamt_diff(HAMT*, HAMT*, void (*)(Value, Value, Value, void*), void*);
+HAMT* hamt_merge(HAMT*, HAMT*);
+size_t hamt_footprint(HAMT*);
 void hamt_free(HAMT*);
 
+// A HAMT shared between threads, which get the current version to read it
+// without locking, or update it with hamt_with (see hamt.c). Every thread has
+// a number (from 0 to HAMT_SHARED_THREADS - 1) and its own hazard slot for the
+// version that it is reading, on its own cache line.
+#define HAMT_SHARED_THREADS 64
+
+typedef struct {
+    HAMT* current;
+    struct {
+        _Alignas(64) HAMT* hamt;
+    } hazards[HAMT_SHARED_THREADS];
+} HAMTShared;
+
+void hamt_shared_init(HAMTShared*);
+HAMT* hamt_shared_acquire(HAMTShared*, size_t);
+void hamt_shared_release(HAMTShared*, size_t);
+Value hamt_shared_get(HAMTShared*, size_t, Value);
+void hamt_shared_set(HAMTShared*, size_t, Value, Value);
+void hamt_shared_free(HAMTShared*);
+
+// A HAMT file mapped in memory (see hamt_file_write), with the same count and
+// root as the HAMT that was written; offsets in the file are from base.
+typedef struct {
+    size_t count;
+    uint32_t root_bits;
+    HAMTNode* root;
+    char* base;
+    size_t size;
+} HAMTFile;
+
+bool hamt_file_write(HAMT*, FILE*);
+bool hamt_file_open(HAMTFile*, const char*);
+Value hamt_file_get(HAMTFile*, Value);
+void hamt_file_close(HAMTFile*);
+
 #ifdef DEBUG
 void hamt_debug(HAMT*);
 #endif
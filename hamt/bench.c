@@ -0,0 +1,250 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hamt.h"
+#include "../intern.h"
+#include "../value.h"
+
+// Stress benchmark for the HAMT: set, get (one key at a time, then in batches)
+// and iterate over millions of number keys, add keys persistently and remove
+// them again (comparing each version with the previous one), then intern long
+// strings and look them up (also with the intern table of the VM, for
+// comparison). The footprint
+// of the HAMT is given in bytes per key. The strings are then written to a HAMT
+// file, and looked up again from the file once it is mapped. Finally, threads
+// read from a shared HAMT while another one adds new keys.
+#define KEYS 10000000
+#define STRINGS 1000000
+#define GET_MANY 256
+#define SHARED_KEYS 100000
+#define SHARED_READS 1000000
+#define SHARED_WRITES 10000
+#define SHARED_THREADS 8
+
+static double seconds_since(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void count_entry(Value key, Value value, void* count) {
+    *(size_t*)count += 1;
+}
+
+static void count_difference(Value key, Value a_value, Value b_value, void* count) {
+    *(size_t*)count += 1;
+}
+
+typedef struct {
+    HAMTShared* shared;
+    size_t thread;
+} Worker;
+
+static void* read_shared(void* data) {
+    Worker* worker = data;
+    for (size_t i = 0; i < SHARED_READS; ++i) {
+        size_t j = (i * 7919) % SHARED_KEYS;
+        if (!VALUE_EQUAL(hamt_shared_get(worker->shared, worker->thread, VALUE_FROM_NUMBER(j)),
+            VALUE_FROM_NUMBER(j))) {
+            fprintf(stderr, "!!! missing shared key %zu\n", j);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 0;
+}
+
+static void* write_shared(void* data) {
+    Worker* worker = data;
+    for (size_t i = SHARED_KEYS; i < SHARED_KEYS + SHARED_WRITES; ++i) {
+        hamt_shared_set(worker->shared, worker->thread, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i));
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[argc + 1]) {
+    size_t keys = argc > 1 ? strtoul(argv[1], 0, 10) : KEYS;
+    HAMT hamt;
+    hamt_init(&hamt);
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < keys; ++i) {
+        hamt_set(&hamt, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i));
+    }
+    printf("hamt_set: %zu keys in %.3f s (%.1f bytes/key)\n", hamt.count, seconds_since(&start),
+        (double)hamt_footprint(&hamt) / hamt.count);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < keys; ++i) {
+        if (!VALUE_EQUAL(hamt_get(&hamt, VALUE_FROM_NUMBER(i)), VALUE_FROM_NUMBER(i))) {
+            fprintf(stderr, "!!! missing key %zu\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("hamt_get: %zu keys in %.3f s\n", keys, seconds_since(&start));
+
+    // The same lookups, GET_MANY keys at a time.
+    Value batch_keys[GET_MANY];
+    Value batch_values[GET_MANY];
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < keys; i += GET_MANY) {
+        size_t n = keys - i < GET_MANY ? keys - i : GET_MANY;
+        for (size_t j = 0; j < n; ++j) {
+            batch_keys[j] = VALUE_FROM_NUMBER(i + j);
+        }
+        hamt_get_many(&hamt, n, batch_keys, batch_values);
+        for (size_t j = 0; j < n; ++j) {
+            if (!VALUE_EQUAL(batch_values[j], batch_keys[j])) {
+                fprintf(stderr, "!!! missing key %zu\n", i + j);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    printf("hamt_get_many: %zu keys in %.3f s\n", keys, seconds_since(&start));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t entries = 0;
+    for (size_t n = 0; n < 10; ++n) {
+        hamt_each(&hamt, count_entry, &entries);
+    }
+    printf("hamt_each: %zu entries in %.3f s\n", entries, seconds_since(&start));
+
+    hamt_free(&hamt);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    HAMT* h = hamt_with(&hamt, VALUE_FROM_NUMBER(0), VALUE_NIL);
+    for (size_t i = 1; i < keys / 10; ++i) {
+        HAMT* newh = hamt_with(h, VALUE_FROM_NUMBER(i * 10), VALUE_NIL);
+        hamt_free(h);
+        free(h);
+        h = newh;
+    }
+    printf("hamt_with: %zu keys in %.3f s (%.1f bytes/key)\n", h->count, seconds_since(&start),
+        (double)hamt_footprint(h) / h->count);
+
+    // Every new version differs from the previous one by a single key.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t differences = 0;
+    for (size_t i = 0; i < keys / 10; ++i) {
+        HAMT* newh = hamt_without(h, VALUE_FROM_NUMBER(i * 10));
+        hamt_diff(h, newh, count_difference, &differences);
+        hamt_free(h);
+        free(h);
+        h = newh;
+    }
+    printf("hamt_without/hamt_diff: %zu differences in %.3f s\n", differences, seconds_since(&start));
+    hamt_free(h);
+    free(h);
+
+    Value* strings = malloc(STRINGS * sizeof(Value));
+    for (size_t i = 0; i < STRINGS; ++i) {
+        char chars[32];
+        int length = snprintf(chars, sizeof(chars), "string number %zu", i);
+        strings[i] = value_copy_string(chars, length);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < STRINGS; ++i) {
+        if (VALUE_IS_NONE(hamt_get_string(&hamt, VALUE_TO_STRING(strings[i])))) {
+            hamt_set(&hamt, strings[i], strings[i]);
+        }
+    }
+    printf("hamt_get_string/hamt_set: %zu strings in %.3f s (%.1f bytes/key)\n", hamt.count,
+        seconds_since(&start), (double)hamt_footprint(&hamt) / hamt.count);
+
+    // Lookups in a table the size of a large string table, in a different
+    // order from the insertions.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t n = 0; n < 10; ++n) {
+        for (size_t i = 0; i < STRINGS; ++i) {
+            size_t j = (i * 7919) % STRINGS;
+            if (!VALUE_EQUAL(hamt_get_string(&hamt, VALUE_TO_STRING(strings[j])), strings[j])) {
+                fprintf(stderr, "!!! missing string %zu\n", j);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    printf("hamt_get_string: %zu lookups in %.3f s\n", 10 * (size_t)STRINGS, seconds_since(&start));
+
+    // The same strings in the intern table of the VM, for comparison.
+    InternTable table;
+    intern_init(&table);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < STRINGS; ++i) {
+        if (VALUE_IS_NONE(intern_get(&table, VALUE_TO_STRING(strings[i])))) {
+            intern_add(&table, strings[i]);
+        }
+    }
+    printf("intern_get/intern_add: %zu strings in %.3f s (%.1f bytes/key)\n", table.count,
+        seconds_since(&start), (double)table.groups * INTERN_GROUP * (1 + sizeof(String*)) / table.count);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t n = 0; n < 10; ++n) {
+        for (size_t i = 0; i < STRINGS; ++i) {
+            size_t j = (i * 7919) % STRINGS;
+            if (!VALUE_EQUAL(intern_get(&table, VALUE_TO_STRING(strings[j])), strings[j])) {
+                fprintf(stderr, "!!! missing interned string %zu\n", j);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    printf("intern_get: %zu lookups in %.3f s\n", 10 * (size_t)STRINGS, seconds_since(&start));
+    intern_free(&table);
+
+    // The same table written to a file, then mapped and looked up in place.
+    char path[] = "/tmp/hamt-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* stream = fd < 0 ? 0 : fdopen(fd, "w");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!stream || !hamt_file_write(&hamt, stream) || fclose(stream) != 0) {
+        fprintf(stderr, "!!! could not write %s\n", path);
+        return EXIT_FAILURE;
+    }
+    printf("hamt_file_write: %zu strings in %.3f s\n", hamt.count, seconds_since(&start));
+    HAMTFile file;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!hamt_file_open(&file, path) || !value_equal(hamt_file_get(&file, strings[0]), strings[0])) {
+        fprintf(stderr, "!!! could not open %s\n", path);
+        return EXIT_FAILURE;
+    }
+    printf("hamt_file_open/hamt_file_get: %zu bytes in %.1f us\n", file.size, seconds_since(&start) * 1e6);
+    unlink(path);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t n = 0; n < 10; ++n) {
+        for (size_t i = 0; i < STRINGS; ++i) {
+            size_t j = (i * 7919) % STRINGS;
+            if (VALUE_IS_NONE(hamt_file_get(&file, strings[j]))) {
+                fprintf(stderr, "!!! missing string %zu in file\n", j);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    printf("hamt_file_get: %zu lookups in %.3f s\n", 10 * (size_t)STRINGS, seconds_since(&start));
+    hamt_file_close(&file);
+    hamt_free(&hamt);
+
+    // Every reader makes SHARED_READS lookups, and the writer (thread 0) adds
+    // SHARED_WRITES keys.
+    HAMTShared shared;
+    hamt_shared_init(&shared);
+    for (size_t i = 0; i < SHARED_KEYS; ++i) {
+        hamt_shared_set(&shared, 0, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i));
+    }
+    Worker workers[SHARED_THREADS + 1];
+    pthread_t threads[SHARED_THREADS + 1];
+    for (size_t readers = 1; readers <= SHARED_THREADS; readers *= 2) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i <= readers; ++i) {
+            workers[i] = (Worker){ .shared = &shared, .thread = i };
+            pthread_create(&threads[i], 0, i == 0 ? write_shared : read_shared, &workers[i]);
+        }
+        for (size_t i = 0; i <= readers; ++i) {
+            pthread_join(threads[i], 0);
+        }
+        printf("hamt_shared: %zu readers and 1 writer in %.3f s\n", readers, seconds_since(&start));
+    }
+    hamt_shared_free(&shared);
+
+    return EXIT_SUCCESS;
+}
@@ -1,10 +1,52 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../hamt.h"
+#include "../intern.h"
 #include "../value.h"
 
+static void count_entry(Value key, Value value, void* count) {
+    *(size_t*)count += 1;
+}
+
+static void count_difference(Value key, Value a_value, Value b_value, void* count) {
+    fputs("diff ", stderr);
+    value_print_debug(stderr, key, true);
+    fputs(": ", stderr);
+    value_print_debug(stderr, a_value, true);
+    fputs(" -> ", stderr);
+    value_print_debug(stderr, b_value, true);
+    fputs("\n", stderr);
+    *(size_t*)count += 1;
+}
+
+// Count the entries of a HAMT with an iterator, or return 0 if it gives an
+// entry that is not in the HAMT.
+static size_t count_iterated(HAMT* hamt) {
+    HAMTIterator iterator;
+    hamt_iterator_init(&iterator, hamt);
+    size_t count = 0;
+    Value key;
+    Value value;
+    while (hamt_iterator_next(&iterator, &key, &value)) {
+        if (!VALUE_EQUAL(hamt_get(hamt, key), value)) {
+            return 0;
+        }
+        count += 1;
+    }
+    return count;
+}
+
+// Count the entries of a HAMT that are missing from a HAMT file.
+static void check_file_entry(Value key, Value value, void* data) {
+    void** context = data;
+    if (!value_equal(hamt_file_get(context[0], key), value)) {
+        *(size_t*)context[1] += 1;
+    }
+}
+
 int main(int argc, char* argv[argc + 1]) {
     HAMT hamt;
     hamt_init(&hamt);
@@ -21,15 +63,315 @@ int main(int argc, char* argv[argc + 1]) {
     fprintf(stderr, "h2   <%p> ", (void*)h2);
     hamt_debug(h2);
 
+    // hamt has 17 and 31, h2 has a different value for 31 and also 111.
+    size_t differences = 0;
+    hamt_diff(&hamt, h2, count_difference, &differences);
+    HAMT* h4 = hamt_merge(h1, h2);
+    HAMT* h5 = hamt_without(h4, VALUE_FROM_NUMBER(111));
+    fprintf(stderr, "h5   <%p> ", (void*)h5);
+    hamt_debug(h5);
+    if (differences != 2 || h4->count != 3 || h5->count != 2 ||
+        !VALUE_EQUAL(hamt_get(h4, VALUE_FROM_NUMBER(31)), VALUE_FROM_NUMBER(71)) ||
+        !VALUE_IS_NONE(hamt_get(h5, VALUE_FROM_NUMBER(111))) ||
+        !VALUE_EQUAL(hamt_get(h4, VALUE_FROM_NUMBER(111)), VALUE_FROM_NUMBER(223))) {
+        fprintf(stderr, "!!! wrong diff or merge\n");
+        return EXIT_FAILURE;
+    }
+
     hamt_free(h1);
     hamt_free(h2);
+    hamt_free(h4);
+    hamt_free(h5);
     fprintf(stderr, "hamt <%p> ", (void*)&hamt);
     hamt_debug(&hamt);
 
-    // TODO test numbers from 0 to 131151 (double collision)
+    // Numbers from 0 to 131151 used to have a double collision with a 32-bit
+    // hash.
+    for (size_t i = 0; i < 1131152; ++i) {
+        hamt_set(&hamt, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i + 1));
+    }
     for (size_t i = 0; i < 1131152; ++i) {
-        hamt_set(&hamt, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(0));
+        if (!VALUE_EQUAL(hamt_get(&hamt, VALUE_FROM_NUMBER(i)), VALUE_FROM_NUMBER(i + 1))) {
+            fprintf(stderr, "!!! missing key %zu\n", i);
+            return EXIT_FAILURE;
+        }
     }
+    // Batches of keys, some of them missing.
+    Value keys[100];
+    Value values[100];
+    for (size_t i = 0; i < 100; ++i) {
+        keys[i] = VALUE_FROM_NUMBER(i % 3 ? i * 11311 : -(double)i);
+    }
+    hamt_get_many(&hamt, 100, keys, values);
+    for (size_t i = 0; i < 100; ++i) {
+        if (!VALUE_EQUAL(values[i], hamt_get(&hamt, keys[i])) || VALUE_IS_NONE(values[i]) != (i % 3 == 0)) {
+            fprintf(stderr, "!!! wrong batch of keys\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (count_iterated(&hamt) != hamt.count ||
+        !VALUE_EQUAL(hamt_find_key(&hamt, VALUE_FROM_NUMBER(777778)), VALUE_FROM_NUMBER(777777))) {
+        fprintf(stderr, "!!! wrong iteration\n");
+        return EXIT_FAILURE;
+    }
+    // Remove one key from this large HAMT, then add and remove keys from a HAMT
+    // with a small root (since hamt_with does not grow it) so that maps collapse
+    // as they become empty.
+    HAMT* h6 = hamt_without(&hamt, VALUE_FROM_NUMBER(12345));
+    differences = 0;
+    hamt_diff(&hamt, h6, count_difference, &differences);
+    if (differences != 1 || h6->count != hamt.count - 1 ||
+        !VALUE_IS_NONE(hamt_get(h6, VALUE_FROM_NUMBER(12345)))) {
+        fprintf(stderr, "!!! key was not removed\n");
+        return EXIT_FAILURE;
+    }
+    hamt_free(h6);
     hamt_free(&hamt);
+
+    HAMT* h7 = hamt_transient(&hamt);
+    for (size_t i = 0; i < 2000; ++i) {
+        HAMT* h = hamt_with(h7, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i));
+        hamt_free(h7);
+        h7 = h;
+    }
+    if (count_iterated(h7) != 2000) {
+        fprintf(stderr, "!!! wrong iteration\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < 2000; ++i) {
+        HAMT* h = hamt_without(h7, VALUE_FROM_NUMBER(i));
+        for (size_t j = i; j < 2000 && i % 100 == 0; ++j) {
+            if (!VALUE_EQUAL(hamt_get(h7, VALUE_FROM_NUMBER(j)), VALUE_FROM_NUMBER(j)) ||
+                (j > i && !VALUE_EQUAL(hamt_get(h, VALUE_FROM_NUMBER(j)), VALUE_FROM_NUMBER(j)))) {
+                fprintf(stderr, "!!! missing key %zu after removing %zu\n", j, i);
+                return EXIT_FAILURE;
+            }
+        }
+        hamt_free(h7);
+        h7 = h;
+    }
+    size_t entries = 0;
+    hamt_each(h7, count_entry, &entries);
+    if (h7->count != 0 || entries != 0) {
+        fprintf(stderr, "!!! keys were not removed\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < (size_t)1 << h7->root_bits; ++i) {
+        if (!VALUE_IS_NONE(h7->root[i].key)) {
+            fprintf(stderr, "!!! map did not collapse\n");
+            return EXIT_FAILURE;
+        }
+    }
+    hamt_free(h7);
+
+    // Strings with the same full hash go into a collision bucket.
+    Value strings[40];
+    for (size_t i = 0; i < 40; ++i) {
+        char chars[16];
+        int length = snprintf(chars, sizeof(chars), "collision %zu", i);
+        strings[i] = value_copy_string(chars, length);
+        VALUE_TO_STRING(strings[i])->hash = 0x5eed;
+    }
+    HAMT interned;
+    hamt_init(&interned);
+    for (size_t i = 0; i < 40; ++i) {
+        hamt_set(&hamt, strings[i], VALUE_FROM_NUMBER(i));
+        hamt_set(&interned, strings[i], strings[i]);
+    }
+    HAMT* h3 = hamt_with(&hamt, strings[3], VALUE_FROM_NUMBER(333));
+    hamt_set(&hamt, strings[4], VALUE_FROM_NUMBER(444));
+    for (size_t i = 0; i < 40; ++i) {
+        if (!VALUE_EQUAL(hamt_get_string(&interned, VALUE_TO_STRING(strings[i])), strings[i]) ||
+            !VALUE_EQUAL(hamt_get(&hamt, strings[i]), VALUE_FROM_NUMBER(i == 4 ? 444 : i)) ||
+            !VALUE_EQUAL(hamt_get(h3, strings[i]), VALUE_FROM_NUMBER(i == 3 ? 333 : i))) {
+            fprintf(stderr, "!!! missing colliding key %zu\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    fprintf(stderr, "hamt <%p> count: %zu, h3 <%p> count: %zu\n", (void*)&hamt, hamt.count, (void*)h3, h3->count);
+    hamt_get_many(&hamt, 40, strings, values);
+    for (size_t i = 0; i < 40; ++i) {
+        if (!VALUE_EQUAL(values[i], VALUE_FROM_NUMBER(i == 4 ? 444 : i))) {
+            fprintf(stderr, "!!! wrong batch of colliding keys\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (size_t i = 0; i < 39; ++i) {
+        HAMT* h = hamt_without(h3, strings[i]);
+        hamt_free(h3);
+        h3 = h;
+    }
+    if (h3->count != 1 || !VALUE_EQUAL(hamt_get(h3, strings[39]), VALUE_FROM_NUMBER(39)) ||
+        !VALUE_EQUAL(hamt_get(&hamt, strings[3]), VALUE_FROM_NUMBER(3))) {
+        fprintf(stderr, "!!! wrong colliding keys after removal\n");
+        return EXIT_FAILURE;
+    }
+
+    // Write the HAMT to a file with a long string value, then map it and look up
+    // all its keys, and a copy of a colliding string.
+    hamt_set(&hamt, VALUE_FROM_NUMBER(-1), strings[0]);
+    char path[] = "/tmp/hamt-test-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* stream = fd < 0 ? 0 : fdopen(fd, "w");
+    HAMTFile file;
+    if (!stream || !hamt_file_write(&hamt, stream) || fclose(stream) != 0 || !hamt_file_open(&file, path)) {
+        fprintf(stderr, "!!! could not write or open a HAMT file\n");
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+    size_t missing = 0;
+    hamt_each(&hamt, check_file_entry, (void*[]){ &file, &missing });
+    Value copy = value_copy_string("collision 5", 11);
+    VALUE_TO_STRING(copy)->hash = 0x5eed;
+    Value value = hamt_file_get(&file, VALUE_FROM_NUMBER(-1));
+    if (missing > 0 || file.count != hamt.count || count_iterated(&hamt) != hamt.count ||
+        !VALUE_EQUAL(hamt_file_get(&file, copy), VALUE_FROM_NUMBER(5)) ||
+        !VALUE_IS_NONE(hamt_file_get(&file, VALUE_FROM_NUMBER(-2))) ||
+        VALUE_EQUAL(value, strings[0]) || !value_equal(value, strings[0])) {
+        fprintf(stderr, "!!! wrong HAMT file (%zu missing)\n", missing);
+        return EXIT_FAILURE;
+    }
+    hamt_file_close(&file);
+    free(VALUE_TO_STRING(copy));
+
+    // A file whose root does not fit in it is not opened. The root bits come
+    // after the magic and the count in the header.
+    uint64_t root_bits = 40;
+    fd = mkstemp(strcpy(path, "/tmp/hamt-test-XXXXXX"));
+    stream = fd < 0 ? 0 : fdopen(fd, "w");
+    if (!stream || !hamt_file_write(&hamt, stream) || fseek(stream, 16, SEEK_SET) != 0 ||
+        fwrite(&root_bits, sizeof(root_bits), 1, stream) != 1 || fclose(stream) != 0) {
+        fprintf(stderr, "!!! could not write a HAMT file\n");
+        return EXIT_FAILURE;
+    }
+    if (hamt_file_open(&file, path)) {
+        fprintf(stderr, "!!! opened a HAMT file whose root is not in it\n");
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+
+    // Colliding strings fill more than a group of the intern table.
+    InternTable table;
+    intern_init(&table);
+    for (size_t i = 0; i < 40; ++i) {
+        if (!VALUE_IS_NONE(intern_get(&table, VALUE_TO_STRING(strings[i])))) {
+            fprintf(stderr, "!!! string %zu interned too early\n", i);
+            return EXIT_FAILURE;
+        }
+        intern_add(&table, strings[i]);
+    }
+    // Only the marked strings stay interned.
+    for (size_t i = 0; i < 40; ++i) {
+        VALUE_TO_STRING(strings[i])->marked = i % 2 == 0;
+    }
+    intern_sweep(&table);
+    for (size_t i = 0; i < 40; ++i) {
+        if (VALUE_EQUAL(intern_get(&table, VALUE_TO_STRING(strings[i])), strings[i]) != (i % 2 == 0)) {
+            fprintf(stderr, "!!! wrong interned string %zu\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    copy = value_copy_string("collision 4", 11);
+    VALUE_TO_STRING(copy)->hash = 0x5eed;
+    if (!VALUE_EQUAL(intern_get(&table, VALUE_TO_STRING(copy)), strings[4])) {
+        fprintf(stderr, "!!! string was not interned\n");
+        return EXIT_FAILURE;
+    }
+    free(VALUE_TO_STRING(copy));
+    intern_debug(&table);
+    intern_free(&table);
+
+    // Ropes built by appending and by prepending the colliding strings are
+    // found by the flat strings with the same characters.
+    Value ropes[2][40];
+    char chars[2][40 * 16];
+    size_t lengths[2] = { 0, 0 };
+    for (size_t i = 0; i < 40; ++i) {
+        ropes[0][i] = value_concatenate_strings(i == 0 ? VALUE_EPSILON : ropes[0][i - 1], strings[i]);
+        ropes[1][i] = value_concatenate_strings(strings[i], i == 0 ? VALUE_EPSILON : ropes[1][i - 1]);
+        lengths[0] += snprintf(chars[0] + lengths[0], sizeof(chars[0]) - lengths[0], "collision %zu", i);
+        int length = snprintf(0, 0, "collision %zu", i);
+        memmove(chars[1] + length, chars[1], lengths[1]);
+        memcpy(chars[1], VALUE_TO_CSTRING(strings[i]), length);
+        lengths[1] += length;
+    }
+    HAMT rope_keys;
+    hamt_init(&rope_keys);
+    for (size_t j = 0; j < 2; ++j) {
+        Value rope = ropes[j][39];
+        Value flat = value_copy_string(chars[j], lengths[j]);
+        if (!VALUE_TO_STRING(rope)->rope || VALUE_TO_STRING(rope)->length != lengths[j]) {
+            fprintf(stderr, "!!! no rope %zu\n", j);
+            return EXIT_FAILURE;
+        }
+        hamt_set(&rope_keys, rope, rope);
+        if (!VALUE_EQUAL(hamt_get_string(&rope_keys, VALUE_TO_STRING(flat)), rope) || !value_equal(flat, rope) ||
+            strcmp(value_to_cstring(rope), chars[j]) != 0) {
+            fprintf(stderr, "!!! wrong rope %zu\n", j);
+            return EXIT_FAILURE;
+        }
+        free(VALUE_TO_STRING(flat));
+    }
+    hamt_free(&rope_keys);
+
+    // A slice of a rope of ropes, and a slice of that slice (of the same rope),
+    // hash and compare like the flat strings with the same characters, and get
+    // their own characters when a C string is needed.
+    Value halves[2] = {
+        value_concatenate_strings(ropes[0][39], ropes[1][39]),
+        value_concatenate_strings(ropes[0][39], ropes[1][39]),
+    };
+    Value whole = value_concatenate_strings(halves[0], halves[1]);
+    char whole_chars[4 * 40 * 16];
+    snprintf(whole_chars, sizeof(whole_chars), "%.*s%.*s%.*s%.*s", (int)lengths[0], chars[0],
+        (int)lengths[1], chars[1], (int)lengths[0], chars[0], (int)lengths[1], chars[1]);
+    Value slices[2] = { value_string_slice(whole, 5, 5 + 1200) };
+    slices[1] = value_string_slice(slices[0], 50, 50 + 1100);
+    for (size_t j = 0; j < 2; ++j) {
+        Slice* slice = (Slice*)VALUE_TO_STRING(slices[j]);
+        size_t offset = 5 + 50 * j;
+        Value flat = value_copy_string(whole_chars + offset, slice->length);
+        if (!slice->slice || slice->length != 1200 - 100 * j || slice->offset != offset ||
+            !VALUE_EQUAL(slice->parent, whole)) {
+            fprintf(stderr, "!!! no slice %zu\n", j);
+            return EXIT_FAILURE;
+        }
+        if (!value_equal(flat, slices[j]) || value_hash(flat) != value_hash(slices[j]) ||
+            strncmp(value_to_cstring(slices[j]), whole_chars + offset, slice->length) != 0 ||
+            strlen(value_to_cstring(slices[j])) != slice->length || !VALUE_IS_NONE(slice->parent)) {
+            fprintf(stderr, "!!! wrong slice %zu\n", j);
+            return EXIT_FAILURE;
+        }
+        free(VALUE_TO_STRING(flat));
+        value_free_object(slices[j]);
+    }
+    value_free_object(whole);
+    value_free_object(halves[0]);
+    value_free_object(halves[1]);
+    for (size_t i = 1; i < 40; ++i) {
+        value_free_object(ropes[0][i]);
+        value_free_object(ropes[1][i]);
+    }
+
+    hamt_free(h3);
+    hamt_free(&hamt);
+    hamt_free(&interned);
+
+    // A shared HAMT, used by a single thread here (see shared.c for threads).
+    HAMTShared shared;
+    hamt_shared_init(&shared);
+    for (size_t i = 0; i < 1000; ++i) {
+        hamt_shared_set(&shared, 0, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i));
+    }
+    HAMT* snapshot = hamt_shared_acquire(&shared, 0);
+    for (size_t i = 0; i < 1000; ++i) {
+        if (!VALUE_EQUAL(hamt_get(snapshot, VALUE_FROM_NUMBER(i)), VALUE_FROM_NUMBER(i)) ||
+            !VALUE_EQUAL(hamt_shared_get(&shared, 1, VALUE_FROM_NUMBER(i)), VALUE_FROM_NUMBER(i))) {
+            fprintf(stderr, "!!! missing shared key %zu\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    hamt_shared_release(&shared, 0);
+    hamt_shared_free(&shared);
     return EXIT_SUCCESS;
 }
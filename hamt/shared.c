@@ -0,0 +1,97 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../hamt.h"
+
+// Check a HAMT shared between threads; it is built with ThreadSanitizer (see
+// the makefile) so that races on the hazard pointers, the current version and
+// the reference counts of maps are reported. Writers add keys of their own
+// while readers look up keys that are always there, and read snapshots that
+// must not change while they hold them. Every key that was added must be there
+// at the end.
+#define KEYS 1000
+#define WRITERS 2
+#define WRITES 2000
+#define READERS 4
+#define READS 20000
+#define SNAPSHOT_EVERY 100
+
+typedef struct {
+    HAMTShared* shared;
+    size_t thread;
+} Worker;
+
+static void* write_shared(void* data) {
+    Worker* worker = data;
+    size_t first = KEYS + worker->thread * WRITES;
+    for (size_t i = first; i < first + WRITES; ++i) {
+        hamt_shared_set(worker->shared, worker->thread, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i));
+    }
+    return 0;
+}
+
+static void* read_shared(void* data) {
+    Worker* worker = data;
+    for (size_t i = 0; i < READS; ++i) {
+        size_t j = (i * 7919) % KEYS;
+        if (!VALUE_EQUAL(hamt_shared_get(worker->shared, worker->thread, VALUE_FROM_NUMBER(j)),
+            VALUE_FROM_NUMBER(j))) {
+            fprintf(stderr, "!!! missing shared key %zu\n", j);
+            exit(EXIT_FAILURE);
+        }
+        if (i % SNAPSHOT_EVERY == 0) {
+            // Keys added by writers are either in the snapshot with their
+            // value or not at all, and the snapshot keeps its count.
+            HAMT* snapshot = hamt_shared_acquire(worker->shared, worker->thread);
+            size_t count = snapshot->count;
+            for (size_t k = KEYS; k < KEYS + WRITERS * WRITES; k += 7) {
+                Value value = hamt_get(snapshot, VALUE_FROM_NUMBER(k));
+                if (!VALUE_IS_NONE(value) && !VALUE_EQUAL(value, VALUE_FROM_NUMBER(k))) {
+                    fprintf(stderr, "!!! wrong shared value for %zu\n", k);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (snapshot->count != count) {
+                fprintf(stderr, "!!! snapshot changed from %zu to %zu keys\n", count, snapshot->count);
+                exit(EXIT_FAILURE);
+            }
+            hamt_shared_release(worker->shared, worker->thread);
+        }
+    }
+    return 0;
+}
+
+int main(void) {
+    HAMTShared shared;
+    hamt_shared_init(&shared);
+    for (size_t i = 0; i < KEYS; ++i) {
+        hamt_shared_set(&shared, 0, VALUE_FROM_NUMBER(i), VALUE_FROM_NUMBER(i));
+    }
+
+    // Writers are threads 0 to WRITERS - 1, and readers come after them.
+    Worker workers[WRITERS + READERS];
+    pthread_t threads[WRITERS + READERS];
+    for (size_t i = 0; i < WRITERS + READERS; ++i) {
+        workers[i] = (Worker){ .shared = &shared, .thread = i };
+        pthread_create(&threads[i], 0, i < WRITERS ? write_shared : read_shared, &workers[i]);
+    }
+    for (size_t i = 0; i < WRITERS + READERS; ++i) {
+        pthread_join(threads[i], 0);
+    }
+
+    HAMT* hamt = hamt_shared_acquire(&shared, 0);
+    if (hamt->count != KEYS + WRITERS * WRITES) {
+        fprintf(stderr, "!!! %zu shared keys instead of %d\n", hamt->count, KEYS + WRITERS * WRITES);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < KEYS + WRITERS * WRITES; ++i) {
+        if (!VALUE_EQUAL(hamt_get(hamt, VALUE_FROM_NUMBER(i)), VALUE_FROM_NUMBER(i))) {
+            fprintf(stderr, "!!! missing shared key %zu\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    hamt_shared_release(&shared, 0);
+    hamt_shared_free(&shared);
+    return EXIT_SUCCESS;
+}
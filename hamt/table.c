@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hamt.h"
+#include "../value.h"
+
+// hamt-table <file>
+// Build a HAMT file (see hamt_file_write) from lines of a key and a value
+// separated by a tab on stdin, for relox --table. Keys and values that are
+// numbers, nil, true or false are read as such, and as strings otherwise; equal
+// strings are only written once. A key that appears again replaces the
+// previous value.
+
+static Value read_value(HAMT* strings, char* chars, size_t length) {
+    if (length == 3 && memcmp(chars, "nil", 3) == 0) {
+        return VALUE_NIL;
+    }
+    if (length == 4 && memcmp(chars, "true", 4) == 0) {
+        return VALUE_TRUE;
+    }
+    if (length == 5 && memcmp(chars, "false", 5) == 0) {
+        return VALUE_FALSE;
+    }
+    char* end;
+    double number = strtod(chars, &end);
+    if (length > 0 && end == chars + length) {
+        return VALUE_FROM_NUMBER(number);
+    }
+    Value v = value_copy_string(chars, length);
+    if (VALUE_IS_STRING(v) && !VALUE_IS_EPSILON(v) && !VALUE_IS_SHORT_STRING(v)) {
+        Value interned = hamt_get_string(strings, VALUE_TO_STRING(v));
+        if (VALUE_IS_STRING(interned)) {
+            free(VALUE_TO_STRING(v));
+            return interned;
+        }
+        hamt_set(strings, v, v);
+    }
+    return v;
+}
+
+static void free_string(Value key, Value value, void* unused) {
+    free(VALUE_TO_STRING(key));
+}
+
+int main(int argc, char* argv[argc + 1]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <file> < <keys and values>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    HAMT table;
+    HAMT strings;
+    hamt_init(&table);
+    hamt_init(&strings);
+    char* line = 0;
+    size_t size = 0;
+    ssize_t length;
+    for (size_t number = 1; (length = getline(&line, &size, stdin)) >= 0; ++number) {
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = 0;
+        }
+        char* tab = memchr(line, '\t', length);
+        if (!tab) {
+            fprintf(stderr, "No tab on line %zu.\n", number);
+            return EXIT_FAILURE;
+        }
+        *tab = 0;
+        Value key = read_value(&strings, line, tab - line);
+        Value value = read_value(&strings, tab + 1, line + length - tab - 1);
+        hamt_set(&table, key, value);
+    }
+    free(line);
+
+    FILE* file = fopen(argv[1], "w");
+    if (!file) {
+        fprintf(stderr, "Could not open \"%s\" for writing. ", argv[1]);
+        perror(0);
+        return EXIT_FAILURE;
+    }
+    bool written = hamt_file_write(&table, file);
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Could not write \"%s\". ", argv[1]);
+        perror(0);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%zu entries\n", table.count);
+    hamt_free(&table);
+    hamt_each(&strings, free_string, 0);
+    hamt_free(&strings);
+    return EXIT_SUCCESS;
+}
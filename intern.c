@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "intern.h"
+
+void intern_init(InternTable* table) {
+    table->count = 0;
+    table->groups = 0;
+    table->tags = 0;
+    table->strings = 0;
+}
+
+// The tag of a hash uses its highest bits, since the lowest ones select the
+// group.
+#define INTERN_TAG(hash) ((uint8_t)((hash) >> 57))
+
+// One bit for every slot of a group that has a tag.
+static uint32_t intern_match(uint8_t* tags, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((__m128i*)tags);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < INTERN_GROUP; ++i) {
+        bits |= (uint32_t)(tags[i] == tag) << i;
+    }
+    return bits;
+#endif
+}
+
+// Get the interned string equal to a string; return VALUE_NONE if there is none.
+// Groups are probed from the one given by the lowest bits of the hash, one,
+// then two, then three groups further and so on (wrapping around), which goes
+// through all the groups since their number is a power of two.
+Value intern_get(InternTable* table, String* string) {
+    if (table->groups == 0) {
+        return VALUE_NONE;
+    }
+    uint64_t hash = string_hash(string);
+    uint8_t tag = INTERN_TAG(hash);
+    size_t mask = table->groups - 1;
+    for (size_t g = hash & mask, step = 1; ; g = (g + step++) & mask) {
+        uint8_t* tags = &table->tags[g * INTERN_GROUP];
+        for (uint32_t bits = intern_match(tags, tag); bits; bits &= bits - 1) {
+            String* interned = table->strings[g * INTERN_GROUP + __builtin_ctz(bits)];
+            if (string_equal(interned, string)) {
+                return VALUE_FROM_STRING(interned);
+            }
+        }
+        // A string would have gone into the first empty slot.
+        if (intern_match(tags, INTERN_EMPTY)) {
+            return VALUE_NONE;
+        }
+    }
+}
+
+// Put a string in the first empty slot for its hash.
+static void intern_insert(InternTable* table, String* string) {
+    uint64_t hash = string_hash(string);
+    size_t mask = table->groups - 1;
+    for (size_t g = hash & mask, step = 1; ; g = (g + step++) & mask) {
+        uint32_t bits = intern_match(&table->tags[g * INTERN_GROUP], INTERN_EMPTY);
+        if (bits) {
+            size_t i = g * INTERN_GROUP + __builtin_ctz(bits);
+            table->tags[i] = INTERN_TAG(hash);
+            table->strings[i] = string;
+            return;
+        }
+    }
+}
+
+// Double the number of groups and add the strings again.
+static void intern_grow(InternTable* table) {
+    size_t groups = table->groups;
+    uint8_t* tags = table->tags;
+    String** strings = table->strings;
+    table->groups = groups == 0 ? INTERN_GROUPS_MIN : 2 * groups;
+    table->tags = aligned_alloc(INTERN_GROUP, table->groups * INTERN_GROUP);
+    table->strings = malloc(table->groups * INTERN_GROUP * sizeof(String*));
+    memset(table->tags, INTERN_EMPTY, table->groups * INTERN_GROUP);
+    for (size_t i = 0; i < groups * INTERN_GROUP; ++i) {
+        if (tags[i] != INTERN_EMPTY) {
+            intern_insert(table, strings[i]);
+        }
+    }
+    free(tags);
+    free(strings);
+#ifdef DEBUG
+    fprintf(stderr, "+++ intern_grow() %zu groups for %zu strings\n", table->groups, table->count);
+#endif
+}
+
+// Add a string that is not interned yet, keeping the table at most 7/8 full.
+void intern_add(InternTable* table, Value v) {
+    if (8 * (table->count + 1) > 7 * table->groups * INTERN_GROUP) {
+        intern_grow(table);
+    }
+    // Interned strings live long and are compared often, so a slice gets its
+    // own characters, and no longer keeps its parent alive.
+    if (VALUE_TO_STRING(v)->slice) {
+        string_chars(VALUE_TO_STRING(v));
+    }
+    intern_insert(table, VALUE_TO_STRING(v));
+    table->count += 1;
+}
+
+// Remove the strings that are not marked, before the garbage collector frees
+// them (see gc_collect): if there are any, the table is emptied and the other
+// strings are added again.
+void intern_sweep(InternTable* table) {
+    String** marked = malloc(table->count * sizeof(String*));
+    size_t count = 0;
+    for (size_t i = 0; i < table->groups * INTERN_GROUP; ++i) {
+        if (table->tags[i] != INTERN_EMPTY && table->strings[i]->marked) {
+            marked[count++] = table->strings[i];
+        }
+    }
+    if (count < table->count) {
+        memset(table->tags, INTERN_EMPTY, table->groups * INTERN_GROUP);
+        for (size_t i = 0; i < count; ++i) {
+            intern_insert(table, marked[i]);
+        }
+        table->count = count;
+    }
+    free(marked);
+}
+
+void intern_free(InternTable* table) {
+    free(table->tags);
+    free(table->strings);
+    intern_init(table);
+}
+
+#ifdef DEBUG
+void intern_debug(InternTable* table) {
+    fputs("### { ", stderr);
+    for (size_t i = 0; i < table->groups * INTERN_GROUP; ++i) {
+        if (table->tags[i] != INTERN_EMPTY) {
+            value_print_debug(stderr, VALUE_FROM_STRING(table->strings[i]), true);
+            fputs(", ", stderr);
+        }
+    }
+    fprintf(stderr, "}, count: %zu\n", table->count);
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef __INTERN_H__
+#define __INTERN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+// The table of interned strings of the VM, a hash set of long strings with
+// open addressing (after the Swiss tables of Abseil). Slots come in groups of
+// INTERN_GROUP, and every slot has a tag byte, either INTERN_EMPTY or 7 bits of
+// the hash of its string; the tags of a group are compared with the tag of a
+// string all at once, so that only the strings with the same tag get compared.
+// Strings are never removed one by one: the strings that survive a collection
+// are added again to an empty table (see intern_sweep).
+#define INTERN_GROUP 16
+#define INTERN_EMPTY 0x80
+#define INTERN_GROUPS_MIN 4
+
+typedef struct {
+    size_t count;
+    // The number of groups is a power of two.
+    size_t groups;
+    uint8_t* tags;
+    String** strings;
+} InternTable;
+
+void intern_init(InternTable*);
+Value intern_get(InternTable*, String*);
+void intern_add(InternTable*, Value);
+void intern_sweep(InternTable*);
+void intern_free(InternTable*);
+
+#ifdef DEBUG
+void intern_debug(InternTable*);
+#endif
+
+#endif
@@ -0,0 +1,1135 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+#include "array.h"
+
+// A copy-and-patch compiler: every instruction is translated by copying a
+// template of native code (assembled once and kept below as bytes), then
+// patching its holes with the operands of the instruction. Native code keeps
+// the VM in r13, the slots of the frame in r12, and the stack pointer in rbx;
+// values stay on the VM stack so that helpers (and the interpreter, for calls)
+// can see them. Anything that is not fast path (string operations, errors,
+// calls, printing...) is left to helper functions written in C.
+
+typedef enum {
+    hole_value,
+    hole_helper,
+    hole_slot,
+    hole_target,
+    hole_error,
+    hole_argument,
+} HoleKind;
+
+#define HOLES_MAX 4
+
+typedef struct {
+    size_t offset;
+    HoleKind kind;
+} Hole;
+
+typedef struct {
+    const uint8_t* bytes;
+    size_t size;
+    size_t holes_count;
+    Hole holes[HOLES_MAX];
+} Template;
+
+typedef enum {
+    template_prologue,
+    template_error,
+    template_return,
+    template_push,
+    template_get_local,
+    template_set_local,
+    template_set_local_pop,
+    template_pop,
+    template_dup,
+    template_jump,
+    template_jump_false,
+    template_jump_false_pop,
+    template_jump_true,
+    template_add,
+    template_subtract,
+    template_multiply,
+    template_divide,
+    template_lt,
+    template_lt_jump_false,
+    template_le,
+    template_le_jump_false,
+    template_gt,
+    template_gt_jump_false,
+    template_ge,
+    template_ge_jump_false,
+    template_eq,
+    template_ne,
+    template_not,
+    template_negate,
+    template_helper,
+    template_tail_call,
+    template_get_global,
+    template_set_global,
+    template_define_global,
+} TemplateName;
+
+// Prologue: vm in r13, slots in r12, and the stack pointer in rbx.
+//     push rbx
+//     push r12
+//     push r13
+//     mov r13, rdi
+//     mov r12, rsi
+//     mov rbx, rdx
+static const uint8_t template_prologue_bytes[] = {
+    0x53, 0x41, 0x54, 0x41, 0x55, 0x49, 0x89, 0xfd, 0x49, 0x89, 0xf4, 0x48,
+    0x89, 0xd3,
+};
+
+// Return 0 to signal a runtime error.
+//     xor eax, eax
+//     pop r13
+//     pop r12
+//     pop rbx
+//     ret
+static const uint8_t template_error_bytes[] = {
+    0x31, 0xc0, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3,
+};
+
+// Return the value at the top of the stack in slot 0, with the stack pointer
+// right above it.
+//     mov rax, [rbx-8]
+//     mov [r12], rax
+//     lea rax, [r12+8]
+//     pop r13
+//     pop r12
+//     pop rbx
+//     ret
+static const uint8_t template_return_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf8, 0x49, 0x89, 0x04, 0x24, 0x49, 0x8d, 0x44, 0x24,
+    0x08, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3,
+};
+
+// Push a constant value.
+//     movabs rax, <value>
+//     mov [rbx], rax
+//     add rbx, 8
+static const uint8_t template_push_bytes[] = {
+    0x48, 0xb8, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x48, 0x89,
+    0x03, 0x48, 0x83, 0xc3, 0x08,
+};
+
+// Locals are at <slot> (an offset in bytes) from the slots of the frame.
+//     mov rax, [r12+<slot>]
+//     mov [rbx], rax
+//     add rbx, 8
+static const uint8_t template_get_local_bytes[] = {
+    0x49, 0x8b, 0x84, 0x24, 0x33, 0x33, 0x33, 0x33, 0x48, 0x89, 0x03, 0x48,
+    0x83, 0xc3, 0x08,
+};
+
+//     mov rax, [rbx-8]
+//     mov [r12+<slot>], rax
+static const uint8_t template_set_local_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf8, 0x49, 0x89, 0x84, 0x24, 0x33, 0x33, 0x33, 0x33,
+};
+
+//     sub rbx, 8
+//     mov rax, [rbx]
+//     mov [r12+<slot>], rax
+static const uint8_t template_set_local_pop_bytes[] = {
+    0x48, 0x83, 0xeb, 0x08, 0x48, 0x8b, 0x03, 0x49, 0x89, 0x84, 0x24, 0x33,
+    0x33, 0x33, 0x33,
+};
+
+//     sub rbx, 8
+static const uint8_t template_pop_bytes[] = {
+    0x48, 0x83, 0xeb, 0x08,
+};
+
+//     mov rax, [rbx-8]
+//     mov [rbx], rax
+//     add rbx, 8
+static const uint8_t template_dup_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf8, 0x48, 0x89, 0x03, 0x48, 0x83, 0xc3, 0x08,
+};
+
+// Jumps within the function are patched once all the code is emitted.
+//     jmp <target>
+static const uint8_t template_jump_bytes[] = {
+    0xe9, 0x44, 0x44, 0x44, 0x44,
+};
+
+// Jump if the value at the top of the stack is false, epsilon or zero (NaN
+// is not zero, and non-numbers are NaNs).
+//     mov rax, [rbx-8]
+//     movabs rcx, FALSE
+//     cmp rax, rcx
+//     je <target>
+//     movabs rcx, EPSILON
+//     cmp rax, rcx
+//     je <target>
+//     movq xmm0, rax
+//     xorpd xmm1, xmm1
+//     ucomisd xmm0, xmm1
+//     jp 1f
+//     je <target>
+// 1:
+static const uint8_t template_jump_false_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf8, 0x48, 0xb9, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xfc, 0x7f, 0x48, 0x39, 0xc8, 0x0f, 0x84, 0x44, 0x44, 0x44, 0x44, 0x48,
+    0xb9, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x39, 0xc8,
+    0x0f, 0x84, 0x44, 0x44, 0x44, 0x44, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66,
+    0x0f, 0x57, 0xc9, 0x66, 0x0f, 0x2e, 0xc1, 0x7a, 0x06, 0x0f, 0x84, 0x44,
+    0x44, 0x44, 0x44,
+};
+
+// As jump_false, popping the predicate when not jumping.
+static const uint8_t template_jump_false_pop_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf8, 0x48, 0xb9, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xfc, 0x7f, 0x48, 0x39, 0xc8, 0x0f, 0x84, 0x44, 0x44, 0x44, 0x44, 0x48,
+    0xb9, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x39, 0xc8,
+    0x0f, 0x84, 0x44, 0x44, 0x44, 0x44, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66,
+    0x0f, 0x57, 0xc9, 0x66, 0x0f, 0x2e, 0xc1, 0x7a, 0x06, 0x0f, 0x84, 0x44,
+    0x44, 0x44, 0x44, 0x48, 0x83, 0xeb, 0x08,
+};
+
+// Jump if the value at the top of the stack is not false, epsilon or zero.
+//     mov rax, [rbx-8]
+//     movabs rcx, FALSE
+//     cmp rax, rcx
+//     je 1f
+//     movabs rcx, EPSILON
+//     cmp rax, rcx
+//     je 1f
+//     movq xmm0, rax
+//     xorpd xmm1, xmm1
+//     ucomisd xmm0, xmm1
+//     jp <target>
+//     jne <target>
+// 1:
+static const uint8_t template_jump_true_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf8, 0x48, 0xb9, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xfc, 0x7f, 0x48, 0x39, 0xc8, 0x74, 0x28, 0x48, 0xb9, 0x04, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x39, 0xc8, 0x74, 0x19, 0x66, 0x48,
+    0x0f, 0x6e, 0xc0, 0x66, 0x0f, 0x57, 0xc9, 0x66, 0x0f, 0x2e, 0xc1, 0x0f,
+    0x8a, 0x44, 0x44, 0x44, 0x44, 0x0f, 0x85, 0x44, 0x44, 0x44, 0x44,
+};
+
+// Arithmetic on two numbers; the helper deals with other operands (string
+// concatenation or type errors.)
+//     mov rax, [rbx-16]
+//     mov rcx, [rbx-8]
+//     movabs rdx, QNAN
+//     mov rsi, rax
+//     and rsi, rdx
+//     cmp rsi, rdx
+//     je 1f
+//     mov rsi, rcx
+//     and rsi, rdx
+//     cmp rsi, rdx
+//     je 1f
+//     movq xmm0, rax
+//     movq xmm1, rcx
+//     addsd xmm0, xmm1
+//     movq [rbx-16], xmm0
+//     sub rbx, 8
+//     jmp 2f
+// 1:
+//     <helper call>
+// 2:
+static const uint8_t template_add_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x24, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x19, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0xf2, 0x0f, 0x58, 0xc1, 0x66, 0x0f, 0xd6, 0x43, 0xf0, 0x48,
+    0x83, 0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba,
+    0x66, 0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55,
+    0x55, 0x48, 0x89, 0xc3,
+};
+
+// As add with subsd.
+static const uint8_t template_subtract_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x24, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x19, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0xf2, 0x0f, 0x5c, 0xc1, 0x66, 0x0f, 0xd6, 0x43, 0xf0, 0x48,
+    0x83, 0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba,
+    0x66, 0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55,
+    0x55, 0x48, 0x89, 0xc3,
+};
+
+// As add with mulsd.
+static const uint8_t template_multiply_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x24, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x19, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0xf2, 0x0f, 0x59, 0xc1, 0x66, 0x0f, 0xd6, 0x43, 0xf0, 0x48,
+    0x83, 0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba,
+    0x66, 0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55,
+    0x55, 0x48, 0x89, 0xc3,
+};
+
+// As add with divsd.
+static const uint8_t template_divide_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x24, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x19, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0xf2, 0x0f, 0x5e, 0xc1, 0x66, 0x0f, 0xd6, 0x43, 0xf0, 0x48,
+    0x83, 0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba,
+    0x66, 0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55,
+    0x55, 0x48, 0x89, 0xc3,
+};
+
+// Comparisons; ucomisd is unordered for NaN, so x < y is tested as y > x.
+//     mov rax, [rbx-16]
+//     mov rcx, [rbx-8]
+//     movabs rdx, QNAN
+//     mov rsi, rax
+//     and rsi, rdx
+//     cmp rsi, rdx
+//     je 1f
+//     mov rsi, rcx
+//     and rsi, rdx
+//     cmp rsi, rdx
+//     je 1f
+//     movq xmm0, rax
+//     movq xmm1, rcx
+//     movabs rax, FALSE
+//     movabs rcx, TRUE
+//     ucomisd xmm1, xmm0
+//     cmova rax, rcx
+//     mov [rbx-16], rax
+//     sub rbx, 8
+//     jmp 2f
+// 1:
+//     <helper call>
+// 2:
+static const uint8_t template_lt_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x3b, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x30, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f,
+    0x48, 0xb9, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x66, 0x0f,
+    0x2e, 0xc8, 0x48, 0x0f, 0x47, 0xc1, 0x48, 0x89, 0x43, 0xf0, 0x48, 0x83,
+    0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66,
+    0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55,
+    0x48, 0x89, 0xc3,
+};
+
+// Fused comparison and jump, the counterpart of lt/jump/false.
+//     mov rax, [rbx-16]
+//     mov rcx, [rbx-8]
+//     movabs rdx, QNAN
+//     mov rsi, rax
+//     and rsi, rdx
+//     cmp rsi, rdx
+//     je 1f
+//     mov rsi, rcx
+//     and rsi, rdx
+//     cmp rsi, rdx
+//     je 1f
+//     movq xmm0, rax
+//     movq xmm1, rcx
+//     ucomisd xmm1, xmm0
+//     ja 3f
+//     sub rbx, 8
+//     movabs rax, FALSE
+//     mov [rbx-8], rax
+//     jmp <target>
+// 3:
+//     sub rbx, 16
+//     jmp 2f
+// 1:
+//     <helper call>
+// 2:
+static const uint8_t template_lt_jump_false_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x38, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x2d, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x66, 0x0f, 0x2e, 0xc8, 0x77, 0x17, 0x48, 0x83, 0xeb, 0x08,
+    0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89,
+    0x43, 0xf8, 0xe9, 0x44, 0x44, 0x44, 0x44, 0x48, 0x83, 0xeb, 0x10, 0xeb,
+    0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66,
+    0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0,
+    0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// As lt with cmovae.
+static const uint8_t template_le_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x3b, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x30, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f,
+    0x48, 0xb9, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x66, 0x0f,
+    0x2e, 0xc8, 0x48, 0x0f, 0x43, 0xc1, 0x48, 0x89, 0x43, 0xf0, 0x48, 0x83,
+    0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66,
+    0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55,
+    0x48, 0x89, 0xc3,
+};
+
+// As lt_jump_false with jae.
+static const uint8_t template_le_jump_false_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x38, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x2d, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x66, 0x0f, 0x2e, 0xc8, 0x73, 0x17, 0x48, 0x83, 0xeb, 0x08,
+    0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89,
+    0x43, 0xf8, 0xe9, 0x44, 0x44, 0x44, 0x44, 0x48, 0x83, 0xeb, 0x10, 0xeb,
+    0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66,
+    0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0,
+    0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// As lt with ucomisd xmm0, xmm1.
+static const uint8_t template_gt_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x3b, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x30, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f,
+    0x48, 0xb9, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x66, 0x0f,
+    0x2e, 0xc1, 0x48, 0x0f, 0x47, 0xc1, 0x48, 0x89, 0x43, 0xf0, 0x48, 0x83,
+    0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66,
+    0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55,
+    0x48, 0x89, 0xc3,
+};
+
+// As lt_jump_false with ucomisd xmm0, xmm1.
+static const uint8_t template_gt_jump_false_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x38, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x2d, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x66, 0x0f, 0x2e, 0xc1, 0x77, 0x17, 0x48, 0x83, 0xeb, 0x08,
+    0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89,
+    0x43, 0xf8, 0xe9, 0x44, 0x44, 0x44, 0x44, 0x48, 0x83, 0xeb, 0x10, 0xeb,
+    0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66,
+    0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0,
+    0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// As gt with cmovae.
+static const uint8_t template_ge_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x3b, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x30, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f,
+    0x48, 0xb9, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x66, 0x0f,
+    0x2e, 0xc1, 0x48, 0x0f, 0x43, 0xc1, 0x48, 0x89, 0x43, 0xf0, 0x48, 0x83,
+    0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66,
+    0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22,
+    0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55,
+    0x48, 0x89, 0xc3,
+};
+
+// As gt_jump_false with jae.
+static const uint8_t template_ge_jump_false_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0xba, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6,
+    0x48, 0x39, 0xd6, 0x74, 0x38, 0x48, 0x89, 0xce, 0x48, 0x21, 0xd6, 0x48,
+    0x39, 0xd6, 0x74, 0x2d, 0x66, 0x48, 0x0f, 0x6e, 0xc0, 0x66, 0x48, 0x0f,
+    0x6e, 0xc9, 0x66, 0x0f, 0x2e, 0xc1, 0x73, 0x17, 0x48, 0x83, 0xeb, 0x08,
+    0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x89,
+    0x43, 0xf8, 0xe9, 0x44, 0x44, 0x44, 0x44, 0x48, 0x83, 0xeb, 0x10, 0xeb,
+    0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66,
+    0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0,
+    0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// Equality of values is the equality of their bits, except for two strings,
+// which the helper compares (see value_equal).
+//     mov rax, [rbx-16]
+//     mov rcx, [rbx-8]
+//     cmp rax, rcx
+//     je 3f
+//     movabs rdx, QNAN | tag_mask
+//     and rax, rdx
+//     and rcx, rdx
+//     movabs rdx, QNAN | tag_string
+//     cmp rax, rdx
+//     jne 4f
+//     cmp rcx, rdx
+//     je 1f
+// 4:
+//     movabs rax, FALSE
+//     jmp 5f
+// 3:
+//     movabs rax, TRUE
+// 5:
+//     mov [rbx-16], rax
+//     sub rbx, 8
+//     jmp 2f
+// 1:
+//     <helper call>
+// 2:
+static const uint8_t template_eq_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0x39, 0xc8, 0x74,
+    0x30, 0x48, 0xba, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48,
+    0x21, 0xd0, 0x48, 0x21, 0xd1, 0x48, 0xba, 0x04, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0xfc, 0x7f, 0x48, 0x39, 0xd0, 0x75, 0x05, 0x48, 0x39, 0xd1, 0x74,
+    0x20, 0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0xeb,
+    0x0a, 0x48, 0xb8, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48,
+    0x89, 0x43, 0xf0, 0x48, 0x83, 0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef,
+    0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f,
+    0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// As eq with true and false swapped.
+static const uint8_t template_ne_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf0, 0x48, 0x8b, 0x4b, 0xf8, 0x48, 0x39, 0xc8, 0x74,
+    0x30, 0x48, 0xba, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48,
+    0x21, 0xd0, 0x48, 0x21, 0xd1, 0x48, 0xba, 0x04, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0xfc, 0x7f, 0x48, 0x39, 0xd0, 0x75, 0x05, 0x48, 0x39, 0xd1, 0x74,
+    0x20, 0x48, 0xb8, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0xeb,
+    0x0a, 0x48, 0xb8, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48,
+    0x89, 0x43, 0xf0, 0x48, 0x83, 0xeb, 0x08, 0xeb, 0x23, 0x4c, 0x89, 0xef,
+    0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66, 0x48, 0xb8, 0x22, 0x22,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0, 0x0f,
+    0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// Only false and nil are false.
+//     mov rdx, [rbx-8]
+//     movabs rsi, FALSE
+//     movabs rcx, TRUE
+//     mov rax, rsi
+//     cmp rdx, rsi
+//     cmove rax, rcx
+//     movabs rsi, NIL
+//     cmp rdx, rsi
+//     cmove rax, rcx
+//     mov [rbx-8], rax
+static const uint8_t template_not_bytes[] = {
+    0x48, 0x8b, 0x53, 0xf8, 0x48, 0xbe, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xfc, 0x7f, 0x48, 0xb9, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f,
+    0x48, 0x89, 0xf0, 0x48, 0x39, 0xf2, 0x48, 0x0f, 0x44, 0xc1, 0x48, 0xbe,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f, 0x48, 0x39, 0xf2, 0x48,
+    0x0f, 0x44, 0xc1, 0x48, 0x89, 0x43, 0xf8,
+};
+
+// Negate a number by flipping its sign bit.
+//     mov rax, [rbx-8]
+//     movabs rdx, QNAN
+//     mov rsi, rax
+//     and rsi, rdx
+//     cmp rsi, rdx
+//     je 1f
+//     btc rax, 63
+//     mov [rbx-8], rax
+//     jmp 2f
+// 1:
+//     <helper call>
+// 2:
+static const uint8_t template_negate_bytes[] = {
+    0x48, 0x8b, 0x43, 0xf8, 0x48, 0xba, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xfc, 0x7f, 0x48, 0x89, 0xc6, 0x48, 0x21, 0xd6, 0x48, 0x39, 0xd6, 0x74,
+    0x0b, 0x48, 0x0f, 0xba, 0xf8, 0x3f, 0x48, 0x89, 0x43, 0xf8, 0xeb, 0x23,
+    0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66, 0x48,
+    0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0, 0x48,
+    0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// Call a helper with the VM, the stack pointer and an argument; the helper
+// returns the new stack pointer, or 0 for an error.
+//     mov rdi, r13
+//     mov rsi, rbx
+//     mov edx, <argument>
+//     movabs rax, <helper>
+//     call rax
+//     test rax, rax
+//     jz <error>
+//     mov rbx, rax
+static const uint8_t template_helper_bytes[] = {
+    0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66, 0x48,
+    0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0, 0x48,
+    0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+// As helper, returning right away with the stack pointer that the helper
+// returns when it is tagged as a tail call (see jit_tail_call).
+//     mov rdi, r13
+//     mov rsi, rbx
+//     mov edx, <argument>
+//     movabs rax, <helper>
+//     call rax
+//     test rax, rax
+//     jz <error>
+//     mov rbx, rax
+//     test al, 1
+//     jz 1f
+//     pop r13
+//     pop r12
+//     pop rbx
+//     ret
+// 1:
+static const uint8_t template_tail_call_bytes[] = {
+    0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66, 0x48,
+    0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0, 0x48,
+    0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3, 0xa8,
+    0x01, 0x74, 0x06, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3,
+};
+
+// The value of a global is patched in as the address of its slot.
+//     movabs rax, <value>
+//     mov rax, [rax]
+//     movabs rcx, NONE
+//     cmp rax, rcx
+//     je 1f
+//     mov [rbx], rax
+//     add rbx, 8
+//     jmp 2f
+// 1:
+//     <helper call>
+// 2:
+static const uint8_t template_get_global_bytes[] = {
+    0x48, 0xb8, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x48, 0x8b,
+    0x00, 0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfd, 0x7f, 0x48,
+    0x39, 0xc8, 0x74, 0x09, 0x48, 0x89, 0x03, 0x48, 0x83, 0xc3, 0x08, 0xeb,
+    0x23, 0x4c, 0x89, 0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66,
+    0x48, 0xb8, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0,
+    0x48, 0x85, 0xc0, 0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+//     movabs rdx, <value>
+//     movabs rcx, NONE
+//     cmp [rdx], rcx
+//     je 1f
+//     mov rax, [rbx-8]
+//     mov [rdx], rax
+//     jmp 2f
+// 1:
+//     <helper call>
+// 2:
+static const uint8_t template_set_global_bytes[] = {
+    0x48, 0xba, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x48, 0xb9,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfd, 0x7f, 0x48, 0x39, 0x0a, 0x74,
+    0x09, 0x48, 0x8b, 0x43, 0xf8, 0x48, 0x89, 0x02, 0xeb, 0x23, 0x4c, 0x89,
+    0xef, 0x48, 0x89, 0xde, 0xba, 0x66, 0x66, 0x66, 0x66, 0x48, 0xb8, 0x22,
+    0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0x22, 0xff, 0xd0, 0x48, 0x85, 0xc0,
+    0x0f, 0x84, 0x55, 0x55, 0x55, 0x55, 0x48, 0x89, 0xc3,
+};
+
+//     sub rbx, 8
+//     mov rax, [rbx]
+//     movabs rdx, <value>
+//     mov [rdx], rax
+static const uint8_t template_define_global_bytes[] = {
+    0x48, 0x83, 0xeb, 0x08, 0x48, 0x8b, 0x03, 0x48, 0xba, 0x11, 0x11, 0x11,
+    0x11, 0x11, 0x11, 0x11, 0x11, 0x48, 0x89, 0x02,
+};
+
+static const Template templates[] = {
+    [template_prologue] = { template_prologue_bytes, sizeof(template_prologue_bytes), 0 },
+    [template_error] = { template_error_bytes, sizeof(template_error_bytes), 0 },
+    [template_return] = { template_return_bytes, sizeof(template_return_bytes), 0 },
+    [template_push] = { template_push_bytes, sizeof(template_push_bytes), 1,
+        { { 2, hole_value } } },
+    [template_get_local] = { template_get_local_bytes, sizeof(template_get_local_bytes), 1,
+        { { 4, hole_slot } } },
+    [template_set_local] = { template_set_local_bytes, sizeof(template_set_local_bytes), 1,
+        { { 8, hole_slot } } },
+    [template_set_local_pop] = { template_set_local_pop_bytes, sizeof(template_set_local_pop_bytes), 1,
+        { { 11, hole_slot } } },
+    [template_pop] = { template_pop_bytes, sizeof(template_pop_bytes), 0 },
+    [template_dup] = { template_dup_bytes, sizeof(template_dup_bytes), 0 },
+    [template_jump] = { template_jump_bytes, sizeof(template_jump_bytes), 1,
+        { { 1, hole_target } } },
+    [template_jump_false] = { template_jump_false_bytes, sizeof(template_jump_false_bytes), 3,
+        { { 19, hole_target }, { 38, hole_target }, { 59, hole_target } } },
+    [template_jump_false_pop] = { template_jump_false_pop_bytes, sizeof(template_jump_false_pop_bytes), 3,
+        { { 19, hole_target }, { 38, hole_target }, { 59, hole_target } } },
+    [template_jump_true] = { template_jump_true_bytes, sizeof(template_jump_true_bytes), 2,
+        { { 49, hole_target }, { 55, hole_target } } },
+    [template_add] = { template_add_bytes, sizeof(template_add_bytes), 3,
+        { { 72, hole_argument }, { 78, hole_helper }, { 93, hole_error } } },
+    [template_subtract] = { template_subtract_bytes, sizeof(template_subtract_bytes), 3,
+        { { 72, hole_argument }, { 78, hole_helper }, { 93, hole_error } } },
+    [template_multiply] = { template_multiply_bytes, sizeof(template_multiply_bytes), 3,
+        { { 72, hole_argument }, { 78, hole_helper }, { 93, hole_error } } },
+    [template_divide] = { template_divide_bytes, sizeof(template_divide_bytes), 3,
+        { { 72, hole_argument }, { 78, hole_helper }, { 93, hole_error } } },
+    [template_lt] = { template_lt_bytes, sizeof(template_lt_bytes), 3,
+        { { 95, hole_argument }, { 101, hole_helper }, { 116, hole_error } } },
+    [template_lt_jump_false] = { template_lt_jump_false_bytes, sizeof(template_lt_jump_false_bytes), 4,
+        { { 75, hole_target }, { 92, hole_argument }, { 98, hole_helper }, { 113, hole_error } } },
+    [template_le] = { template_le_bytes, sizeof(template_le_bytes), 3,
+        { { 95, hole_argument }, { 101, hole_helper }, { 116, hole_error } } },
+    [template_le_jump_false] = { template_le_jump_false_bytes, sizeof(template_le_jump_false_bytes), 4,
+        { { 75, hole_target }, { 92, hole_argument }, { 98, hole_helper }, { 113, hole_error } } },
+    [template_gt] = { template_gt_bytes, sizeof(template_gt_bytes), 3,
+        { { 95, hole_argument }, { 101, hole_helper }, { 116, hole_error } } },
+    [template_gt_jump_false] = { template_gt_jump_false_bytes, sizeof(template_gt_jump_false_bytes), 4,
+        { { 75, hole_target }, { 92, hole_argument }, { 98, hole_helper }, { 113, hole_error } } },
+    [template_ge] = { template_ge_bytes, sizeof(template_ge_bytes), 3,
+        { { 95, hole_argument }, { 101, hole_helper }, { 116, hole_error } } },
+    [template_ge_jump_false] = { template_ge_jump_false_bytes, sizeof(template_ge_jump_false_bytes), 4,
+        { { 75, hole_target }, { 92, hole_argument }, { 98, hole_helper }, { 113, hole_error } } },
+    [template_eq] = { template_eq_bytes, sizeof(template_eq_bytes), 3,
+        { { 88, hole_argument }, { 94, hole_helper }, { 109, hole_error } } },
+    [template_ne] = { template_ne_bytes, sizeof(template_ne_bytes), 3,
+        { { 88, hole_argument }, { 94, hole_helper }, { 109, hole_error } } },
+    [template_not] = { template_not_bytes, sizeof(template_not_bytes), 0 },
+    [template_negate] = { template_negate_bytes, sizeof(template_negate_bytes), 3,
+        { { 43, hole_argument }, { 49, hole_helper }, { 64, hole_error } } },
+    [template_helper] = { template_helper_bytes, sizeof(template_helper_bytes), 3,
+        { { 7, hole_argument }, { 13, hole_helper }, { 28, hole_error } } },
+    [template_tail_call] = { template_tail_call_bytes, sizeof(template_tail_call_bytes), 3,
+        { { 7, hole_argument }, { 13, hole_helper }, { 28, hole_error } } },
+    [template_get_global] = { template_get_global_bytes, sizeof(template_get_global_bytes), 4,
+        { { 2, hole_value }, { 44, hole_argument }, { 50, hole_helper }, { 65, hole_error } } },
+    [template_set_global] = { template_set_global_bytes, sizeof(template_set_global_bytes), 4,
+        { { 2, hole_value }, { 41, hole_argument }, { 47, hole_helper }, { 62, hole_error } } },
+    [template_define_global] = { template_define_global_bytes, sizeof(template_define_global_bytes), 1,
+        { { 9, hole_value } } },
+};
+
+// Helpers called from native code; like native code, they return the new
+// stack pointer, or 0 after a runtime error.
+typedef Value* Helper(VM*, Value*, uint32_t);
+
+// Binary operations when the operands are not both numbers (or both strings
+// for equality.)
+static Value* jit_binary(VM* vm, Value* sp, uint32_t opcode) {
+    // The garbage collector may run when adding a new string.
+    vm->sp = sp;
+    Value x = sp[-2];
+    Value y = sp[-1];
+    if (opcode == op_eq || opcode == op_ne) {
+        sp[-2] = value_equal(x, y) == (opcode == op_eq) ? VALUE_TRUE : VALUE_FALSE;
+        return sp - 1;
+    }
+    if (opcode == op_multiply && VALUE_IS_STRING(x) && VALUE_IS_STRING(y)) {
+        sp[-2] = vm_add_string(vm, value_concatenate_strings(x, y), x, y);
+        return sp - 1;
+    }
+    if (opcode == op_exponent) {
+        if (!VALUE_IS_NUMBER(y)) {
+            vm_runtime_error(vm, "Exponent is not a number.");
+            return 0;
+        }
+        if (VALUE_IS_NUMBER(x)) {
+            sp[-2] = VALUE_FROM_NUMBER(pow(x.as_double, y.as_double));
+        } else if (VALUE_IS_STRING(x)) {
+            sp[-2] = vm_add_string(vm, value_string_exponent(x, y.as_double), x, x);
+        } else {
+            vm_runtime_error(vm, "Base of exponent is not a number or a string.");
+            return 0;
+        }
+        return sp - 1;
+    }
+    const char* kind = opcode == op_add || opcode == op_subtract || opcode == op_multiply ||
+        opcode == op_divide ? "arithmetic" : "comparison";
+    vm_runtime_error(vm, VALUE_IS_NUMBER(x) ? "Second operand of %s operation is not a number." :
+        "First operand of %s operation is not a number.", kind);
+    return 0;
+}
+
+static Value* jit_unary(VM* vm, Value* sp, uint32_t opcode) {
+    Value v = sp[-1];
+    switch (opcode) {
+        case op_bars:
+            if (VALUE_IS_STRING(v)) {
+                sp[-1] = VALUE_FROM_NUMBER(VALUE_IS_EPSILON(v) ? 0 :
+                    VALUE_IS_SHORT_STRING(v) ? VALUE_SHORT_STRING_LENGTH(v) :
+                    (VALUE_TO_STRING(v)->length));
+            } else if (VALUE_IS_NUMBER(v)) {
+                sp[-1] = VALUE_FROM_NUMBER(fabs(v.as_double));
+            } else {
+                vm_runtime_error(vm, "Bars apply to number or string.");
+                return 0;
+            }
+            return sp;
+        case op_quote:
+            vm->sp = sp;
+            sp[-1] = vm_add_string(vm, value_stringify(v), v, v);
+            return sp;
+        default:
+            vm_runtime_error(vm, "Operand for negate is not a number.");
+            return 0;
+    }
+}
+
+static Value* jit_concat(VM* vm, Value* sp, uint32_t n) {
+    vm->sp = sp;
+    Value* parts = sp - n;
+    parts[0] = vm_add_string(vm, value_interpolate(n, parts), parts[0], parts[0]);
+    return parts + 1;
+}
+
+static Value* jit_print(VM* vm, Value* sp, uint32_t unused) {
+    value_print(sp[-1]);
+    puts("");
+    return sp - 1;
+}
+
+static Value* jit_undefined_global(VM* vm, Value* sp, uint32_t n) {
+    vm_runtime_error(vm, "undefined var \"%s\"", value_to_cstring(vm->global_names.items[n]));
+    return 0;
+}
+
+typedef struct {
+    ByteArray code;
+    // Pairs of (position of a jump in the code, offset of its target in the
+    // bytecode), and positions of jumps to the error exit.
+    NumberArray targets;
+    NumberArray errors;
+} Emitter;
+
+typedef struct {
+    uint64_t value;
+    Helper* helper;
+    size_t slot;
+    size_t target;
+    uint32_t argument;
+} Operands;
+
+static void emitter_patch(Emitter* emitter, size_t at, uint64_t x, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        emitter->code.items[at + i] = (uint8_t)(x >> (8 * i));
+    }
+}
+
+static void emitter_emit(Emitter* emitter, TemplateName name, Operands operands) {
+    const Template* template = &templates[name];
+    size_t start = emitter->code.count;
+    for (size_t i = 0; i < template->size; ++i) {
+        byte_array_push(&emitter->code, template->bytes[i]);
+    }
+    for (size_t i = 0; i < template->holes_count; ++i) {
+        size_t at = start + template->holes[i].offset;
+        switch (template->holes[i].kind) {
+            case hole_value:
+                emitter_patch(emitter, at, operands.value, 8);
+                break;
+            case hole_helper:
+                emitter_patch(emitter, at, (uintptr_t)operands.helper, 8);
+                break;
+            case hole_slot:
+                emitter_patch(emitter, at, operands.slot * sizeof(Value), 4);
+                break;
+            case hole_target:
+                number_array_push(&emitter->targets, at);
+                number_array_push(&emitter->targets, operands.target);
+                break;
+            case hole_error:
+                number_array_push(&emitter->errors, at);
+                break;
+            case hole_argument:
+                emitter_patch(emitter, at, operands.argument, 4);
+                break;
+        }
+    }
+}
+
+bool jit_compile(VM* vm, Function* function) {
+    Chunk* chunk = function->chunk;
+    uint8_t* bytes = chunk->bytes.items;
+    size_t count = chunk->bytes.count;
+
+    Emitter emitter;
+    byte_array_init(&emitter.code);
+    number_array_init(&emitter.targets);
+    number_array_init(&emitter.errors);
+
+    // Position in the native code of every instruction.
+    size_t* positions = calloc(count + 1, sizeof(size_t));
+    bool supported = true;
+
+#define EMIT(name) emitter_emit(&emitter, template_##name, (Operands){ 0 })
+#define EMIT_WITH(name, ...) emitter_emit(&emitter, template_##name, (Operands){ __VA_ARGS__ })
+#define PUSH(v) EMIT_WITH(push, .value = (v).as_int)
+#define TARGET() (i + 3 + (int16_t)((bytes[i + 1] << 8) | bytes[i + 2]))
+
+    EMIT(prologue);
+    for (size_t i = 0; supported && i < count; i += opcode_size(bytes[i])) {
+        positions[i] = emitter.code.count;
+        uint8_t opcode = bytes[i];
+        switch (opcode) {
+            case op_nil: PUSH(VALUE_NIL); break;
+            case op_zero: PUSH(VALUE_FROM_NUMBER(0)); break;
+            case op_one: PUSH(VALUE_FROM_NUMBER(1)); break;
+            case op_infinity: PUSH(VALUE_FROM_NUMBER(INFINITY)); break;
+            case op_epsilon: PUSH(VALUE_EPSILON); break;
+            case op_false: PUSH(VALUE_FALSE); break;
+            case op_true: PUSH(VALUE_TRUE); break;
+            case op_constant: PUSH(chunk->values.items[bytes[i + 1]]); break;
+            case op_negate:
+                EMIT_WITH(negate, .helper = jit_unary, .argument = opcode);
+                break;
+            case op_add:
+            case op_add_nn:
+                EMIT_WITH(add, .helper = jit_binary, .argument = op_add);
+                break;
+            case op_subtract:
+            case op_subtract_nn:
+                EMIT_WITH(subtract, .helper = jit_binary, .argument = op_subtract);
+                break;
+            case op_multiply:
+            case op_multiply_nn:
+            case op_multiply_ss:
+                EMIT_WITH(multiply, .helper = jit_binary, .argument = op_multiply);
+                break;
+            case op_divide:
+            case op_divide_nn:
+                EMIT_WITH(divide, .helper = jit_binary, .argument = op_divide);
+                break;
+            case op_exponent:
+                EMIT_WITH(helper, .helper = jit_binary, .argument = opcode);
+                break;
+            case op_not: EMIT(not); break;
+            case op_eq: EMIT_WITH(eq, .helper = jit_binary, .argument = op_eq); break;
+            case op_ne: EMIT_WITH(ne, .helper = jit_binary, .argument = op_ne); break;
+            case op_gt:
+            case op_gt_nn:
+                EMIT_WITH(gt, .helper = jit_binary, .argument = op_gt);
+                break;
+            case op_ge:
+            case op_ge_nn:
+                EMIT_WITH(ge, .helper = jit_binary, .argument = op_ge);
+                break;
+            case op_lt:
+            case op_lt_nn:
+                EMIT_WITH(lt, .helper = jit_binary, .argument = op_lt);
+                break;
+            case op_le:
+            case op_le_nn:
+                EMIT_WITH(le, .helper = jit_binary, .argument = op_le);
+                break;
+            case op_bars:
+            case op_quote:
+                EMIT_WITH(helper, .helper = jit_unary, .argument = opcode);
+                break;
+            case op_concat: EMIT_WITH(helper, .helper = jit_concat, .argument = bytes[i + 1]); break;
+            case op_print: EMIT_WITH(helper, .helper = jit_print); break;
+            case op_pop: EMIT(pop); break;
+            case op_pop_2: EMIT(pop); EMIT(pop); break;
+            case op_dup: EMIT(dup); break;
+            // Globals are all known by the time the program runs, so their
+            // slots do not move anymore.
+            case op_define_global:
+                EMIT_WITH(define_global, .value = (uintptr_t)&vm->globals.items[bytes[i + 1]]);
+                break;
+            case op_get_global:
+                EMIT_WITH(get_global, .value = (uintptr_t)&vm->globals.items[bytes[i + 1]],
+                    .helper = jit_undefined_global, .argument = bytes[i + 1]);
+                break;
+            case op_set_global:
+                EMIT_WITH(set_global, .value = (uintptr_t)&vm->globals.items[bytes[i + 1]],
+                    .helper = jit_undefined_global, .argument = bytes[i + 1]);
+                break;
+            case op_get_local: EMIT_WITH(get_local, .slot = bytes[i + 1]); break;
+            case op_set_local: EMIT_WITH(set_local, .slot = bytes[i + 1]); break;
+            case op_set_local_pop: EMIT_WITH(set_local_pop, .slot = bytes[i + 1]); break;
+            case op_get_local_2:
+                EMIT_WITH(get_local, .slot = bytes[i + 1]);
+                EMIT_WITH(get_local, .slot = bytes[i + 2]);
+                break;
+            case op_get_local_constant:
+                EMIT_WITH(get_local, .slot = bytes[i + 1]);
+                PUSH(chunk->values.items[bytes[i + 2]]);
+                break;
+            case op_jump: EMIT_WITH(jump, .target = TARGET()); break;
+            case op_jump_true: EMIT_WITH(jump_true, .target = TARGET()); break;
+            case op_jump_false: EMIT_WITH(jump_false, .target = TARGET()); break;
+            case op_jump_false_pop: EMIT_WITH(jump_false_pop, .target = TARGET()); break;
+            case op_pop_jump:
+                EMIT(pop);
+                EMIT_WITH(jump, .target = TARGET());
+                break;
+            case op_lt_jump_false:
+            case op_lt_jump_false_nn:
+                EMIT_WITH(lt_jump_false, .target = TARGET(), .helper = jit_binary, .argument = op_lt);
+                break;
+            case op_le_jump_false:
+            case op_le_jump_false_nn:
+                EMIT_WITH(le_jump_false, .target = TARGET(), .helper = jit_binary, .argument = op_le);
+                break;
+            case op_gt_jump_false:
+            case op_gt_jump_false_nn:
+                EMIT_WITH(gt_jump_false, .target = TARGET(), .helper = jit_binary, .argument = op_gt);
+                break;
+            case op_ge_jump_false:
+            case op_ge_jump_false_nn:
+                EMIT_WITH(ge_jump_false, .target = TARGET(), .helper = jit_binary, .argument = op_ge);
+                break;
+            case op_call:
+                EMIT_WITH(helper, .helper = jit_call, .argument = bytes[i + 1]);
+                break;
+            case op_tail_call:
+                EMIT_WITH(tail_call, .helper = jit_tail_call, .argument = bytes[i + 1]);
+                break;
+            case op_return: EMIT(return); break;
+            case op_nop: break;
+            default:
+                // Register instructions are never compiled.
+                supported = false;
+        }
+    }
+    positions[count] = emitter.code.count;
+    size_t error = emitter.code.count;
+    EMIT(error);
+
+#undef EMIT
+#undef EMIT_WITH
+#undef PUSH
+#undef TARGET
+
+    // Resolve jumps now that the position of every instruction is known.
+    for (size_t i = 0; i < emitter.targets.count; i += 2) {
+        size_t at = emitter.targets.items[i];
+        emitter_patch(&emitter, at, positions[emitter.targets.items[i + 1]] - (at + 4), 4);
+    }
+    for (size_t i = 0; i < emitter.errors.count; ++i) {
+        size_t at = emitter.errors.items[i];
+        emitter_patch(&emitter, at, error - (at + 4), 4);
+    }
+
+    void* native = 0;
+    if (supported) {
+        native = mmap(0, emitter.code.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (native == MAP_FAILED) {
+            native = 0;
+        } else {
+            memcpy(native, emitter.code.items, emitter.code.count);
+            if (mprotect(native, emitter.code.count, PROT_READ | PROT_EXEC) != 0) {
+                munmap(native, emitter.code.count);
+                native = 0;
+            }
+        }
+    }
+    if (native) {
+        function->native = native;
+        function->native_size = emitter.code.count;
+#ifdef DEBUG
+        fprintf(stderr, "+++ jit_compile() function %p: %zu bytes of native code for %zu bytes\n",
+            (void*)function, function->native_size, count);
+#endif
+    }
+
+    free(positions);
+    byte_array_free(&emitter.code);
+    number_array_free(&emitter.targets);
+    number_array_free(&emitter.errors);
+    return native != 0;
+}
+
+void jit_free(Function* function) {
+    if (function->native_size > 0) {
+#ifdef DEBUG
+        fprintf(stderr, "--- jit_free() function %p (%zu bytes)\n", (void*)function,
+            function->native_size);
+#endif
+        munmap(function->native, function->native_size);
+        function->native = 0;
+    }
+}
+
+#else
+
+bool jit_compile(VM* vm, Function* function) {
+    return false;
+}
+
+void jit_free(Function* function) {
+}
+
+#endif
+
+// Run the function of a frame that was just pushed until it returns, then pop
+// the frame; tail calls from native code replace the function of the frame
+// and go round again. Return the new stack pointer, or 0 after an error.
+static Value* jit_enter(VM* vm, Frame* frame, Value* sp) {
+    while (frame->function->native) {
+        Native* native;
+        *(void**)&native = frame->function->native;
+        sp = native(vm, frame->slots, sp);
+        if (!((uintptr_t)sp & JIT_TAIL_CALL)) {
+            vm->frame_count -= sp ? 1 : 0;
+            return sp;
+        }
+        sp = (Value*)((uintptr_t)sp & ~(uintptr_t)JIT_TAIL_CALL);
+    }
+
+    // A tail call to a function without native code; vm_run pops the frame.
+    vm->sp = sp;
+    return vm_run(vm) == result_ok ? vm->sp : 0;
+}
+
+Result jit_run(VM* vm, Frame* frame) {
+    Value* sp = jit_enter(vm, frame, vm->sp);
+    if (!sp) {
+        return result_runtime_error;
+    }
+    vm->sp = sp;
+    return result_ok;
+}
+
+// Calls to native code go straight to it; other calls go through the
+// interpreter.
+Value* jit_call(VM* vm, Value* sp, uint32_t args_count) {
+    if (vm->c_stack - (char*)__builtin_frame_address(0) > JIT_C_STACK_MAX) {
+        vm_runtime_error(vm, "Stack overflow");
+        return 0;
+    }
+    Value callee = sp[-1 - (int)args_count];
+    if (VALUE_IS_FUNCTION(callee) && !VALUE_IS_FOREIGN_FUNCTION(callee)) {
+        Function* function = VALUE_TO_FUNCTION(callee);
+        if (function->native && function->arity == args_count && vm->frame_count < vm->frames_max) {
+            Frame* frame = &vm->frames[vm->frame_count];
+            vm->frame_count += 1;
+            frame->function = function;
+            frame->slots = sp - args_count - 1;
+            return jit_enter(vm, frame, sp);
+        }
+    }
+    vm->sp = sp;
+    return vm_call_and_run(vm, args_count) == result_ok ? vm->sp : 0;
+}
+
+// Tail calls move the function and its arguments down to the slots of the
+// current frame and return a tagged stack pointer, so that native code returns
+// right away to jit_enter, which runs the function in the same frame. The call
+// is counted as in the interpreter (see vm_count_call; native code only runs
+// with the JIT on), so a function that is only reached by tail calls from
+// native code is compiled once it is hot. Calls that would fail are left to
+// jit_call.
+Value* jit_tail_call(VM* vm, Value* sp, uint32_t args_count) {
+    Value callee = sp[-1 - (int)args_count];
+    if (VALUE_IS_FUNCTION(callee) && !VALUE_IS_FOREIGN_FUNCTION(callee) &&
+        VALUE_TO_FUNCTION(callee)->arity == args_count) {
+        Frame* frame = &vm->frames[vm->frame_count - 1];
+        frame->function = VALUE_TO_FUNCTION(callee);
+#ifdef DEBUG
+        fprintf(stderr, "~~~ tail call to %s, reusing frame %zu\n",
+            value_to_cstring(frame->function->name), vm->frame_count);
+#endif
+        memmove(frame->slots, sp - args_count - 1, (args_count + 1) * sizeof(Value));
+        if (frame->function->calls++ == JIT_THRESHOLD) {
+            jit_compile(vm, frame->function);
+        }
+        return (Value*)((uintptr_t)(frame->slots + args_count + 1) | JIT_TAIL_CALL);
+    }
+    return jit_call(vm, sp, args_count);
+}
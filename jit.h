@@ -0,0 +1,37 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdbool.h>
+
+#include "value.h"
+#include "vm.h"
+
+// Native code is only generated for x86-64 (System V ABI); everywhere else,
+// and when building with NO_JIT, functions are always interpreted.
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define JIT
+#endif
+
+// Number of calls to a function before it gets compiled to native code.
+#define JIT_THRESHOLD 100
+
+// Native code calls other functions on the C stack; calls fail with a stack
+// overflow past this many bytes, whatever the limit on frames of the VM.
+#define JIT_C_STACK_MAX (4 << 20)
+
+// Native code for a function, called with the slots of its frame and the
+// stack pointer; it returns the new stack pointer, or 0 after a runtime error.
+// Native code that is not compiled at run time (see aot.h) has no size.
+typedef Value* Native(VM*, Value*, Value*);
+
+// Tag of the stack pointer returned by native code that ends with a tail call
+// (see jit_tail_call); values are aligned so this bit is otherwise clear.
+#define JIT_TAIL_CALL 1
+
+bool jit_compile(VM*, Function*);
+Result jit_run(VM*, Frame*);
+Value* jit_call(VM*, Value*, uint32_t);
+Value* jit_tail_call(VM*, Value*, uint32_t);
+void jit_free(Function*);
+
+#endif
@@ -3,6 +3,8 @@
 #include <string.h>
 
 #include "array.h"
+#include "emit.h"
+#include "gc.h"
 #include "vm.h"
 
 static const char* read_file(const char* path) {
@@ -42,10 +44,62 @@ static const char* read_stdin(void) {
     return output;
 }
 
+// relox [--stack | --registers] [--no-jit] [--frames <n>] [--gc-stats] [--table <file>] [--emit-c] [<file> | -]
+// With --emit-c, write a C program equivalent to the script to stdout instead
+// of running it (see aot.h). --frames sets the limit on the depth of calls,
+// and --gc-stats reports statistics of the garbage collector after running.
+// --table maps a HAMT file (see hamt/table.c) for the lookup function.
 int main(int argc, char* argv[argc + 1]) {
     VM vm;
-    const char* source = argc == 1 || strcmp(argv[1], "-") == 0 ? read_stdin() : read_file(argv[1]);
-    Result result = vm_compile_and_run(&vm, source);
+    vm.backend = backend_stack;
+    vm.jit = true;
+    vm.frames_max = FRAMES_MAX;
+    vm.table = 0;
+    HAMTFile table;
+    bool emit_c = false;
+    bool gc_stats = false;
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i) {
+        if (strcmp(argv[i], "--stack") == 0) {
+            vm.backend = backend_stack;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            vm.backend = backend_registers;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            vm.jit = false;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            char* end;
+            vm.frames_max = strtoul(argv[++i], &end, 10);
+            if (*end || vm.frames_max == 0) {
+                fprintf(stderr, "Invalid number of frames \"%s\".\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            if (vm.frames_max > FRAMES_MAX_LIMIT) {
+                fprintf(stderr, "Too many frames \"%s\" (at most %zu).\n", argv[i], FRAMES_MAX_LIMIT);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            gc_stats = true;
+        } else if (strcmp(argv[i], "--table") == 0 && i + 1 < argc) {
+            if (!hamt_file_open(&table, argv[++i])) {
+                fprintf(stderr, "Could not open \"%s\" as a table.\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            vm.table = &table;
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit_c = true;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    const char* source = i == argc || strcmp(argv[i], "-") == 0 ? read_stdin() : read_file(argv[i]);
+    Result result = emit_c ? vm_compile_and_emit_c(&vm, source, stdout) : vm_compile_and_run(&vm, source);
+    if (gc_stats) {
+        gc_report(&vm, stderr);
+    }
     vm_free(&vm);
+    if (vm.table) {
+        hamt_file_close(vm.table);
+    }
     return result == result_ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
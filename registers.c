@@ -0,0 +1,558 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "array.h"
+#include "registers.h"
+#include "vm.h"
+
+// The register backend translates the stack code of a function into
+// three-address code (e.g. add r3 r1 k0) where every position of the stack
+// is a register of the frame. Locals already live at a fixed position of the
+// stack, and a temporary goes to the register at the position where the
+// stack code would have pushed it, so no register allocation is needed.
+//
+// The translation keeps a virtual stack of operands: pushing a local or a
+// constant only records where the value is, and nothing is emitted until the
+// value is used, so that get/local, constant and pop mostly disappear. The
+// virtual stack is flushed (every value is moved to its own register) before
+// jumps and at jump targets so that all paths agree on where values are.
+
+typedef struct {
+    bool constant;
+    uint8_t index;
+} Operand;
+
+typedef struct {
+    Chunk* chunk;
+    uint8_t* bytes;
+    size_t count;
+    bool* targets;
+    ByteArray code;
+    NumberArray lines;
+    NumberArray jumps;
+    Operand stack[REGISTERS_MAX];
+    size_t depth;
+    size_t registers;
+    size_t line;
+    bool error;
+} Translator;
+
+static bool is_jump(uint8_t opcode) {
+    return opcode == op_jump || opcode == op_jump_true || opcode == op_jump_false;
+}
+
+static size_t jump_target(uint8_t* bytes, size_t i) {
+    size_t next = i + opcode_size(bytes[i]);
+    return next + (int16_t)((bytes[next - 2] << 8) | bytes[next - 1]);
+}
+
+// Net effect of an instruction on the depth of the stack.
+static ptrdiff_t stack_effect(uint8_t* bytes, size_t i) {
+    switch (bytes[i]) {
+        case op_nil:
+        case op_zero:
+        case op_one:
+        case op_infinity:
+        case op_epsilon:
+        case op_constant:
+        case op_false:
+        case op_true:
+        case op_dup:
+        case op_get_global:
+        case op_get_local:
+            return 1;
+        case op_add:
+        case op_subtract:
+        case op_multiply:
+        case op_divide:
+        case op_exponent:
+        case op_eq:
+        case op_ne:
+        case op_gt:
+        case op_ge:
+        case op_lt:
+        case op_le:
+        case op_print:
+        case op_pop:
+        case op_define_global:
+            return -1;
+        case op_concat:
+            return 1 - (ptrdiff_t)bytes[i + 1];
+        case op_call:
+        case op_tail_call:
+            return -(ptrdiff_t)bytes[i + 1];
+        default:
+            return 0;
+    }
+}
+
+// Depth of the stack before every instruction, following jumps from the
+// entry point; unreachable instructions are left at -1.
+static ptrdiff_t* stack_depths(uint8_t* bytes, size_t count, size_t depth) {
+    ptrdiff_t* depths = malloc((count + 1) * sizeof(ptrdiff_t));
+    for (size_t i = 0; i <= count; ++i) {
+        depths[i] = -1;
+    }
+    NumberArray worklist;
+    number_array_init(&worklist);
+    depths[0] = depth;
+    number_array_push(&worklist, 0);
+    while (worklist.count > 0) {
+        size_t i = worklist.items[--worklist.count];
+        if (i == count || bytes[i] == op_return) {
+            continue;
+        }
+        ptrdiff_t d = depths[i] + stack_effect(bytes, i);
+        size_t successors[2];
+        size_t n = 0;
+        if (bytes[i] != op_jump) {
+            successors[n++] = i + opcode_size(bytes[i]);
+        }
+        if (is_jump(bytes[i])) {
+            successors[n++] = jump_target(bytes, i);
+        }
+        for (size_t j = 0; j < n; ++j) {
+            size_t k = successors[j];
+            if (depths[k] < 0) {
+                depths[k] = d;
+                number_array_push(&worklist, k);
+            }
+        }
+    }
+    number_array_free(&worklist);
+    return depths;
+}
+
+static void translator_error(Translator* t, const char* message) {
+    if (!t->error) {
+        fprintf(stderr, "!!! Compiler error, line %zu: %s\n", t->line, message);
+    }
+    t->error = true;
+}
+
+static void translator_emit(Translator* t, uint8_t byte) {
+    byte_array_push(&t->code, byte);
+    number_array_push(&t->lines, t->line);
+}
+
+static void translator_emit_3(Translator* t, uint8_t opcode, uint8_t x, uint8_t y) {
+    translator_emit(t, opcode);
+    translator_emit(t, x);
+    translator_emit(t, y);
+}
+
+// Emit a placeholder offset for a jump to the original target, fixed later.
+static void translator_emit_jump(Translator* t, size_t target) {
+    translator_emit(t, 0xde);
+    translator_emit(t, 0xad);
+    number_array_push(&t->jumps, t->code.count - 2);
+    number_array_push(&t->jumps, target);
+}
+
+static Operand operand_register(size_t i) {
+    return (Operand){ .constant = false, .index = (uint8_t)i };
+}
+
+// Index of a constant in the values of the chunk, adding it if necessary.
+static Operand operand_constant(Translator* t, Value v) {
+    ValueArray* values = &t->chunk->values;
+    size_t i = 0;
+    while (i < values->count && !VALUE_EQUAL(values->items[i], v)) {
+        ++i;
+    }
+    if (i == values->count) {
+        if (i > UINT8_MAX) {
+            translator_error(t, "too many constants");
+        }
+        value_array_push(values, v);
+    }
+    return (Operand){ .constant = true, .index = (uint8_t)i };
+}
+
+static void translator_push(Translator* t, Operand operand) {
+    if (t->depth == REGISTERS_MAX) {
+        translator_error(t, "too many registers");
+        return;
+    }
+    t->stack[t->depth++] = operand;
+    if (t->depth > t->registers) {
+        t->registers = t->depth;
+    }
+}
+
+static Operand translator_pop(Translator* t) {
+    return t->stack[--t->depth];
+}
+
+// Is the value at position i in its own register?
+static bool translator_in_place(Translator* t, size_t i) {
+    return !t->stack[i].constant && t->stack[i].index == i;
+}
+
+// Move the value at position i to its own register.
+static void translator_materialize(Translator* t, size_t i) {
+    if (!translator_in_place(t, i)) {
+        Operand operand = t->stack[i];
+        translator_emit_3(t, operand.constant ? op_r_constant : op_r_move, (uint8_t)i, operand.index);
+        t->stack[i] = operand_register(i);
+    }
+}
+
+// Materialize all values below position n.
+static void translator_flush(Translator* t, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        translator_materialize(t, i);
+    }
+}
+
+// Materialize the values that are read from register r before writing to it.
+static void translator_flush_register(Translator* t, size_t r) {
+    for (size_t i = 0; i < t->depth; ++i) {
+        if (!t->stack[i].constant && t->stack[i].index == r) {
+            translator_materialize(t, i);
+        }
+    }
+}
+
+// Encode an operand of a register instruction; constants that are too far to
+// be encoded are first loaded in the (free) register at position i.
+static uint8_t translator_operand(Translator* t, Operand operand, size_t i) {
+    if (!operand.constant) {
+        return operand.index;
+    }
+    if (operand.index < REGISTERS_MAX) {
+        return REGISTERS_MAX + operand.index;
+    }
+    translator_emit_3(t, op_r_constant, (uint8_t)i, operand.index);
+    return (uint8_t)i;
+}
+
+// The local at position r has just been written to its own register.
+static void translator_write_local(Translator* t, size_t r) {
+    t->stack[r] = operand_register(r);
+}
+
+// Destination of the result of the instruction at i, which would be pushed
+// at position r; when the result is stored into a local right away, write
+// it to the local directly and skip the set/local instruction.
+static size_t translator_destination(Translator* t, size_t* next, size_t r) {
+    size_t j = *next;
+    if (j < t->count && t->bytes[j] == op_set_local && !t->targets[j]) {
+        size_t local = t->bytes[j + 1];
+        translator_flush_register(t, local);
+        translator_write_local(t, local);
+        *next = j + opcode_size(op_set_local);
+        return local;
+    }
+    return r;
+}
+
+// Is the predicate of the conditional jump at i popped right after, both
+// when jumping and when not jumping? Then it does not need to be kept in a
+// register.
+static bool translator_test_only(Translator* t, size_t i) {
+    size_t next = i + opcode_size(t->bytes[i]);
+    size_t target = jump_target(t->bytes, i);
+    return next < t->count && t->bytes[next] == op_pop && !t->targets[next] &&
+        target < t->count && t->bytes[target] == op_pop;
+}
+
+static Opcode register_opcode(uint8_t opcode) {
+    switch (opcode) {
+        case op_negate: return op_r_negate;
+        case op_add: return op_r_add;
+        case op_subtract: return op_r_subtract;
+        case op_multiply: return op_r_multiply;
+        case op_divide: return op_r_divide;
+        case op_exponent: return op_r_exponent;
+        case op_not: return op_r_not;
+        case op_eq: return op_r_eq;
+        case op_ne: return op_r_ne;
+        case op_gt: return op_r_gt;
+        case op_ge: return op_r_ge;
+        case op_lt: return op_r_lt;
+        case op_le: return op_r_le;
+        case op_bars: return op_r_bars;
+        case op_quote: return op_r_quote;
+        case op_jump: return op_r_jump;
+        case op_jump_true: return op_r_jump_true;
+        case op_jump_false: return op_r_jump_false;
+        default: return op_nop;
+    }
+}
+
+// Comparisons followed by a conditional jump become a single instruction.
+static Opcode register_jump_opcode(uint8_t opcode) {
+    switch (opcode) {
+        case op_gt: return op_r_gt_jump_false;
+        case op_ge: return op_r_ge_jump_false;
+        case op_lt: return op_r_lt_jump_false;
+        case op_le: return op_r_le_jump_false;
+        default: return op_nop;
+    }
+}
+
+// Translate the stack code of the chunk of a function into register code,
+// with depth values already on the stack when the function starts (the
+// function and its arguments). The number of registers needed by the
+// function is set as well.
+bool function_to_registers(Function* function, size_t depth) {
+    Chunk* chunk = function->chunk;
+    Translator t = {
+        .chunk = chunk,
+        .bytes = chunk->bytes.items,
+        .count = chunk->bytes.count,
+        .depth = 0,
+        .registers = depth,
+        .error = false,
+    };
+    uint8_t* bytes = t.bytes;
+    size_t count = t.count;
+
+    // Line of every byte, and targets of all jumps.
+    size_t* lines = malloc((count + 1) * sizeof(size_t));
+    for (size_t i = 0, j = 0; j < chunk->line_numbers.count; j += 2) {
+        for (size_t k = 0; k < chunk->line_numbers.items[j + 1]; ++k) {
+            lines[i++] = chunk->line_numbers.items[j];
+        }
+    }
+    t.targets = calloc(count + 1, sizeof(bool));
+    for (size_t i = 0; i < count; i += opcode_size(bytes[i])) {
+        if (is_jump(bytes[i])) {
+            t.targets[jump_target(bytes, i)] = true;
+        }
+    }
+    ptrdiff_t* depths = stack_depths(bytes, count, depth);
+
+    size_t* positions = calloc(count + 1, sizeof(size_t));
+    byte_array_init(&t.code);
+    number_array_init(&t.lines);
+    number_array_init(&t.jumps);
+
+    // Values can only be found on the virtual stack when falling through
+    // from the previous instruction; otherwise all values are in place.
+    bool fallthrough = false;
+    for (size_t i = 0; i < count && !t.error;) {
+        uint8_t opcode = bytes[i];
+        size_t next = i + opcode_size(opcode);
+        if (depths[i] < 0) {
+            positions[i] = t.code.count;
+            i = next;
+            continue;
+        }
+        t.line = lines[i];
+        if (!fallthrough) {
+            for (t.depth = 0; t.depth < (size_t)depths[i];) {
+                translator_push(&t, operand_register(t.depth));
+            }
+        } else if (t.targets[i]) {
+            translator_flush(&t, t.depth);
+        }
+        positions[i] = t.code.count;
+        fallthrough = true;
+
+        switch (opcode) {
+            case op_nil: translator_push(&t, operand_constant(&t, VALUE_NIL)); break;
+            case op_zero: translator_push(&t, operand_constant(&t, VALUE_FROM_NUMBER(0))); break;
+            case op_one: translator_push(&t, operand_constant(&t, VALUE_FROM_NUMBER(1))); break;
+            case op_infinity: translator_push(&t, operand_constant(&t, VALUE_FROM_NUMBER(INFINITY))); break;
+            case op_epsilon: translator_push(&t, operand_constant(&t, VALUE_EPSILON)); break;
+            case op_false: translator_push(&t, operand_constant(&t, VALUE_FALSE)); break;
+            case op_true: translator_push(&t, operand_constant(&t, VALUE_TRUE)); break;
+            case op_constant:
+                translator_push(&t, (Operand){ .constant = true, .index = bytes[i + 1] });
+                break;
+
+            case op_negate:
+            case op_not:
+            case op_bars:
+            case op_quote: {
+                size_t r = t.depth - 1;
+                uint8_t x = translator_operand(&t, translator_pop(&t), r);
+                size_t a = translator_destination(&t, &next, r);
+                translator_emit_3(&t, register_opcode(opcode), (uint8_t)a, x);
+                translator_push(&t, operand_register(a));
+                break;
+            }
+
+            case op_add:
+            case op_subtract:
+            case op_multiply:
+            case op_divide:
+            case op_exponent:
+            case op_eq:
+            case op_ne:
+            case op_gt:
+            case op_ge:
+            case op_lt:
+            case op_le: {
+                size_t r = t.depth - 2;
+                Operand y = translator_pop(&t);
+                Operand x = translator_pop(&t);
+                uint8_t b = translator_operand(&t, x, r);
+                uint8_t c = translator_operand(&t, y, r + 1);
+                Opcode jump = register_jump_opcode(opcode);
+                if (jump != op_nop && next < count && bytes[next] == op_jump_false && !t.targets[next] &&
+                    translator_test_only(&t, next)) {
+                    translator_flush(&t, t.depth);
+                    translator_emit_3(&t, jump, b, c);
+                    translator_emit_jump(&t, jump_target(bytes, next));
+                    // The result is never read, but the pop that follows
+                    // still expects it on the stack.
+                    translator_push(&t, operand_register(r));
+                    next += opcode_size(op_jump_false);
+                } else {
+                    size_t a = translator_destination(&t, &next, r);
+                    translator_emit(&t, register_opcode(opcode));
+                    translator_emit_3(&t, (uint8_t)a, b, c);
+                    translator_push(&t, operand_register(a));
+                }
+                break;
+            }
+
+            case op_print: {
+                size_t r = t.depth - 1;
+                uint8_t x = translator_operand(&t, translator_pop(&t), r);
+                translator_emit(&t, op_r_print);
+                translator_emit(&t, x);
+                break;
+            }
+
+            case op_pop: translator_pop(&t); break;
+            case op_dup: translator_push(&t, t.stack[t.depth - 1]); break;
+
+            case op_define_global:
+            case op_set_global: {
+                size_t r = t.depth - 1;
+                uint8_t x = translator_operand(&t, t.stack[r], r);
+                if (opcode == op_define_global) {
+                    translator_pop(&t);
+                }
+                translator_emit_3(&t, opcode == op_define_global ? op_r_define_global : op_r_set_global,
+                    bytes[i + 1], x);
+                break;
+            }
+            case op_get_global: {
+                size_t a = translator_destination(&t, &next, t.depth);
+                translator_emit_3(&t, op_r_get_global, (uint8_t)a, bytes[i + 1]);
+                translator_push(&t, operand_register(a));
+                break;
+            }
+
+            case op_get_local: {
+                size_t local = bytes[i + 1];
+                translator_materialize(&t, local);
+                translator_push(&t, operand_register(local));
+                break;
+            }
+            case op_set_local: {
+                size_t local = bytes[i + 1];
+                Operand value = t.stack[t.depth - 1];
+                if (value.constant || value.index != local) {
+                    translator_flush_register(&t, local);
+                    translator_emit_3(&t, value.constant ? op_r_constant : op_r_move, (uint8_t)local,
+                        value.index);
+                    translator_write_local(&t, local);
+                    t.stack[t.depth - 1] = operand_register(local);
+                }
+                break;
+            }
+
+            case op_jump:
+                translator_flush(&t, t.depth);
+                translator_emit(&t, op_r_jump);
+                translator_emit_jump(&t, jump_target(bytes, i));
+                fallthrough = false;
+                break;
+            case op_jump_true:
+            case op_jump_false: {
+                size_t r = t.depth - 1;
+                uint8_t x;
+                if (translator_test_only(&t, i)) {
+                    translator_flush(&t, r);
+                    x = translator_operand(&t, t.stack[r], r);
+                } else {
+                    translator_flush(&t, t.depth);
+                    x = (uint8_t)r;
+                }
+                translator_emit(&t, register_opcode(opcode));
+                translator_emit(&t, x);
+                translator_emit_jump(&t, jump_target(bytes, i));
+                break;
+            }
+
+            // The parts of a string are concatenated in place, like the
+            // arguments of a call.
+            case op_concat: {
+                size_t n = bytes[i + 1];
+                size_t a = t.depth - n;
+                for (size_t j = a; j < t.depth; ++j) {
+                    translator_materialize(&t, j);
+                }
+                translator_emit_3(&t, op_r_concat, (uint8_t)a, (uint8_t)n);
+                t.depth = a;
+                translator_push(&t, operand_register(a));
+                break;
+            }
+
+            case op_call:
+            case op_tail_call: {
+                size_t n = bytes[i + 1];
+                size_t a = t.depth - n - 1;
+                for (size_t j = a; j < t.depth; ++j) {
+                    translator_materialize(&t, j);
+                }
+                translator_emit_3(&t, opcode == op_call ? op_r_call : op_r_tail_call, (uint8_t)a, (uint8_t)n);
+                t.depth = a;
+                translator_push(&t, operand_register(a));
+                break;
+            }
+
+            case op_return: {
+                // The script returns with an empty stack.
+                Operand result = t.depth == 0 ? operand_constant(&t, VALUE_NIL) : t.stack[t.depth - 1];
+                uint8_t x = translator_operand(&t, result, t.depth == 0 ? 0 : t.depth - 1);
+                translator_emit(&t, op_r_return);
+                translator_emit(&t, x);
+                fallthrough = false;
+                break;
+            }
+
+            case op_nop:
+                break;
+
+            default:
+                translator_error(&t, "unexpected instruction for the register backend");
+                break;
+        }
+        i = next;
+    }
+    positions[count] = t.code.count;
+
+    for (size_t j = 0; j < t.jumps.count; j += 2) {
+        size_t at = t.jumps.items[j];
+        ptrdiff_t offset = positions[t.jumps.items[j + 1]] - (at + 2);
+        t.code.items[at] = (uint8_t)(offset >> 8);
+        t.code.items[at + 1] = (uint8_t)offset;
+    }
+
+    // Replace the bytes and line numbers of the chunk.
+    if (!t.error) {
+        byte_array_free(&chunk->bytes);
+        number_array_free(&chunk->line_numbers);
+        for (size_t i = 0; i < t.code.count; ++i) {
+            chunk_add_byte(chunk, t.code.items[i], t.lines.items[i]);
+        }
+        function->registers = t.registers;
+    }
+
+    byte_array_free(&t.code);
+    number_array_free(&t.lines);
+    number_array_free(&t.jumps);
+    free(positions);
+    free(depths);
+    free(t.targets);
+    free(lines);
+    return !t.error;
+}
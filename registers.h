@@ -0,0 +1,11 @@
+#ifndef __REGISTERS_H__
+#define __REGISTERS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "value.h"
+
+bool function_to_registers(Function*, size_t);
+
+#endif
@@ -4,9 +4,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "jit.h"
 #include "value.h"
 #include "vm.h"
 
+Nursery* string_nursery = 0;
+
+// The hash of a string is only computed the first time that it is needed (a
+// hash of 0 means that it is not known yet), since most strings made while a
+// script runs are never interned nor used as keys.
+uint64_t string_hash(String* string) {
+    if (string->hash == 0) {
+        string->hash = bytes_hash(string_bytes(string), string->length);
+    }
+    return string->hash;
+}
+
 void value_print(Value v) {
     value_print_debug(stdout, v, false);
 }
@@ -31,10 +44,10 @@ void value_print_debug(FILE* stream, Value v, bool debug) {
                     for (size_t i = 0, offset = 6; i < n; ++i, offset += 7) {
                         fputc((v.as_int >> offset) & 0x7f, stream);
                     }
-                } else if (debug) {
-                    fputs(VALUE_IS_EPSILON(v) ? "ε" : VALUE_TO_CSTRING(v), stream);
                 } else if (!VALUE_IS_EPSILON(v)) {
-                    fputs(VALUE_TO_CSTRING(v), stream);
+                    fwrite(string_bytes(VALUE_TO_STRING(v)), 1, VALUE_TO_STRING(v)->length, stream);
+                } else if (debug) {
+                    fputs("ε", stream);
                 }
                 break;
             case tag_function: {
@@ -132,7 +145,6 @@ static Value value_concatenate_short_short(Value x, Value y) {
         string->chars[i + m] = (y.as_int >> shift) & 0x7f;
     }
     string->chars[length] = 0;
-    string->hash = bytes_hash(string->chars, string->length);
     return VALUE_FROM_STRING(string);
 }
 
@@ -145,9 +157,8 @@ static Value value_concatenate_short_long(Value x, Value y) {
     for (size_t i = 0, shift = 6; i < m; ++i, shift += 7) {
         string->chars[i] = (x.as_int >> shift) & 0x7f;
     }
-    memcpy(string->chars + m, yy->chars, n);
+    memcpy(string->chars + m, string_bytes(yy), n);
     string->chars[length] = 0;
-    string->hash = bytes_hash(string->chars, string->length);
     return VALUE_FROM_STRING(string);
 }
 
@@ -157,24 +168,33 @@ static Value value_concatenate_long_short(Value x, Value y) {
     size_t n = VALUE_SHORT_STRING_LENGTH(y);
     size_t length = m + n;
     String* string = string_new(length);
-    memcpy(string->chars, xx->chars, m);
+    memcpy(string->chars, string_bytes(xx), m);
     for (size_t i = 0, shift = 6; i < n; ++i, shift += 7) {
         string->chars[i + m] = (y.as_int >> shift) & 0x7f;
     }
     string->chars[length] = 0;
-    string->hash = bytes_hash(string->chars, string->length);
     return VALUE_FROM_STRING(string);
 }
 
+// Length of a string that is not ε.
+static size_t value_string_length(Value v) {
+    return VALUE_IS_SHORT_STRING(v) ? VALUE_SHORT_STRING_LENGTH(v) : VALUE_TO_STRING(v)->length;
+}
+
 Value value_concatenate_strings(Value x, Value y) {
-    if (VALUE_IS_EPSILON(y)) {
+    if (VALUE_IS_EPSILON(x)) {
         // ε * y = y
-        return x;
+        return y;
     }
     if (VALUE_IS_EPSILON(y)) {
         // x * ε = x
         return x;
     }
+    if (value_string_length(x) + value_string_length(y) >= STRING_ROPE_MIN) {
+        // Nothing is copied yet, so that building a long string piece by piece
+        // takes linear time.
+        return VALUE_FROM_STRING(string_rope(x, y));
+    }
     if (VALUE_IS_SHORT_STRING(x)) {
         if (VALUE_IS_SHORT_STRING(y)) {
             size_t m = VALUE_SHORT_STRING_LENGTH(x);
@@ -184,7 +204,7 @@ Value value_concatenate_strings(Value x, Value y) {
                 // x * y is still a short string when |x| + |y| fits in a short string. Use the x string,
                 // mask off the length bits, and OR with the y chars shifted by |x| and the new length.
                 return (Value){ .as_int = (x.as_int & ~VALUE_SHORT_STRING_LENGTH_MASK) |
-                    ((y.as_int & (((1 << (7 * n)) - 1) << 6)) << (7 * m)) | (l << 3) };
+                    ((y.as_int & ((((uint64_t)1 << (7 * n)) - 1) << 6)) << (7 * m)) | (l << 3) };
             }
             // x * y is too long to fit in a short string.
             return value_concatenate_short_short(x, y);
@@ -213,7 +233,7 @@ Value value_string_exponent(Value base, double x) {
         size_t n = m * y;
         if (n <= 6) {
             Value str = (Value){ .as_int = (base.as_int & ~VALUE_SHORT_STRING_LENGTH_MASK) | (n << 3) };
-            uint64_t b = base.as_int & (((1 << (7 * m)) - 1) << 6);
+            uint64_t b = base.as_int & ((((uint64_t)1 << (7 * m)) - 1) << 6);
             for (size_t i = 1; i < y; ++i) {
                 str.as_int |= (b << (7 * m * i));
             }
@@ -226,23 +246,160 @@ Value value_string_exponent(Value base, double x) {
             }
         }
         string->chars[n] = 0;
-        string->hash = bytes_hash(string->chars, string->length);
         return VALUE_FROM_STRING(string);
     }
     return VALUE_FROM_STRING(string_exponent(VALUE_TO_STRING(base), y));
 }
 
-uint32_t value_hash(Value v) {
+// Characters and length of a string.
+static const char* value_string_chars(Value v, char short_string[7], size_t* length) {
+    if (VALUE_IS_EPSILON(v)) {
+        *length = 0;
+        return "";
+    }
+    if (VALUE_IS_SHORT_STRING(v)) {
+        *length = VALUE_SHORT_STRING_LENGTH(v);
+        for (size_t i = 0, shift = 6; i < *length; ++i, shift += 7) {
+            short_string[i] = (v.as_int >> shift) & 0x7f;
+        }
+        return short_string;
+    }
+    *length = VALUE_TO_STRING(v)->length;
+    return string_bytes(VALUE_TO_STRING(v));
+}
+
+#define VALUE_QUOTED_MAX 32
+
+// Characters and length of a value as it is quoted (see value_stringify);
+// numbers and short strings are written to buffer.
+static const char* value_quoted_chars(Value v, char buffer[VALUE_QUOTED_MAX], size_t* length) {
+    if (VALUE_IS_NUMBER(v)) {
+        if (v.as_double == INFINITY || v.as_double == -INFINITY) {
+            *length = v.as_double > 0 ? 3 : 4;
+            return v.as_double > 0 ? "∞" : "-∞";
+        }
+        *length = (size_t)snprintf(buffer, VALUE_QUOTED_MAX, "%g", v.as_double);
+        return buffer;
+    }
+    if (VALUE_IS_STRING(v)) {
+        return value_string_chars(v, buffer, length);
+    }
+    *length = strlen(strings[VALUE_TAG(v)]);
+    return strings[VALUE_TAG(v)];
+}
+
+// Concatenation of n values (at least one) quoted as strings, for "a${x}b":
+// the length of the result is known before it is allocated, and every part
+// is copied to it directly. A single string is returned as it is.
+Value value_interpolate(size_t n, const Value* values) {
+    if (n == 1 && VALUE_IS_STRING(values[0])) {
+        return values[0];
+    }
+    char buffers[n][VALUE_QUOTED_MAX];
+    const char* chars[n];
+    size_t lengths[n];
+    size_t length = 0;
+    for (size_t i = 0; i < n; ++i) {
+        chars[i] = value_quoted_chars(values[i], buffers[i], &lengths[i]);
+        length += lengths[i];
+    }
+    if (length == 0) {
+        return VALUE_EPSILON;
+    }
+    if (length <= 6) {
+        char short_string[6];
+        for (size_t i = 0, j = 0; i < n; j += lengths[i++]) {
+            memcpy(short_string + j, chars[i], lengths[i]);
+        }
+        return value_copy_string(short_string, length);
+    }
+    String* string = string_new(length);
+    for (size_t i = 0, j = 0; i < n; j += lengths[i++]) {
+        memcpy(string->chars + j, chars[i], lengths[i]);
+    }
+    string->chars[length] = 0;
+    return VALUE_FROM_STRING(string);
+}
+
+// Substring of a string from start up to end (clamped to the string); long
+// substrings are slices of the string, and shorter ones are copied.
+Value value_string_slice(Value v, double start, double end) {
+    size_t length = VALUE_IS_EPSILON(v) ? 0 : value_string_length(v);
+    size_t i = start > 0 ? (start < length ? (size_t)start : length) : 0;
+    size_t j = end > 0 ? (end < length ? (size_t)end : length) : 0;
+    if (j <= i) {
+        return VALUE_EPSILON;
+    }
+    if (i == 0 && j == length) {
+        return v;
+    }
+    if (j - i < STRING_SLICE_MIN) {
+        char short_string[7];
+        size_t n;
+        const char* chars = value_string_chars(v, short_string, &n);
+        return value_copy_string(chars + i, j - i);
+    }
+    return VALUE_FROM_STRING(string_slice(v, i, j - i));
+}
+
+// Values are equal when their bits are; strings are equal when their
+// characters are, since strings in the nursery are not interned (and strings
+// made from numbers or concatenations may be long strings even when short.)
+bool value_equal(Value x, Value y) {
+    if (VALUE_EQUAL(x, y)) {
+        return true;
+    }
+    if (!VALUE_IS_STRING(x) || !VALUE_IS_STRING(y)) {
+        return false;
+    }
+    char xs[7];
+    char ys[7];
+    size_t m;
+    size_t n;
+    const char* xchars = value_string_chars(x, xs, &m);
+    const char* ychars = value_string_chars(y, ys, &n);
+    return m == n && memcmp(xchars, ychars, m) == 0;
+}
+
+// Final mix of MurmurHash3, so that every bit of the hash depends on every bit
+// of the value.
+static uint64_t value_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdu;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53u;
+    x ^= x >> 33;
+    return x;
+}
+
+// Values that are not string objects (including short strings) are hashed as a
+// single word.
+uint64_t value_hash(Value v) {
     return VALUE_IS_STRING(v) && !VALUE_IS_EPSILON(v) && !VALUE_IS_SHORT_STRING(v) ?
-        VALUE_TO_STRING(v)->hash : bytes_hash(v.as_bytes, 8);
+        string_hash(VALUE_TO_STRING(v)) : value_mix(v.as_int);
 }
 
 void value_free_object(Value v) {
     if (VALUE_IS_STRING(v) && !VALUE_IS_EPSILON(v) && !VALUE_IS_SHORT_STRING(v)) {
+        String* string = VALUE_TO_STRING(v);
+        // The parts of a rope may have been freed already, so it is not
+        // flattened now.
+        if (string->rope) {
+#ifdef DEBUG
+            fprintf(stderr, "--- value_free_object() rope (length: %zu)\n", string->length);
+#endif
+            free(((Rope*)string)->chars);
+        } else if (string->slice) {
+#ifdef DEBUG
+            fprintf(stderr, "--- value_free_object() slice (length: %zu)\n", string->length);
+#endif
+            free(((Slice*)string)->chars);
+        } else {
 #ifdef DEBUG
-        fprintf(stderr, "--- value_free_object() string \"%s\"\n", VALUE_TO_CSTRING(v));
+            fprintf(stderr, "--- value_free_object() string \"%s\"\n", string->chars);
 #endif
-        free(VALUE_TO_STRING(v));
+        }
+        free(string);
     } else if (VALUE_IS_FUNCTION(v) && !VALUE_IS_FOREIGN_FUNCTION(v)) {
         function_free(VALUE_TO_FUNCTION(v));
     } else if (VALUE_IS_POINTER(v)) {
@@ -253,18 +410,51 @@ void value_free_object(Value v) {
     }
 }
 
-uint32_t bytes_hash(char* bytes, size_t length) {
-    uint32_t hash = 2166136261u;
-    for (size_t i = 0; i < length; ++i) {
-        hash ^= (uint8_t)bytes[i];
-        hash *= 16777619;
+#define HASH_PRIME_1 0x9e3779b185ebca87u
+#define HASH_PRIME_2 0xc2b2ae3d27d4eb4fu
+#define HASH_PRIME_4 0x85ebca77c2b2ae63u
+#define HASH_PRIME_5 0x27d4eb2f165667c5u
+#define HASH_ROTATE(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+// 64-bit hash of bytes, a word at a time, with the rounds of xxHash64 for short
+// inputs (the last bytes are padded with zeros to a word, after the length has
+// been mixed in).
+uint64_t bytes_hash(const char* bytes, size_t length) {
+    uint64_t hash = HASH_PRIME_5 + length;
+    for (size_t i = 0; i < length; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, length - i < 8 ? length - i : 8);
+        word *= HASH_PRIME_2;
+        hash ^= HASH_ROTATE(word, 31) * HASH_PRIME_1;
+        hash = HASH_ROTATE(hash, 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    return value_mix(hash);
+}
+
+// Bump allocation in the nursery; once it is full, new strings go to the heap
+// until the next minor collection empties it.
+static String* nursery_allocate(Nursery* nursery, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (nursery->full || nursery->top + size > nursery->end) {
+        nursery->full = true;
+        return 0;
     }
-    return hash;
+    String* string = (String*)nursery->top;
+    nursery->top += size;
+    return string;
 }
 
 String* string_new(size_t length) {
-    String* string = malloc(sizeof(String) + length + 1);
+    size_t size = sizeof(String) + length + 1;
+    String* string = string_nursery ? nursery_allocate(string_nursery, size) : 0;
+    if (!string) {
+        string = malloc(size);
+    }
     string->length = length;
+    string->hash = 0;
+    string->marked = false;
+    string->rope = false;
+    string->slice = false;
 #ifdef DEBUG
     fprintf(stderr, "+++ string_new() (%p, length: %zu).", (void*)string->chars, string->length);
 #endif
@@ -275,46 +465,160 @@ String* string_copy(const char* start, size_t length) {
     String* string = string_new(length);
     memcpy(string->chars, start, length);
     string->chars[length] = 0;
-    string->hash = bytes_hash(string->chars, string->length);
     return string;
 }
 
+// A rope is allocated in the heap, never in the nursery, since it lives as
+// long as the string that it makes. Its parts may still be in the nursery
+// though (see gc_collect_nursery).
+String* string_rope(Value left, Value right) {
+    Rope* rope = malloc(sizeof(Rope));
+    rope->length = value_string_length(left) + value_string_length(right);
+    rope->hash = 0;
+    rope->marked = false;
+    rope->rope = true;
+    rope->slice = false;
+    size_t depth = STRING_DEPTH(left) > STRING_DEPTH(right) ? STRING_DEPTH(left) : STRING_DEPTH(right);
+    rope->depth = depth + 1;
+    rope->left = left;
+    rope->right = right;
+    rope->chars = 0;
+#ifdef DEBUG
+    fprintf(stderr, "+++ string_rope() (%p, length: %zu, depth: %zu)\n", (void*)rope, rope->length, rope->depth);
+#endif
+    return (String*)rope;
+}
+
+// A slice is allocated in the heap like a rope, and its parent may be in the
+// nursery too. The parent of a slice of an uncopied slice is the parent of
+// that slice, so that slices never refer to each other.
+String* string_slice(Value parent, size_t offset, size_t length) {
+    String* string = VALUE_TO_STRING(parent);
+    if (string->slice && !((Slice*)string)->chars) {
+        offset += ((Slice*)string)->offset;
+        parent = ((Slice*)string)->parent;
+    }
+    Slice* slice = malloc(sizeof(Slice));
+    slice->length = length;
+    slice->hash = 0;
+    slice->marked = false;
+    slice->rope = false;
+    slice->slice = true;
+    slice->parent = parent;
+    slice->offset = offset;
+    slice->chars = 0;
+#ifdef DEBUG
+    fprintf(stderr, "+++ string_slice() (%p, length: %zu, offset: %zu)\n", (void*)slice, length, offset);
+#endif
+    return (String*)slice;
+}
+
+// Copy the characters of a string (other than ε) to dest, going down the
+// deeper part of a rope in a loop, so that the C stack stays shallow for ropes
+// that were built by appending (or prepending) one piece at a time.
+static void value_string_write(Value v, char* dest) {
+    while (STRING_DEPTH(v) > 0) {
+        Rope* rope = (Rope*)VALUE_TO_STRING(v);
+        size_t m = value_string_length(rope->left);
+        if (STRING_DEPTH(rope->left) < STRING_DEPTH(rope->right)) {
+            value_string_write(rope->left, dest);
+            dest += m;
+            v = rope->right;
+        } else {
+            value_string_write(rope->right, dest + m);
+            v = rope->left;
+        }
+    }
+    char short_string[7];
+    size_t length;
+    const char* chars = value_string_chars(v, short_string, &length);
+    memcpy(dest, chars, length);
+}
+
+// Characters of a string, flattening a rope or copying a slice the first time.
+char* string_chars(String* string) {
+    if (string->slice) {
+        Slice* slice = (Slice*)string;
+        if (!slice->chars) {
+            char* chars = malloc(slice->length + 1);
+            memcpy(chars, string_bytes(string), slice->length);
+            chars[slice->length] = 0;
+            slice->chars = chars;
+            slice->parent = VALUE_NONE;
+#ifdef DEBUG
+            fprintf(stderr, "~~~ string_chars() copied slice %p (length: %zu)\n", (void*)slice, slice->length);
+#endif
+        }
+        return slice->chars;
+    }
+    if (!string->rope) {
+        return string->chars;
+    }
+    Rope* rope = (Rope*)string;
+    if (!rope->chars) {
+        char* chars = malloc(rope->length + 1);
+        value_string_write(VALUE_FROM_STRING(rope), chars);
+        chars[rope->length] = 0;
+        rope->chars = chars;
+        rope->depth = 0;
+        rope->left = VALUE_NONE;
+        rope->right = VALUE_NONE;
+#ifdef DEBUG
+        fprintf(stderr, "~~~ string_chars() flattened rope %p (length: %zu)\n", (void*)rope, rope->length);
+#endif
+    }
+    return rope->chars;
+}
+
+// Characters of a string, which are not followed by a NUL character in the
+// case of a slice that was not copied yet.
+const char* string_bytes(String* string) {
+    if (string->slice && !((Slice*)string)->chars) {
+        return string_bytes(VALUE_TO_STRING(((Slice*)string)->parent)) + ((Slice*)string)->offset;
+    }
+    return string_chars(string);
+}
+
 String* string_concatenate(String* x, String* y) {
     String* string = string_new(x->length + y->length);
-    memcpy(string->chars, x->chars, x->length);
-    memcpy(string->chars + x->length, y->chars, y->length);
+    memcpy(string->chars, string_bytes(x), x->length);
+    memcpy(string->chars + x->length, string_bytes(y), y->length);
     string->chars[string->length] = 0;
-    string->hash = bytes_hash(string->chars, string->length);
     return string;
 }
 
 String* string_exponent(String* x, double n) {
     String* string = string_new(x->length * n);
     for (size_t i = 0; i < n; ++i) {
-        memcpy(string->chars + i * x->length, x->chars, x->length);
+        memcpy(string->chars + i * x->length, string_bytes(x), x->length);
     }
     string->chars[string->length] = 0;
-    string->hash = bytes_hash(string->chars, string->length);
     return string;
 }
 
 String* string_from_number(double n) {
     String* string = string_new((size_t)snprintf(NULL, 0, "%g", n));
     snprintf(string->chars, string->length + 1, "%g", n);
-    string->hash = bytes_hash(string->chars, string->length);
     return string;
 }
 
+// Hashes are only compared when both are known.
 bool string_equal(String* s, String* t) {
-    return s->length == t->length && s->hash == t->hash && memcmp(s->chars, t->chars, s->length) == 0;
+    return s->length == t->length && (s->hash == t->hash || s->hash == 0 || t->hash == 0) &&
+        memcmp(string_bytes(s), string_bytes(t), s->length) == 0;
 }
 
 Function* function_new(void) {
     Function* f = malloc(sizeof(Function));
     f->arity = 0;
+    f->registers = 0;
     f->chunk = malloc(sizeof(Chunk));
     chunk_init(f->chunk);
     f->name = VALUE_NONE;
+    f->calls = 0;
+    f->native = 0;
+    f->native_size = 0;
+    f->marked = false;
     return f;
 }
 
@@ -322,6 +626,7 @@ void function_free(Function* f) {
 #ifdef DEBUG
         fprintf(stderr, "--- function_free() function %p\n", (void*)f);
 #endif
+    jit_free(f);
     chunk_free(f->chunk);
     free(f);
 }
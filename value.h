@@ -53,30 +53,30 @@ enum {
 #define VALUE_FROM_INT(x) (Value){ .as_double = (double)(x) }
 
 #define VALUE_TAG(v) ((v).as_int & tag_mask)
+#define VALUE_HAS_TAG(v, tag) (((v).as_int & (VALUE_QNAN_MASK | tag_mask)) == (VALUE_QNAN_MASK | (tag)))
 
 #define VALUE_IS_NONE(v) ((v).as_int == VALUE_NONE_MASK)
 #define VALUE_IS_HAMT_NODE(v) (((v).as_int & VALUE_HAMT_NODE_MASK) == VALUE_HAMT_NODE_MASK)
-#define VALUE_IS_NIL(v) (VALUE_TAG(v) == tag_nil)
-#define VALUE_IS_BOOLEAN(v) (((v).as_int & 6) == 2)
-#define VALUE_IS_FALSE(v) (VALUE_TAG(v) == tag_false)
-#define VALUE_IS_TRUE(v) (VALUE_TAG(v) == tag_true)
+#define VALUE_IS_NIL(v) VALUE_HAS_TAG(v, tag_nil)
+#define VALUE_IS_BOOLEAN(v) (((v).as_int & (VALUE_QNAN_MASK | 6)) == (VALUE_QNAN_MASK | 2))
+#define VALUE_IS_FALSE(v) VALUE_HAS_TAG(v, tag_false)
+#define VALUE_IS_TRUE(v) VALUE_HAS_TAG(v, tag_true)
 #define VALUE_IS_EPSILON(v) ((v).as_int == VALUE_EPSILON_MASK)
 #define VALUE_IS_SHORT_STRING(v) (((v).as_int & VALUE_SHORT_STRING_MASK) == VALUE_SHORT_STRING_MASK)
-#define VALUE_IS_STRING(v) (VALUE_TAG(v) == tag_string)
-#define VALUE_IS_FUNCTION(v) (VALUE_TAG(v) == tag_function)
+#define VALUE_IS_STRING(v) VALUE_HAS_TAG(v, tag_string)
+#define VALUE_IS_FUNCTION(v) VALUE_HAS_TAG(v, tag_function)
 #define VALUE_IS_FOREIGN_FUNCTION(v) (((v).as_int & VALUE_FOREIGN_FUNCTION_MASK) == \
     VALUE_FOREIGN_FUNCTION_MASK)
-#define VALUE_IS_POINTER(v) (VALUE_TAG(v) == tag_pointer)
+#define VALUE_IS_POINTER(v) VALUE_HAS_TAG(v, tag_pointer)
 #define VALUE_IS_NUMBER(v) (((v).as_int & VALUE_QNAN_MASK) != VALUE_QNAN_MASK)
 
 #define VALUE_TO_STRING(v) ((String*)((v).as_int & VALUE_OBJECT_MASK))
-#define VALUE_TO_CSTRING(v) (VALUE_TO_STRING(v)->chars)
+#define VALUE_TO_CSTRING(v) string_chars(VALUE_TO_STRING(v))
 #define VALUE_TO_HAMT(v) ((HAMT*)((v).as_int & VALUE_OBJECT_MASK))
 #define VALUE_TO_FUNCTION(v) ((Function*)((v).as_int & VALUE_OBJECT_MASK))
 #define VALUE_TO_FOREIGN_FUNCTION(v) ((ForeignFunction*)((v).as_int & VALUE_OBJECT_MASK))
 #define VALUE_TO_POINTER(v) ((v).as_int & VALUE_OBJECT_MASK)
 #define VALUE_TO_INT(v) ((int64_t)(v).as_double)
-#define VALUE_TO_HAMT_NODE_BITMAP(v) ((uint32_t)(v).as_int)
 
 #define VALUE_SHORT_STRING_LENGTH(v) ((size_t)(((v).as_int & VALUE_SHORT_STRING_LENGTH_MASK) >> 3))
 
@@ -87,18 +87,91 @@ char* value_to_cstring(Value);
 Value value_stringify(Value);
 Value value_concatenate_strings(Value, Value);
 Value value_string_exponent(Value, double);
-uint32_t value_hash(Value);
+Value value_interpolate(size_t, const Value*);
+Value value_string_slice(Value, double, double);
+uint64_t value_hash(Value);
+bool value_equal(Value, Value);
 void value_free_object(Value);
 
-uint32_t bytes_hash(char*, size_t);
+uint64_t bytes_hash(const char*, size_t);
 
 typedef struct {
     size_t length;
-    uint32_t hash;
+    uint64_t hash;
+    bool marked;
+    // Whether this is actually a Rope or a Slice, with no characters of its
+    // own (at first).
+    bool rope;
+    bool slice;
     char chars[];
 } String;
 
+// Concatenations of long strings make ropes rather than copying their operands
+// (see value_concatenate_strings). A rope begins like a String and refers to
+// its two parts (strings other than ε) until its characters are needed (see
+// string_chars); they are then copied once to chars, which the rope owns, and
+// the parts are let go.
+typedef struct {
+    size_t length;
+    uint64_t hash;
+    bool marked;
+    bool rope;
+    bool slice;
+    // Longest path down to a string that is not a rope.
+    size_t depth;
+    Value left;
+    Value right;
+    char* chars;
+} Rope;
+
+// Shorter concatenations are copied.
+#define STRING_ROPE_MIN 256
+
+// Substrings of long strings make slices (see value_string_slice), which refer
+// to the characters of their parent string, at an offset, until they get
+// copied to chars. This happens when the characters are needed as a C string
+// (see string_chars), or when nothing else keeps the parent alive (see
+// gc_collect), so that a short slice does not keep a long string around.
+typedef struct {
+    size_t length;
+    uint64_t hash;
+    bool marked;
+    bool rope;
+    bool slice;
+    // A string that is not an uncopied slice itself, or none once copied.
+    Value parent;
+    size_t offset;
+    char* chars;
+} Slice;
+
+// Shorter substrings are copied (to the nursery), which costs less than a
+// slice in the heap that has to be tracked and freed.
+#define STRING_SLICE_MIN 1024
+
+// Depth of a part of a rope.
+#define STRING_DEPTH(v) (!VALUE_IS_SHORT_STRING(v) && VALUE_TO_STRING(v)->rope ? \
+    ((Rope*)VALUE_TO_STRING(v))->depth : 0)
+
+// Strings made while a script runs are first allocated in the nursery of the
+// VM, where most of them die young (see gc.c); they are not interned until
+// they get promoted to the heap.
+typedef struct {
+    char* start;
+    char* top;
+    char* end;
+    bool full;
+} Nursery;
+
+#define NURSERY_CONTAINS(nursery, p) ((char*)(p) >= (nursery)->start && (char*)(p) < (nursery)->end)
+
+extern Nursery* string_nursery;
+
+uint64_t string_hash(String*);
+char* string_chars(String*);
+const char* string_bytes(String*);
 String* string_new(size_t);
+String* string_rope(Value, Value);
+String* string_slice(Value, size_t, size_t);
 String* string_copy(const char*, size_t);
 String* string_concatenate(String*, String*);
 String* string_exponent(String*, double);
@@ -109,8 +182,14 @@ typedef struct Chunk Chunk;
 
 typedef struct {
     size_t arity;
+    size_t registers;
     struct Chunk* chunk;
     Value name;
+    // Calls so far, and native code once the function is hot (see jit.c).
+    size_t calls;
+    void* native;
+    size_t native_size;
+    bool marked;
 } Function;
 
 Function* function_new(void);
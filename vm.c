@@ -2,13 +2,17 @@
 #include <stdio.h>
 #endif
 
+#include <errno.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/mman.h>
 
 #include "compiler.h"
+#include "gc.h"
+#include "jit.h"
 #include "vm.h"
 
 void chunk_init(Chunk* chunk) {
@@ -47,7 +51,76 @@ void chunk_free(Chunk* chunk) {
     chunk_init(chunk);
 }
 
-#ifdef DEBUG
+// Size of an instruction in bytes, including its operands.
+size_t opcode_size(uint8_t opcode) {
+    switch (opcode) {
+        case op_constant:
+        case op_define_global:
+        case op_get_global:
+        case op_set_global:
+        case op_get_local:
+        case op_set_local:
+        case op_set_local_pop:
+        case op_concat:
+        case op_call:
+        case op_tail_call:
+        case op_r_print:
+        case op_r_return:
+            return 2;
+        case op_jump:
+        case op_jump_true:
+        case op_jump_false:
+        case op_get_local_2:
+        case op_get_local_constant:
+        case op_pop_jump:
+        case op_jump_false_pop:
+        case op_lt_jump_false:
+        case op_le_jump_false:
+        case op_gt_jump_false:
+        case op_ge_jump_false:
+        case op_lt_jump_false_nn:
+        case op_le_jump_false_nn:
+        case op_gt_jump_false_nn:
+        case op_ge_jump_false_nn:
+        case op_r_move:
+        case op_r_constant:
+        case op_r_negate:
+        case op_r_not:
+        case op_r_bars:
+        case op_r_quote:
+        case op_r_concat:
+        case op_r_define_global:
+        case op_r_get_global:
+        case op_r_set_global:
+        case op_r_jump:
+        case op_r_call:
+        case op_r_tail_call:
+            return 3;
+        case op_r_add:
+        case op_r_subtract:
+        case op_r_multiply:
+        case op_r_divide:
+        case op_r_exponent:
+        case op_r_eq:
+        case op_r_ne:
+        case op_r_gt:
+        case op_r_ge:
+        case op_r_lt:
+        case op_r_le:
+        case op_r_jump_true:
+        case op_r_jump_false:
+            return 4;
+        case op_r_lt_jump_false:
+        case op_r_le_jump_false:
+        case op_r_gt_jump_false:
+        case op_r_ge_jump_false:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
+#if defined(DEBUG) || defined(PROFILE)
 
 char const*const opcodes[opcode_count] = {
     [op_nil] = "nil",
@@ -73,6 +146,7 @@ char const*const opcodes[opcode_count] = {
     [op_le] = "le",
     [op_bars] = "bars",
     [op_quote] = "quote",
+    [op_concat] = "concat",
     [op_print] = "print",
     [op_pop] = "pop",
     [op_dup] = "dup",
@@ -85,26 +159,165 @@ char const*const opcodes[opcode_count] = {
     [op_jump_true] = "jump/true",
     [op_jump_false] = "jump/false",
     [op_call] = "call",
+    [op_tail_call] = "tail/call",
     [op_return] = "return",
     [op_nop] = "nop",
+    [op_get_local_2] = "get/local/2",
+    [op_get_local_constant] = "get/local/constant",
+    [op_set_local_pop] = "set/local/pop",
+    [op_pop_2] = "pop/2",
+    [op_pop_jump] = "pop/jump",
+    [op_jump_false_pop] = "jump/false/pop",
+    [op_lt_jump_false] = "lt/jump/false",
+    [op_le_jump_false] = "le/jump/false",
+    [op_gt_jump_false] = "gt/jump/false",
+    [op_ge_jump_false] = "ge/jump/false",
+    [op_add_nn] = "add/nn",
+    [op_subtract_nn] = "subtract/nn",
+    [op_multiply_nn] = "multiply/nn",
+    [op_multiply_ss] = "multiply/ss",
+    [op_divide_nn] = "divide/nn",
+    [op_gt_nn] = "gt/nn",
+    [op_ge_nn] = "ge/nn",
+    [op_lt_nn] = "lt/nn",
+    [op_le_nn] = "le/nn",
+    [op_lt_jump_false_nn] = "lt/jump/false/nn",
+    [op_le_jump_false_nn] = "le/jump/false/nn",
+    [op_gt_jump_false_nn] = "gt/jump/false/nn",
+    [op_ge_jump_false_nn] = "ge/jump/false/nn",
+    [op_r_move] = "r/move",
+    [op_r_constant] = "r/constant",
+    [op_r_negate] = "r/negate",
+    [op_r_add] = "r/add",
+    [op_r_subtract] = "r/subtract",
+    [op_r_multiply] = "r/multiply",
+    [op_r_divide] = "r/divide",
+    [op_r_exponent] = "r/exponent",
+    [op_r_not] = "r/not",
+    [op_r_eq] = "r/eq",
+    [op_r_ne] = "r/ne",
+    [op_r_gt] = "r/gt",
+    [op_r_ge] = "r/ge",
+    [op_r_lt] = "r/lt",
+    [op_r_le] = "r/le",
+    [op_r_bars] = "r/bars",
+    [op_r_quote] = "r/quote",
+    [op_r_concat] = "r/concat",
+    [op_r_print] = "r/print",
+    [op_r_define_global] = "r/define/global",
+    [op_r_get_global] = "r/get/global",
+    [op_r_set_global] = "r/set/global",
+    [op_r_jump] = "r/jump",
+    [op_r_jump_true] = "r/jump/true",
+    [op_r_jump_false] = "r/jump/false",
+    [op_r_lt_jump_false] = "r/lt/jump/false",
+    [op_r_le_jump_false] = "r/le/jump/false",
+    [op_r_gt_jump_false] = "r/gt/jump/false",
+    [op_r_ge_jump_false] = "r/ge/jump/false",
+    [op_r_call] = "r/call",
+    [op_r_tail_call] = "r/tail/call",
+    [op_r_return] = "r/return",
 };
 
+#endif
+
+#ifdef DEBUG
+
+// Operand of a register instruction: a register or a constant.
+static void chunk_debug_operand(Chunk* chunk, uint8_t x) {
+    if (x < REGISTERS_MAX) {
+        fprintf(stderr, " r%d", x);
+    } else {
+        fputc(' ', stderr);
+        value_print_debug(stderr, chunk->values.items[x - REGISTERS_MAX], true);
+    }
+}
+
+// Register instructions have up to four bytes of operands, printed before
+// the decoded instruction (register operands are rN).
+static void chunk_debug_registers(Chunk* chunk, size_t i) {
+    uint8_t opcode = chunk->bytes.items[i];
+    uint8_t* operands = &chunk->bytes.items[i + 1];
+    size_t size = opcode_size(opcode);
+    for (size_t k = 1; k < 5; ++k) {
+        if (k < size) {
+            fprintf(stderr, "%02x ", operands[k - 1]);
+        } else {
+            fputs("   ", stderr);
+        }
+    }
+    fprintf(stderr, " %s", opcodes[opcode]);
+    switch (opcode) {
+        case op_r_move:
+            fprintf(stderr, " r%d r%d", operands[0], operands[1]);
+            break;
+        case op_r_constant:
+            fprintf(stderr, " r%d ", operands[0]);
+            value_print_debug(stderr, chunk->values.items[operands[1]], true);
+            break;
+        case op_r_define_global:
+        case op_r_set_global:
+        case op_r_get_global: {
+            bool get = opcode == op_r_get_global;
+            if (get) {
+                fprintf(stderr, " r%d", operands[0]);
+            }
+            fputc(' ', stderr);
+            value_print_debug(stderr, chunk->vm->global_names.items[operands[get ? 1 : 0]], true);
+            if (!get) {
+                chunk_debug_operand(chunk, operands[1]);
+            }
+            break;
+        }
+        case op_r_print:
+        case op_r_return:
+            chunk_debug_operand(chunk, operands[0]);
+            break;
+        case op_r_concat:
+        case op_r_call:
+        case op_r_tail_call:
+            fprintf(stderr, " r%d %d", operands[0], operands[1]);
+            break;
+        case op_r_jump:
+        case op_r_jump_true:
+        case op_r_jump_false:
+        case op_r_lt_jump_false:
+        case op_r_le_jump_false:
+        case op_r_gt_jump_false:
+        case op_r_ge_jump_false: {
+            for (size_t k = 0; k + 3 < size; ++k) {
+                chunk_debug_operand(chunk, operands[k]);
+            }
+            ptrdiff_t offset = (int16_t)((operands[size - 3] << 8) | operands[size - 2]);
+            fprintf(stderr, " -> %zu", i + size + offset);
+            break;
+        }
+        default:
+            fprintf(stderr, " r%d", operands[0]);
+            for (size_t k = 1; k + 1 < size; ++k) {
+                chunk_debug_operand(chunk, operands[k]);
+            }
+            break;
+    }
+    fputc('\n', stderr);
+}
+
 void chunk_debug(Chunk* chunk, const char* name) {
     fprintf(stderr, "*** ----8<---- %s ----8<----\n", name);
+    // j is the index of the current line in the line numbers, and k counts
+    // the bytes seen so far for that line.
     for (size_t i = 0, j = 0, k = 0; i < chunk->bytes.count;) {
         uint8_t opcode = chunk->bytes.items[i];
         size_t line = chunk->line_numbers.items[j];
+        size_t size = opcode_size(opcode);
         fprintf(stderr, "*** %4zu %4zu  %02x ", i, line, opcode);
         i += 1;
-        k += 1;
         switch (opcode) {
             case op_constant: {
                 uint8_t arg = chunk->bytes.items[i];
                 fprintf(stderr, "%02x     %s ", arg, opcodes[opcode]);
                 value_print_debug(stderr, chunk->values.items[arg], true);
                 fputc('\n', stderr);
-                i += 1;
-                k += 1;
                 break;
             }
             case op_define_global:
@@ -112,39 +325,66 @@ void chunk_debug(Chunk* chunk, const char* name) {
             case op_set_global: {
                 uint8_t arg = chunk->bytes.items[i];
                 fprintf(stderr, "%02x     %s ", arg, opcodes[opcode]);
-                value_print_debug(stderr, hamt_get(&chunk->vm->global_scope, VALUE_FROM_INT(arg)), true);
+                value_print_debug(stderr, chunk->vm->global_names.items[arg], true);
                 fputc('\n', stderr);
-                i += 1;
-                k += 1;
                 break;
             }
             case op_get_local:
             case op_set_local:
-            case op_call: {
+            case op_set_local_pop:
+            case op_concat:
+            case op_call:
+            case op_tail_call: {
                 uint8_t arg = chunk->bytes.items[i];
                 fprintf(stderr, "%02x     %s %d\n", arg, opcodes[opcode], arg);
-                i += 1;
-                k += 1;
+                break;
+            }
+            case op_get_local_2: {
+                uint8_t x = chunk->bytes.items[i];
+                uint8_t y = chunk->bytes.items[i + 1];
+                fprintf(stderr, "%02x %02x  %s %d %d\n", x, y, opcodes[opcode], x, y);
+                break;
+            }
+            case op_get_local_constant: {
+                uint8_t x = chunk->bytes.items[i];
+                uint8_t y = chunk->bytes.items[i + 1];
+                fprintf(stderr, "%02x %02x  %s %d ", x, y, opcodes[opcode], x);
+                value_print_debug(stderr, chunk->values.items[y], true);
+                fputc('\n', stderr);
                 break;
             }
             case op_jump:
             case op_jump_true:
-            case op_jump_false: {
+            case op_jump_false:
+            case op_pop_jump:
+            case op_jump_false_pop:
+            case op_lt_jump_false:
+            case op_le_jump_false:
+            case op_gt_jump_false:
+            case op_ge_jump_false:
+            case op_lt_jump_false_nn:
+            case op_le_jump_false_nn:
+            case op_gt_jump_false_nn:
+            case op_ge_jump_false_nn: {
                 uint8_t hi = chunk->bytes.items[i];
                 uint8_t lo = chunk->bytes.items[i + 1];
                 ptrdiff_t offset = (int16_t)((hi << 8) | lo);
-                i += 2;
-                fprintf(stderr, "%02x %02x  %s -> %zu\n", hi, lo, opcodes[opcode], i + offset);
-                k += 1;
+                fprintf(stderr, "%02x %02x  %s -> %zu\n", hi, lo, opcodes[opcode], i + 2 + offset);
                 break;
             }
             default:
-                fprintf(stderr, "       %s\n", opcodes[opcode]);
+                if (opcode >= op_r_move) {
+                    chunk_debug_registers(chunk, i - 1);
+                } else {
+                    fprintf(stderr, "       %s\n", opcodes[opcode]);
+                }
                 break;
         }
-        if (k == chunk->line_numbers.items[j + 1]) {
+        i += size - 1;
+        k += size;
+        while (j + 1 < chunk->line_numbers.count && k >= chunk->line_numbers.items[j + 1]) {
+            k -= chunk->line_numbers.items[j + 1];
             j += 2;
-            k = 0;
         }
     }
     fprintf(stderr, "*** ----8<---- %s ----8<----\n", name);
@@ -152,7 +392,7 @@ void chunk_debug(Chunk* chunk, const char* name) {
 
 #endif
 
-static Result vm_runtime_error(VM* vm, const char* format, ...) {
+Result vm_runtime_error(VM* vm, const char* format, ...) {
     fputs("\n", stderr);
     va_list args;
     va_start(args, format);
@@ -165,35 +405,58 @@ static Result vm_runtime_error(VM* vm, const char* format, ...) {
     return result_runtime_error;
 }
 
+// Add an object to the VM; this may trigger a garbage collection when running.
+// Strings are interned when they are added by the compiler, since equal names
+// must be the same value. Strings made while running are not (they are hashed
+// and interned only if they get promoted from the nursery, see gc_promote).
 Value vm_add_object(VM* vm, Value v) {
+    if (VALUE_IS_STRING(v) && !VALUE_IS_EPSILON(v) && !VALUE_IS_SHORT_STRING(v) &&
+        (VALUE_TO_STRING(v)->rope || VALUE_TO_STRING(v)->slice)) {
+        value_array_push(&vm->remembered, v);
+    }
+    if (vm->nursery.full) {
+        v = gc_collect_nursery(vm, v);
+    }
+    if (vm->frame_count > 0 && vm->gc.heap_size >= vm->gc.heap_next) {
+        gc_collect(vm, v);
+    }
     if (VALUE_IS_STRING(v)) {
-        if (VALUE_IS_EPSILON(v) || VALUE_IS_SHORT_STRING(v)) {
+        if (VALUE_IS_EPSILON(v) || VALUE_IS_SHORT_STRING(v) || NURSERY_CONTAINS(&vm->nursery, VALUE_TO_STRING(v))) {
             return v;
         }
-        String* string = VALUE_TO_STRING(v);
-        Value interned = hamt_get_string(&vm->strings, string);
-        if (VALUE_IS_STRING(interned)) {
-            if (!VALUE_EQUAL(v, interned)) {
-                free(string);
+        if (vm->frame_count == 0) {
+            String* string = VALUE_TO_STRING(v);
+            Value interned = intern_get(&vm->strings, string);
+            if (VALUE_IS_STRING(interned)) {
+                if (!VALUE_EQUAL(v, interned)) {
+                    free(string);
+                }
+                return interned;
             }
-            return interned;
+            intern_add(&vm->strings, v);
         }
-        hamt_set(&vm->strings, v, v);
     }
-    value_array_push(&vm->objects, v);
+    gc_track(vm, v);
     return v;
 }
 
+// Add a string made from x and y while running, unless it is one of them (as
+// in ε * y = y), which the VM already has.
+Value vm_add_string(VM* vm, Value v, Value x, Value y) {
+    return VALUE_EQUAL(v, x) || VALUE_EQUAL(v, y) ? v : vm_add_object(vm, v);
+}
+
 Var* vm_var_new(VM* vm, size_t index, bool mutable, bool global) {
     Var* var = malloc(sizeof(Var));
     var->index = (uint8_t)index;
     var->initialized = false;
     var->mutable = mutable;
     var->global = global;
+    var->marked = false;
 #ifdef DEBUG
     fprintf(stderr, "+++ vm_var_new(): new var %p\n", (void*)var);
 #endif
-    value_array_push(&vm->objects, VALUE_FROM_POINTER(var));
+    gc_track(vm, VALUE_FROM_POINTER(var));
     return var;
 }
 
@@ -205,14 +468,24 @@ Var* vm_add_global(VM* vm, Value v, bool mutable) {
 
     Var* var = vm_var_new(vm, vm->globals.count, mutable, true);
     hamt_set(&vm->global_scope, v, VALUE_FROM_POINTER(var));
-    hamt_set(&vm->global_scope, VALUE_FROM_NUMBER(var->index), v);
+    value_array_push(&vm->global_names, v);
     value_array_push(&vm->globals, VALUE_NONE);
     return var;
 }
 
-static inline int16_t frame_word(Frame* frame) {
-    frame->ip += 2;
-    return (int16_t)(*(frame->ip - 2) << 8) | *(frame->ip - 1);
+// Replace the two strings at the top of the stack with their concatenation.
+static inline void vm_multiply_strings(VM* vm) {
+    Value y = *(--vm->sp);
+    Value x = *(vm->sp - 1);
+    Value string = vm_add_string(vm, value_concatenate_strings(x, y), x, y);
+    *(vm->sp - 1) = string;
+}
+
+// Count a call to a function, which is compiled to native code once it is hot.
+static inline void vm_count_call(VM* vm, Function* function) {
+    if (vm->jit && vm->backend == backend_stack && function->calls++ == JIT_THRESHOLD) {
+        jit_compile(vm, function);
+    }
 }
 
 static Frame* vm_call(VM* vm, Value v, uint8_t args_count) {
@@ -223,7 +496,7 @@ static Frame* vm_call(VM* vm, Value v, uint8_t args_count) {
 
     if (VALUE_IS_FOREIGN_FUNCTION(v)) {
         Value result = (*VALUE_TO_FOREIGN_FUNCTION(v))(args_count, vm->sp - args_count);
-        vm->sp += args_count;
+        vm->sp -= args_count + 1;
         *vm->sp++ = result;
         return &vm->frames[vm->frame_count - 1];
 
@@ -235,7 +508,7 @@ static Frame* vm_call(VM* vm, Value v, uint8_t args_count) {
             return 0;
         }
 
-        if (vm->frame_count == FRAMES_MAX) {
+        if (vm->frame_count == vm->frames_max) {
             vm_runtime_error(vm, "Stack overflow");
             return 0;
         }
@@ -248,16 +521,87 @@ static Frame* vm_call(VM* vm, Value v, uint8_t args_count) {
         frame->function = function;
         frame->ip = function->chunk->bytes.items;
         frame->slots = vm->sp - args_count - 1;
+
+        // Hot functions are compiled to native code, which runs to completion
+        // right away; the caller then simply carries on.
+        vm_count_call(vm, function);
+        if (function->native) {
+            return jit_run(vm, frame) == result_ok ? &vm->frames[vm->frame_count - 1] : 0;
+        }
         return frame;
     }
 }
 
+#ifdef DEBUG
+static void vm_trace_stack(VM* vm, uint8_t opcode) {
+    fprintf(stderr, "%s {", opcodes[opcode]);
+    for (Value* sp = vm->stack; sp != vm->sp; ++sp) {
+        fputc(' ', stderr);
+        value_print_debug(stderr, *sp, true);
+    }
+    fprintf(stderr, " }\n");
+}
+#endif
+
+#ifdef PROFILE
+// Count how many times every opcode is followed by every other opcode at run
+// time; these counts are used to pick the superinstructions.
+static size_t opcode_pairs[opcode_count][opcode_count];
+
+static int vm_compare_pairs(const void* p, const void* q) {
+    size_t m = ((size_t*)opcode_pairs)[*(size_t*)p];
+    size_t n = ((size_t*)opcode_pairs)[*(size_t*)q];
+    return m < n ? 1 : m > n ? -1 : 0;
+}
+
+// Report the most frequent pairs.
+static void vm_profile_report(void) {
+    size_t* counts = (size_t*)opcode_pairs;
+    size_t n = opcode_count * opcode_count;
+    size_t* pairs = malloc(n * sizeof(size_t));
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        pairs[i] = i;
+        total += counts[i];
+    }
+    qsort(pairs, n, sizeof(size_t), vm_compare_pairs);
+    fprintf(stderr, "### %zu instructions\n", total);
+    for (size_t i = 0; i < 24 && counts[pairs[i]] > 0; ++i) {
+        size_t count = counts[pairs[i]];
+        fprintf(stderr, "### %12zu %5.2f%% %s %s\n", count, 100.0 * count / total,
+            opcodes[pairs[i] / opcode_count], opcodes[pairs[i] % opcode_count]);
+    }
+    free(pairs);
+}
+#endif
+
+// Labels as values are a GNU extension, so fall back to a portable switch
+// when they are not available or when NO_COMPUTED_GOTO is defined.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// GCC merges the identical indirect jumps at the end of every handler back
+// into a single one (crossjumping), which defeats the purpose of threading.
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-crossjumping")))
+#endif
 Result vm_run(VM* vm) {
     Frame* frame = &vm->frames[vm->frame_count - 1];
     frame->ip = frame->function->chunk->bytes.items;
 
-#define BYTE() *frame->ip++
-#define WORD() frame_word(frame)
+    // Frame count to return at, when running a call from native code.
+    size_t base = vm->frame_count - 1;
+
+    // Keep the instruction pointer in a local so that it can stay in a
+    // register; it is saved to the frame before calls and reloaded after
+    // calls and returns.
+    uint8_t* ip = frame->ip;
+
+#define BYTE() *ip++
+#define WORD() (ip += 2, (int16_t)((ip[-2] << 8) | ip[-1]))
 #define CONSTANT() frame->function->chunk->values.items[BYTE()]
 
 #define PUSH(x) *vm->sp++ = (x)
@@ -265,60 +609,217 @@ Result vm_run(VM* vm) {
 #define PEEK(i) (*(vm->sp - 1 - (i)))
 #define POKE(i, x) *(vm->sp - 1 - (i)) = (x)
 
-#define BINARY_OP_NUMBER(op) do { \
+// Self-specializing instructions: after the generic instruction has been
+// executed with numbers (or strings), it rewrites itself to a quickened
+// variant that only checks its operands with a cheap guard. When the guard
+// fails, the quickened instruction rewrites itself back to the generic one,
+// which is executed again. QUICKEN() and DEQUICKEN() must be used before
+// reading any operand, when ip - 1 still points to the opcode.
+#ifdef NO_QUICKENING
+#define QUICKEN(op)
+#else
+#define QUICKEN(op) ip[-1] = (op)
+#endif
+#define DEQUICKEN(op) do { \
+    ip[-1] = (op); \
+    ip -= 1; \
+} while (0)
+#define NUMBERS(x, y) \
+    ((((x).as_int & VALUE_QNAN_MASK) != VALUE_QNAN_MASK) & (((y).as_int & VALUE_QNAN_MASK) != VALUE_QNAN_MASK))
+
+#define CHECK_NUMBERS(kind) do { \
     if (!VALUE_IS_NUMBER(PEEK(1))) { \
-        return vm_runtime_error(vm, "First operand of arithmetic operation is not a number."); \
+        return vm_runtime_error(vm, "First operand of " kind " operation is not a number."); \
     } \
     if (!VALUE_IS_NUMBER(PEEK(0))) { \
-        return vm_runtime_error(vm, "Second operand of arithmetic operation is not a number."); \
+        return vm_runtime_error(vm, "Second operand of " kind " operation is not a number."); \
     } \
+} while (0)
+#define BINARY_OP_NUMBER(op, quickened) do { \
+    CHECK_NUMBERS("arithmetic"); \
+    QUICKEN(quickened); \
     double v = POP().as_double; \
     POKE(0, VALUE_FROM_NUMBER(PEEK(0).as_double op v)); \
 } while (0)
-#define BINARY_OP_BOOLEAN(op) do { \
-    if (!VALUE_IS_NUMBER(PEEK(1))) { \
-        return vm_runtime_error(vm, "First operand of comparison operation is not a number."); \
-    } \
-    if (!VALUE_IS_NUMBER(PEEK(0))) { \
-        return vm_runtime_error(vm, "Second operand of comparison operation is not a number."); \
-    } \
+#define BINARY_OP_BOOLEAN(op, quickened) do { \
+    CHECK_NUMBERS("comparison"); \
+    QUICKEN(quickened); \
     double v = POP().as_double; \
     POKE(0, (PEEK(0).as_double op v) ? VALUE_TRUE : VALUE_FALSE); \
 } while (0)
+// Fused comparison, jump if false, and pop: the result is only pushed when
+// jumping, since it is popped right away otherwise.
+#define JUMP_FALSE(op) do { \
+    ptrdiff_t offset = WORD(); \
+    double v = POP().as_double; \
+    if (PEEK(0).as_double op v) { \
+        (void)POP(); \
+    } else { \
+        POKE(0, VALUE_FALSE); \
+        ip += offset; \
+    } \
+} while (0)
+#define BINARY_OP_JUMP_FALSE(op, quickened) do { \
+    CHECK_NUMBERS("comparison"); \
+    QUICKEN(quickened); \
+    JUMP_FALSE(op); \
+} while (0)
+
+#define BINARY_OP_NUMBER_NN(op, generic) do { \
+    if (NUMBERS(PEEK(1), PEEK(0))) { \
+        double v = POP().as_double; \
+        POKE(0, VALUE_FROM_NUMBER(PEEK(0).as_double op v)); \
+    } else { \
+        DEQUICKEN(generic); \
+    } \
+} while (0)
+#define BINARY_OP_BOOLEAN_NN(op, generic) do { \
+    if (NUMBERS(PEEK(1), PEEK(0))) { \
+        double v = POP().as_double; \
+        POKE(0, (PEEK(0).as_double op v) ? VALUE_TRUE : VALUE_FALSE); \
+    } else { \
+        DEQUICKEN(generic); \
+    } \
+} while (0)
+#define BINARY_OP_JUMP_FALSE_NN(op, generic) do { \
+    if (NUMBERS(PEEK(1), PEEK(0))) { \
+        JUMP_FALSE(op); \
+    } else { \
+        DEQUICKEN(generic); \
+    } \
+} while (0)
+
+#define FALSY(p) (VALUE_IS_FALSE(p) || VALUE_IS_EPSILON(p) || (p).as_double == 0)
+
+#ifdef PROFILE
+    uint8_t previous = op_nop;
+#define DECODE() do { \
+    opcode = BYTE(); \
+    opcode_pairs[previous][opcode] += 1; \
+    previous = opcode; \
+} while (0)
+#else
+#define DECODE() opcode = BYTE()
+#endif
+
+#ifdef DEBUG
+#define TRACE_IP() fprintf(stderr, "~~~ %4zu %4zu ", vm->frame_count, \
+    ip - frame->function->chunk->bytes.items)
+#define TRACE_STACK() vm_trace_stack(vm, opcode)
+#else
+#define TRACE_IP()
+#define TRACE_STACK()
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Every handler ends with its own indirect jump to the next handler
+    // through this table instead of going back to a single switch.
+    static void* const handlers[opcode_count] = {
+        [op_nil] = &&handler_op_nil,
+        [op_zero] = &&handler_op_zero,
+        [op_one] = &&handler_op_one,
+        [op_infinity] = &&handler_op_infinity,
+        [op_epsilon] = &&handler_op_epsilon,
+        [op_constant] = &&handler_op_constant,
+        [op_negate] = &&handler_op_negate,
+        [op_add] = &&handler_op_add,
+        [op_subtract] = &&handler_op_subtract,
+        [op_multiply] = &&handler_op_multiply,
+        [op_divide] = &&handler_op_divide,
+        [op_exponent] = &&handler_op_exponent,
+        [op_false] = &&handler_op_false,
+        [op_true] = &&handler_op_true,
+        [op_not] = &&handler_op_not,
+        [op_eq] = &&handler_op_eq,
+        [op_ne] = &&handler_op_ne,
+        [op_gt] = &&handler_op_gt,
+        [op_ge] = &&handler_op_ge,
+        [op_lt] = &&handler_op_lt,
+        [op_le] = &&handler_op_le,
+        [op_bars] = &&handler_op_bars,
+        [op_quote] = &&handler_op_quote,
+        [op_concat] = &&handler_op_concat,
+        [op_print] = &&handler_op_print,
+        [op_pop] = &&handler_op_pop,
+        [op_dup] = &&handler_op_dup,
+        [op_define_global] = &&handler_op_define_global,
+        [op_get_global] = &&handler_op_get_global,
+        [op_set_global] = &&handler_op_set_global,
+        [op_get_local] = &&handler_op_get_local,
+        [op_set_local] = &&handler_op_set_local,
+        [op_jump] = &&handler_op_jump,
+        [op_jump_true] = &&handler_op_jump_true,
+        [op_jump_false] = &&handler_op_jump_false,
+        [op_call] = &&handler_op_call,
+        [op_tail_call] = &&handler_op_tail_call,
+        [op_nop] = &&handler_op_nop,
+        [op_return] = &&handler_op_return,
+        [op_get_local_2] = &&handler_op_get_local_2,
+        [op_get_local_constant] = &&handler_op_get_local_constant,
+        [op_set_local_pop] = &&handler_op_set_local_pop,
+        [op_pop_2] = &&handler_op_pop_2,
+        [op_pop_jump] = &&handler_op_pop_jump,
+        [op_jump_false_pop] = &&handler_op_jump_false_pop,
+        [op_lt_jump_false] = &&handler_op_lt_jump_false,
+        [op_le_jump_false] = &&handler_op_le_jump_false,
+        [op_gt_jump_false] = &&handler_op_gt_jump_false,
+        [op_ge_jump_false] = &&handler_op_ge_jump_false,
+        [op_add_nn] = &&handler_op_add_nn,
+        [op_subtract_nn] = &&handler_op_subtract_nn,
+        [op_multiply_nn] = &&handler_op_multiply_nn,
+        [op_multiply_ss] = &&handler_op_multiply_ss,
+        [op_divide_nn] = &&handler_op_divide_nn,
+        [op_gt_nn] = &&handler_op_gt_nn,
+        [op_ge_nn] = &&handler_op_ge_nn,
+        [op_lt_nn] = &&handler_op_lt_nn,
+        [op_le_nn] = &&handler_op_le_nn,
+        [op_lt_jump_false_nn] = &&handler_op_lt_jump_false_nn,
+        [op_le_jump_false_nn] = &&handler_op_le_jump_false_nn,
+        [op_gt_jump_false_nn] = &&handler_op_gt_jump_false_nn,
+        [op_ge_jump_false_nn] = &&handler_op_ge_jump_false_nn,
+    };
+#define OPCODE(op) handler_##op
+#define DISPATCH() do { TRACE_IP(); DECODE(); goto *handlers[opcode]; } while (0)
+#define NEXT() do { TRACE_STACK(); DISPATCH(); } while (0)
+#else
+#define OPCODE(op) case op
+#define NEXT() break
+#endif
 
     uint8_t opcode;
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+#else
     while (true) {
-#ifdef DEBUG
-        fprintf(stderr, "~~~ %4zu %4zu ", vm->frame_count, frame->ip - frame->function->chunk->bytes.items);
+        TRACE_IP();
+        DECODE();
+        switch (opcode) {
 #endif
-        switch (opcode = BYTE()) {
-            case op_nil: PUSH(VALUE_NIL); break;
-            case op_zero: PUSH(VALUE_FROM_NUMBER(0)); break;
-            case op_one: PUSH(VALUE_FROM_NUMBER(1)); break;
-            case op_infinity: PUSH(VALUE_FROM_NUMBER(INFINITY)); break;
-            case op_epsilon: PUSH(VALUE_EPSILON); break;
-            case op_constant: PUSH(CONSTANT()); break;
-            case op_negate:
+            OPCODE(op_nil): PUSH(VALUE_NIL); NEXT();
+            OPCODE(op_zero): PUSH(VALUE_FROM_NUMBER(0)); NEXT();
+            OPCODE(op_one): PUSH(VALUE_FROM_NUMBER(1)); NEXT();
+            OPCODE(op_infinity): PUSH(VALUE_FROM_NUMBER(INFINITY)); NEXT();
+            OPCODE(op_epsilon): PUSH(VALUE_EPSILON); NEXT();
+            OPCODE(op_constant): PUSH(CONSTANT()); NEXT();
+            OPCODE(op_negate):
                 if (!VALUE_IS_NUMBER(PEEK(0))) {
                     return vm_runtime_error(vm, "Operand for negate is not a number.");
                 }
                 POKE(0, VALUE_FROM_NUMBER(-PEEK(0).as_double));
-                break;
-            case op_add: BINARY_OP_NUMBER(+); break;
-            case op_subtract: BINARY_OP_NUMBER(-); break;
-            case op_multiply: {
+                NEXT();
+            OPCODE(op_add): BINARY_OP_NUMBER(+, op_add_nn); NEXT();
+            OPCODE(op_subtract): BINARY_OP_NUMBER(-, op_subtract_nn); NEXT();
+            OPCODE(op_multiply): {
                 if (VALUE_IS_STRING(PEEK(0)) && VALUE_IS_STRING(PEEK(1))) {
-                    Value v = POP();
-                    Value string = value_concatenate_strings(PEEK(0), v);
-                    vm_add_object(vm, string);
-                    POKE(0, string);
+                    QUICKEN(op_multiply_ss);
+                    vm_multiply_strings(vm);
                 } else {
-                    BINARY_OP_NUMBER(*);
+                    BINARY_OP_NUMBER(*, op_multiply_nn);
                 }
-                break;
+                NEXT();
             }
-            case op_divide: BINARY_OP_NUMBER(/); break;
-            case op_exponent: {
+            OPCODE(op_divide): BINARY_OP_NUMBER(/, op_divide_nn); NEXT();
+            OPCODE(op_exponent): {
                 if (!VALUE_IS_NUMBER(PEEK(0))) {
                     return vm_runtime_error(vm, "Exponent is not a number.");
                 }
@@ -327,32 +828,32 @@ Result vm_run(VM* vm) {
                 if (VALUE_IS_NUMBER(base)) {
                     POKE(0, VALUE_FROM_NUMBER(pow(base.as_double, exponent)));
                 } else if (VALUE_IS_STRING(base)) {
-                    POKE(0, value_string_exponent(base, exponent));
+                    POKE(0, vm_add_string(vm, value_string_exponent(base, exponent), base, base));
                 } else {
                     return vm_runtime_error(vm, "Base of exponent is not a number or a string.");
                 }
-                break;
+                NEXT();
             }
-            case op_false: PUSH(VALUE_FALSE); break;
-            case op_true: PUSH(VALUE_TRUE); break;
-            case op_not:
+            OPCODE(op_false): PUSH(VALUE_FALSE); NEXT();
+            OPCODE(op_true): PUSH(VALUE_TRUE); NEXT();
+            OPCODE(op_not):
                 POKE(0, (VALUE_IS_FALSE(PEEK(0)) || VALUE_IS_NIL(PEEK(0))) ? VALUE_TRUE : VALUE_FALSE);
-                break;
-            case op_eq: {
+                NEXT();
+            OPCODE(op_eq): {
                 Value v = POP();
-                POKE(0, VALUE_EQUAL(PEEK(0), v) ? VALUE_TRUE : VALUE_FALSE);
-                break;
+                POKE(0, value_equal(PEEK(0), v) ? VALUE_TRUE : VALUE_FALSE);
+                NEXT();
             }
-            case op_ne: {
+            OPCODE(op_ne): {
                 Value v = POP();
-                POKE(0, VALUE_EQUAL(PEEK(0), v) ? VALUE_FALSE : VALUE_TRUE);
-                break;
+                POKE(0, value_equal(PEEK(0), v) ? VALUE_FALSE : VALUE_TRUE);
+                NEXT();
             }
-            case op_gt: BINARY_OP_BOOLEAN(>); break;
-            case op_ge: BINARY_OP_BOOLEAN(>=); break;
-            case op_lt: BINARY_OP_BOOLEAN(<); break;
-            case op_le: BINARY_OP_BOOLEAN(<=); break;
-            case op_bars: {
+            OPCODE(op_gt): BINARY_OP_BOOLEAN(>, op_gt_nn); NEXT();
+            OPCODE(op_ge): BINARY_OP_BOOLEAN(>=, op_ge_nn); NEXT();
+            OPCODE(op_lt): BINARY_OP_BOOLEAN(<, op_lt_nn); NEXT();
+            OPCODE(op_le): BINARY_OP_BOOLEAN(<=, op_le_nn); NEXT();
+            OPCODE(op_bars): {
                 Value v = PEEK(0);
                 if (VALUE_IS_STRING(v)) {
                     // FIXME 2L0N || should handle unicode strings (?)
@@ -365,95 +866,201 @@ Result vm_run(VM* vm) {
                 } else {
                     return vm_runtime_error(vm, "Bars apply to number or string.");
                 }
-                break;
+                NEXT();
+            }
+            OPCODE(op_quote): POKE(0, vm_add_string(vm, value_stringify(PEEK(0)), PEEK(0), PEEK(0))); NEXT();
+            OPCODE(op_concat): {
+                uint8_t n = BYTE();
+                Value v = vm_add_string(vm, value_interpolate(n, vm->sp - n), PEEK(n - 1), PEEK(n - 1));
+                vm->sp -= n - 1;
+                POKE(0, v);
+                NEXT();
             }
-            case op_quote: POKE(0, value_stringify(PEEK(0))); break;
-            case op_print:
+            OPCODE(op_print):
                 value_print(POP());
                 puts("");
-                break;
+                NEXT();
 
-            case op_pop: (void)POP(); break;
-            case op_dup: {
+            OPCODE(op_pop): (void)POP(); NEXT();
+            OPCODE(op_dup): {
                 Value top = PEEK(0);
                 PUSH(top);
-                break;
+                NEXT();
             }
 
-            case op_define_global: vm->globals.items[BYTE()] = POP(); break;
-            case op_get_global: {
+            OPCODE(op_define_global): vm->globals.items[BYTE()] = POP(); NEXT();
+            OPCODE(op_get_global): {
                 uint8_t n = BYTE();
                 Value value = vm->globals.items[n];
                 if (VALUE_IS_NONE(value)) {
                     return vm_runtime_error(vm, "undefined var \"%s\"",
-                        value_to_cstring(hamt_get(&vm->global_scope, VALUE_FROM_INT(n))));
+                        value_to_cstring(vm->global_names.items[n]));
                 }
                 PUSH(value);
-                break;
+                NEXT();
             }
-            case op_set_global: {
+            OPCODE(op_set_global): {
                 uint8_t n = BYTE();
                 if (VALUE_IS_NONE(vm->globals.items[n])) {
                     return vm_runtime_error(vm, "undefined var \"%s\"",
-                        value_to_cstring(hamt_get(&vm->global_scope, VALUE_FROM_INT(n))));
+                        value_to_cstring(vm->global_names.items[n]));
                 }
                 vm->globals.items[n] = PEEK(0);
-                break;
+                NEXT();
             }
-            case op_get_local: PUSH(frame->slots[BYTE()]); break;
-            case op_set_local: frame->slots[BYTE()] = PEEK(0); break;
+            OPCODE(op_get_local): PUSH(frame->slots[BYTE()]); NEXT();
+            OPCODE(op_set_local): frame->slots[BYTE()] = PEEK(0); NEXT();
 
-            case op_jump: frame->ip += WORD(); break;
-            case op_jump_true: {
+            OPCODE(op_jump): {
+                ptrdiff_t offset = WORD();
+                ip += offset;
+                NEXT();
+            }
+            OPCODE(op_jump_true): {
                 ptrdiff_t offset = WORD();
                 Value p = PEEK(0);
-                if (!(VALUE_IS_FALSE(p) || VALUE_IS_EPSILON(p) || p.as_double == 0)) {
-                    frame->ip += offset;
+                if (!FALSY(p)) {
+                    ip += offset;
                 }
-                break;
+                NEXT();
             }
-            case op_jump_false: {
+            OPCODE(op_jump_false): {
                 ptrdiff_t offset = WORD();
                 Value p = PEEK(0);
-                if (VALUE_IS_FALSE(p) || VALUE_IS_EPSILON(p) || p.as_double == 0) {
-                    frame->ip += offset;
+                if (FALSY(p)) {
+                    ip += offset;
                 }
-                break;
+                NEXT();
             }
 
-            case op_call: {
+            OPCODE(op_call): {
                 uint8_t args_count = BYTE();
+                frame->ip = ip;
                 frame = vm_call(vm, PEEK(args_count), args_count);
                 if (!frame) {
                     return result_runtime_error;
                 }
-                break;
+                ip = frame->ip;
+                NEXT();
             }
 
-            case op_nop: break;
+            // Calls in tail position reuse the frame of the caller: the
+            // function and its arguments move down to the slots of the
+            // current frame. Foreign functions, functions with native code
+            // and arity mismatches go through a regular call, and the return
+            // that follows. Reused frames still count as calls, so that
+            // functions that loop by tail calls get compiled when hot (and
+            // their native code then runs through a regular call).
+            OPCODE(op_tail_call): {
+                uint8_t args_count = BYTE();
+                Value callee = PEEK(args_count);
+                if (VALUE_IS_FUNCTION(callee) && !VALUE_IS_FOREIGN_FUNCTION(callee)) {
+                    Function* function = VALUE_TO_FUNCTION(callee);
+                    if (!function->native && function->arity == args_count) {
+                        vm_count_call(vm, function);
+                        if (!function->native) {
+#ifdef DEBUG
+                            fprintf(stderr, "(tail call to %s, reusing frame %zu) ",
+                                value_to_cstring(function->name), vm->frame_count);
+#endif
+                            memmove(frame->slots, vm->sp - args_count - 1, (args_count + 1) * sizeof(Value));
+                            vm->sp = frame->slots + args_count + 1;
+                            frame->function = function;
+                            ip = function->chunk->bytes.items;
+                            NEXT();
+                        }
+                    }
+                }
+                frame->ip = ip;
+                frame = vm_call(vm, callee, args_count);
+                if (!frame) {
+                    return result_runtime_error;
+                }
+                ip = frame->ip;
+                NEXT();
+            }
 
-            case op_return: {
-                Value result = POP();
+            OPCODE(op_nop): NEXT();
+
+            OPCODE(op_get_local_2): {
+                uint8_t x = BYTE();
+                uint8_t y = BYTE();
+                PUSH(frame->slots[x]);
+                PUSH(frame->slots[y]);
+                NEXT();
+            }
+            OPCODE(op_get_local_constant): {
+                uint8_t x = BYTE();
+                PUSH(frame->slots[x]);
+                PUSH(CONSTANT());
+                NEXT();
+            }
+            OPCODE(op_set_local_pop): frame->slots[BYTE()] = POP(); NEXT();
+            OPCODE(op_pop_2): vm->sp -= 2; NEXT();
+            OPCODE(op_pop_jump): {
+                ptrdiff_t offset = WORD();
+                (void)POP();
+                ip += offset;
+                NEXT();
+            }
+            OPCODE(op_jump_false_pop): {
+                ptrdiff_t offset = WORD();
+                Value p = PEEK(0);
+                if (FALSY(p)) {
+                    ip += offset;
+                } else {
+                    (void)POP();
+                }
+                NEXT();
+            }
+            OPCODE(op_lt_jump_false): BINARY_OP_JUMP_FALSE(<, op_lt_jump_false_nn); NEXT();
+            OPCODE(op_le_jump_false): BINARY_OP_JUMP_FALSE(<=, op_le_jump_false_nn); NEXT();
+            OPCODE(op_gt_jump_false): BINARY_OP_JUMP_FALSE(>, op_gt_jump_false_nn); NEXT();
+            OPCODE(op_ge_jump_false): BINARY_OP_JUMP_FALSE(>=, op_ge_jump_false_nn); NEXT();
+
+            OPCODE(op_add_nn): BINARY_OP_NUMBER_NN(+, op_add); NEXT();
+            OPCODE(op_subtract_nn): BINARY_OP_NUMBER_NN(-, op_subtract); NEXT();
+            OPCODE(op_multiply_nn): BINARY_OP_NUMBER_NN(*, op_multiply); NEXT();
+            OPCODE(op_multiply_ss): {
+                if (VALUE_IS_STRING(PEEK(0)) && VALUE_IS_STRING(PEEK(1))) {
+                    vm_multiply_strings(vm);
+                } else {
+                    DEQUICKEN(op_multiply);
+                }
+                NEXT();
+            }
+            OPCODE(op_divide_nn): BINARY_OP_NUMBER_NN(/, op_divide); NEXT();
+            OPCODE(op_gt_nn): BINARY_OP_BOOLEAN_NN(>, op_gt); NEXT();
+            OPCODE(op_ge_nn): BINARY_OP_BOOLEAN_NN(>=, op_ge); NEXT();
+            OPCODE(op_lt_nn): BINARY_OP_BOOLEAN_NN(<, op_lt); NEXT();
+            OPCODE(op_le_nn): BINARY_OP_BOOLEAN_NN(<=, op_le); NEXT();
+            OPCODE(op_lt_jump_false_nn): BINARY_OP_JUMP_FALSE_NN(<, op_lt_jump_false); NEXT();
+            OPCODE(op_le_jump_false_nn): BINARY_OP_JUMP_FALSE_NN(<=, op_le_jump_false); NEXT();
+            OPCODE(op_gt_jump_false_nn): BINARY_OP_JUMP_FALSE_NN(>, op_gt_jump_false); NEXT();
+            OPCODE(op_ge_jump_false_nn): BINARY_OP_JUMP_FALSE_NN(>=, op_ge_jump_false); NEXT();
+
+            OPCODE(op_return): {
                 vm->frame_count -= 1;
                 if (vm->frame_count == 0) {
-                    (void)POP();
+                    // The script returns with an empty stack.
+                    vm->sp = frame->slots;
                     return result_ok;
                 }
+                Value result = POP();
                 vm->sp = frame->slots;
                 PUSH(result);
+                if (vm->frame_count == base) {
+                    return result_ok;
+                }
                 frame = &vm->frames[vm->frame_count - 1];
-                break;
+                ip = frame->ip;
+                NEXT();
             }
+#ifndef COMPUTED_GOTO
         }
-#ifdef DEBUG
-        fprintf(stderr, "%s {", opcodes[opcode]);
-        for (Value* sp = vm->stack; sp != vm->sp; ++sp) {
-            fputc(' ', stderr);
-            value_print_debug(stderr, *sp, true);
-        }
-        fprintf(stderr, " }\n");
-#endif
+        TRACE_STACK();
     }
+#endif
 
     // unreachable
     return result_runtime_error;
@@ -467,13 +1074,446 @@ Result vm_run(VM* vm) {
 #undef POKE
 #undef BINARY_OP_NUMBER
 #undef BINARY_OP_BOOLEAN
+#undef BINARY_OP_JUMP_FALSE
+#undef BINARY_OP_NUMBER_NN
+#undef BINARY_OP_BOOLEAN_NN
+#undef BINARY_OP_JUMP_FALSE_NN
+#undef CHECK_NUMBERS
+#undef JUMP_FALSE
+#undef NUMBERS
+#undef QUICKEN
+#undef DEQUICKEN
+#undef FALSY
+#undef DECODE
+#undef TRACE_IP
+#undef TRACE_STACK
+#undef OPCODE
+#undef DISPATCH
+#undef NEXT
 }
 
+// Call the function below the arguments at the top of the stack and run it
+// to completion, leaving its result on the stack (for native code.)
+Result vm_call_and_run(VM* vm, uint8_t args_count) {
+    size_t frame_count = vm->frame_count;
+    if (!vm_call(vm, *(vm->sp - 1 - args_count), args_count)) {
+        return result_runtime_error;
+    }
+    return vm->frame_count == frame_count ? result_ok : vm_run(vm);
+}
+
+static inline void vm_clear_registers(Value* from, Value* to) {
+    for (Value* r = from; r < to; ++r) {
+        *r = VALUE_NIL;
+    }
+}
+
+static inline Value vm_operand(Value* registers, Value* constants, uint8_t x) {
+    return x < REGISTERS_MAX ? registers[x] : constants[x - REGISTERS_MAX];
+}
+
+// Run register code (see registers.c): the registers of a frame are its
+// slots on the stack, and vm->sp is kept above the registers of the current
+// function so that calls find their arguments at the top of the stack.
+//
+// The garbage collector takes every slot below vm->sp as a root, so all the
+// registers of the current frame must hold valid values, including those that
+// it has not written yet: registers above the last write are nil. They are
+// cleared when a function is entered (above its arguments), and when a call
+// returns (above its result), since the registers of the callee may not have
+// covered those of the caller, whose values may have been freed meanwhile.
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-crossjumping")))
+#endif
+static Result vm_run_registers(VM* vm) {
+    Frame* frame = &vm->frames[vm->frame_count - 1];
+    uint8_t* ip = frame->function->chunk->bytes.items;
+    Value* registers = frame->slots;
+    Value* constants = frame->function->chunk->values.items;
+    vm->sp = registers + frame->function->registers;
+    vm_clear_registers(registers + 1 + frame->function->arity, vm->sp);
+
+#define BYTE() *ip++
+#define WORD() (ip += 2, (int16_t)((ip[-2] << 8) | ip[-1]))
+#define R(i) registers[i]
+// Register or constant operand.
+#define RK() vm_operand(registers, constants, BYTE())
+
+// Restore the registers of the current frame after a call or a return.
+#define ENTER_FRAME() do { \
+    ip = frame->ip; \
+    registers = frame->slots; \
+    constants = frame->function->chunk->values.items; \
+    vm->sp = registers + frame->function->registers; \
+} while (0)
+// After vm_call from the caller frame, which either entered a function with
+// n arguments, or ran a foreign function or native code to completion.
+#define CALL_FRAME(caller, n) do { \
+    bool entered = frame != (caller); \
+    ENTER_FRAME(); \
+    if (entered) { \
+        vm_clear_registers(registers + (n) + 1, vm->sp); \
+    } \
+} while (0)
+
+#define NUMBERS(x, y) \
+    ((((x).as_int & VALUE_QNAN_MASK) != VALUE_QNAN_MASK) & (((y).as_int & VALUE_QNAN_MASK) != VALUE_QNAN_MASK))
+#define CHECK_NUMBERS(x, y, kind) do { \
+    if (!NUMBERS(x, y)) { \
+        if (!VALUE_IS_NUMBER(x)) { \
+            return vm_runtime_error(vm, "First operand of " kind " operation is not a number."); \
+        } \
+        return vm_runtime_error(vm, "Second operand of " kind " operation is not a number."); \
+    } \
+} while (0)
+#define OPERANDS() \
+    uint8_t a = BYTE(); \
+    Value x = RK(); \
+    Value y = RK()
+#define BINARY_OP_NUMBER(op) do { \
+    OPERANDS(); \
+    CHECK_NUMBERS(x, y, "arithmetic"); \
+    R(a) = VALUE_FROM_NUMBER(x.as_double op y.as_double); \
+} while (0)
+#define BINARY_OP_BOOLEAN(op) do { \
+    OPERANDS(); \
+    CHECK_NUMBERS(x, y, "comparison"); \
+    R(a) = (x.as_double op y.as_double) ? VALUE_TRUE : VALUE_FALSE; \
+} while (0)
+#define BINARY_OP_JUMP_FALSE(op) do { \
+    Value x = RK(); \
+    Value y = RK(); \
+    ptrdiff_t offset = WORD(); \
+    CHECK_NUMBERS(x, y, "comparison"); \
+    if (!(x.as_double op y.as_double)) { \
+        ip += offset; \
+    } \
+} while (0)
+
+#define FALSY(p) (VALUE_IS_FALSE(p) || VALUE_IS_EPSILON(p) || (p).as_double == 0)
+
+#ifdef PROFILE
+    uint8_t previous = op_nop;
+#define DECODE() do { \
+    opcode = BYTE(); \
+    opcode_pairs[previous][opcode] += 1; \
+    previous = opcode; \
+} while (0)
+#else
+#define DECODE() opcode = BYTE()
+#endif
+
+#ifdef DEBUG
+#define TRACE_IP() fprintf(stderr, "~~~ %4zu %4zu ", vm->frame_count, \
+    ip - frame->function->chunk->bytes.items)
+#define TRACE_STACK() vm_trace_stack(vm, opcode)
+#else
+#define TRACE_IP()
+#define TRACE_STACK()
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* const handlers[opcode_count] = {
+        [op_r_move] = &&handler_op_r_move,
+        [op_r_constant] = &&handler_op_r_constant,
+        [op_r_negate] = &&handler_op_r_negate,
+        [op_r_add] = &&handler_op_r_add,
+        [op_r_subtract] = &&handler_op_r_subtract,
+        [op_r_multiply] = &&handler_op_r_multiply,
+        [op_r_divide] = &&handler_op_r_divide,
+        [op_r_exponent] = &&handler_op_r_exponent,
+        [op_r_not] = &&handler_op_r_not,
+        [op_r_eq] = &&handler_op_r_eq,
+        [op_r_ne] = &&handler_op_r_ne,
+        [op_r_gt] = &&handler_op_r_gt,
+        [op_r_ge] = &&handler_op_r_ge,
+        [op_r_lt] = &&handler_op_r_lt,
+        [op_r_le] = &&handler_op_r_le,
+        [op_r_bars] = &&handler_op_r_bars,
+        [op_r_quote] = &&handler_op_r_quote,
+        [op_r_concat] = &&handler_op_r_concat,
+        [op_r_print] = &&handler_op_r_print,
+        [op_r_define_global] = &&handler_op_r_define_global,
+        [op_r_get_global] = &&handler_op_r_get_global,
+        [op_r_set_global] = &&handler_op_r_set_global,
+        [op_r_jump] = &&handler_op_r_jump,
+        [op_r_jump_true] = &&handler_op_r_jump_true,
+        [op_r_jump_false] = &&handler_op_r_jump_false,
+        [op_r_lt_jump_false] = &&handler_op_r_lt_jump_false,
+        [op_r_le_jump_false] = &&handler_op_r_le_jump_false,
+        [op_r_gt_jump_false] = &&handler_op_r_gt_jump_false,
+        [op_r_ge_jump_false] = &&handler_op_r_ge_jump_false,
+        [op_r_call] = &&handler_op_r_call,
+        [op_r_tail_call] = &&handler_op_r_tail_call,
+        [op_r_return] = &&handler_op_r_return,
+    };
+#define OPCODE(op) handler_##op
+#define DISPATCH() do { TRACE_IP(); DECODE(); goto *handlers[opcode]; } while (0)
+#define NEXT() do { TRACE_STACK(); DISPATCH(); } while (0)
+#else
+#define OPCODE(op) case op
+#define NEXT() break
+#endif
+
+    uint8_t opcode;
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+#else
+    while (true) {
+        TRACE_IP();
+        DECODE();
+        switch (opcode) {
+#endif
+            OPCODE(op_r_move): {
+                uint8_t a = BYTE();
+                R(a) = R(BYTE());
+                NEXT();
+            }
+            OPCODE(op_r_constant): {
+                uint8_t a = BYTE();
+                R(a) = constants[BYTE()];
+                NEXT();
+            }
+            OPCODE(op_r_negate): {
+                uint8_t a = BYTE();
+                Value x = RK();
+                if (!VALUE_IS_NUMBER(x)) {
+                    return vm_runtime_error(vm, "Operand for negate is not a number.");
+                }
+                R(a) = VALUE_FROM_NUMBER(-x.as_double);
+                NEXT();
+            }
+            OPCODE(op_r_add): BINARY_OP_NUMBER(+); NEXT();
+            OPCODE(op_r_subtract): BINARY_OP_NUMBER(-); NEXT();
+            OPCODE(op_r_multiply): {
+                OPERANDS();
+                if (VALUE_IS_STRING(x) && VALUE_IS_STRING(y)) {
+                    R(a) = vm_add_string(vm, value_concatenate_strings(x, y), x, y);
+                } else {
+                    CHECK_NUMBERS(x, y, "arithmetic");
+                    R(a) = VALUE_FROM_NUMBER(x.as_double * y.as_double);
+                }
+                NEXT();
+            }
+            OPCODE(op_r_divide): BINARY_OP_NUMBER(/); NEXT();
+            OPCODE(op_r_exponent): {
+                OPERANDS();
+                if (!VALUE_IS_NUMBER(y)) {
+                    return vm_runtime_error(vm, "Exponent is not a number.");
+                }
+                if (VALUE_IS_NUMBER(x)) {
+                    R(a) = VALUE_FROM_NUMBER(pow(x.as_double, y.as_double));
+                } else if (VALUE_IS_STRING(x)) {
+                    R(a) = vm_add_string(vm, value_string_exponent(x, y.as_double), x, x);
+                } else {
+                    return vm_runtime_error(vm, "Base of exponent is not a number or a string.");
+                }
+                NEXT();
+            }
+            OPCODE(op_r_not): {
+                uint8_t a = BYTE();
+                Value x = RK();
+                R(a) = (VALUE_IS_FALSE(x) || VALUE_IS_NIL(x)) ? VALUE_TRUE : VALUE_FALSE;
+                NEXT();
+            }
+            OPCODE(op_r_eq): {
+                OPERANDS();
+                R(a) = value_equal(x, y) ? VALUE_TRUE : VALUE_FALSE;
+                NEXT();
+            }
+            OPCODE(op_r_ne): {
+                OPERANDS();
+                R(a) = value_equal(x, y) ? VALUE_FALSE : VALUE_TRUE;
+                NEXT();
+            }
+            OPCODE(op_r_gt): BINARY_OP_BOOLEAN(>); NEXT();
+            OPCODE(op_r_ge): BINARY_OP_BOOLEAN(>=); NEXT();
+            OPCODE(op_r_lt): BINARY_OP_BOOLEAN(<); NEXT();
+            OPCODE(op_r_le): BINARY_OP_BOOLEAN(<=); NEXT();
+            OPCODE(op_r_bars): {
+                uint8_t a = BYTE();
+                Value x = RK();
+                if (VALUE_IS_STRING(x)) {
+                    R(a) = VALUE_FROM_NUMBER(VALUE_IS_EPSILON(x) ? 0 :
+                        VALUE_IS_SHORT_STRING(x) ? VALUE_SHORT_STRING_LENGTH(x) :
+                        (VALUE_TO_STRING(x)->length));
+                } else if (VALUE_IS_NUMBER(x)) {
+                    R(a) = VALUE_FROM_NUMBER(fabs(x.as_double));
+                } else {
+                    return vm_runtime_error(vm, "Bars apply to number or string.");
+                }
+                NEXT();
+            }
+            OPCODE(op_r_quote): {
+                uint8_t a = BYTE();
+                Value v = RK();
+                R(a) = vm_add_string(vm, value_stringify(v), v, v);
+                NEXT();
+            }
+            OPCODE(op_r_concat): {
+                uint8_t a = BYTE();
+                uint8_t n = BYTE();
+                R(a) = vm_add_string(vm, value_interpolate(n, &R(a)), R(a), R(a));
+                NEXT();
+            }
+            OPCODE(op_r_print):
+                value_print(RK());
+                puts("");
+                NEXT();
+
+            OPCODE(op_r_define_global): {
+                uint8_t n = BYTE();
+                vm->globals.items[n] = RK();
+                NEXT();
+            }
+            OPCODE(op_r_get_global): {
+                uint8_t a = BYTE();
+                uint8_t n = BYTE();
+                Value value = vm->globals.items[n];
+                if (VALUE_IS_NONE(value)) {
+                    return vm_runtime_error(vm, "undefined var \"%s\"",
+                        value_to_cstring(vm->global_names.items[n]));
+                }
+                R(a) = value;
+                NEXT();
+            }
+            OPCODE(op_r_set_global): {
+                uint8_t n = BYTE();
+                Value value = RK();
+                if (VALUE_IS_NONE(vm->globals.items[n])) {
+                    return vm_runtime_error(vm, "undefined var \"%s\"",
+                        value_to_cstring(vm->global_names.items[n]));
+                }
+                vm->globals.items[n] = value;
+                NEXT();
+            }
+
+            OPCODE(op_r_jump): {
+                ptrdiff_t offset = WORD();
+                ip += offset;
+                NEXT();
+            }
+            OPCODE(op_r_jump_true): {
+                Value p = RK();
+                ptrdiff_t offset = WORD();
+                if (!FALSY(p)) {
+                    ip += offset;
+                }
+                NEXT();
+            }
+            OPCODE(op_r_jump_false): {
+                Value p = RK();
+                ptrdiff_t offset = WORD();
+                if (FALSY(p)) {
+                    ip += offset;
+                }
+                NEXT();
+            }
+            OPCODE(op_r_lt_jump_false): BINARY_OP_JUMP_FALSE(<); NEXT();
+            OPCODE(op_r_le_jump_false): BINARY_OP_JUMP_FALSE(<=); NEXT();
+            OPCODE(op_r_gt_jump_false): BINARY_OP_JUMP_FALSE(>); NEXT();
+            OPCODE(op_r_ge_jump_false): BINARY_OP_JUMP_FALSE(>=); NEXT();
+
+            OPCODE(op_r_call): {
+                // The function and its arguments are in registers a to a + n,
+                // and the result goes to register a.
+                uint8_t a = BYTE();
+                uint8_t n = BYTE();
+                frame->ip = ip;
+                vm->sp = registers + a + n + 1;
+                Frame* caller = frame;
+                frame = vm_call(vm, R(a), n);
+                if (!frame) {
+                    return result_runtime_error;
+                }
+                CALL_FRAME(caller, n);
+                NEXT();
+            }
+            // As op_tail_call: the function and its arguments move down to
+            // the first registers, which become those of the callee.
+            OPCODE(op_r_tail_call): {
+                uint8_t a = BYTE();
+                uint8_t n = BYTE();
+                Value callee = R(a);
+                if (VALUE_IS_FUNCTION(callee) && !VALUE_IS_FOREIGN_FUNCTION(callee)) {
+                    Function* function = VALUE_TO_FUNCTION(callee);
+                    if (!function->native && function->arity == n) {
+                        vm_count_call(vm, function);
+#ifdef DEBUG
+                        fprintf(stderr, "(tail call to %s, reusing frame %zu) ",
+                            value_to_cstring(function->name), vm->frame_count);
+#endif
+                        memmove(registers, registers + a, (n + 1) * sizeof(Value));
+                        frame->function = function;
+                        frame->ip = function->chunk->bytes.items;
+                        ENTER_FRAME();
+                        vm_clear_registers(registers + n + 1, vm->sp);
+                        NEXT();
+                    }
+                }
+                frame->ip = ip;
+                vm->sp = registers + a + n + 1;
+                Frame* caller = frame;
+                frame = vm_call(vm, callee, n);
+                if (!frame) {
+                    return result_runtime_error;
+                }
+                CALL_FRAME(caller, n);
+                NEXT();
+            }
+            OPCODE(op_r_return): {
+                Value result = RK();
+                vm->frame_count -= 1;
+                if (vm->frame_count == 0) {
+                    vm->sp = vm->stack;
+                    return result_ok;
+                }
+                R(0) = result;
+                Value* above = &R(1);
+                frame = &vm->frames[vm->frame_count - 1];
+                ENTER_FRAME();
+                vm_clear_registers(above, vm->sp);
+                NEXT();
+            }
+#ifndef COMPUTED_GOTO
+        }
+        TRACE_STACK();
+    }
+#endif
+
+    // unreachable
+    return result_runtime_error;
+
+#undef BYTE
+#undef WORD
+#undef R
+#undef RK
+#undef ENTER_FRAME
+#undef CALL_FRAME
+#undef NUMBERS
+#undef CHECK_NUMBERS
+#undef OPERANDS
+#undef BINARY_OP_NUMBER
+#undef BINARY_OP_BOOLEAN
+#undef BINARY_OP_JUMP_FALSE
+#undef FALSY
+#undef DECODE
+#undef TRACE_IP
+#undef TRACE_STACK
+#undef OPCODE
+#undef DISPATCH
+#undef NEXT
+}
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
 static void vm_foreign_function(VM* vm, const char* name, ForeignFunction function) {
     Var* var = vm_var_new(vm, vm->globals.count, false, true);
     Value v = value_copy_string(name, strlen(name));
     hamt_set(&vm->global_scope, v, VALUE_FROM_POINTER(var));
-    hamt_set(&vm->global_scope, VALUE_FROM_NUMBER(var->index), v);
+    value_array_push(&vm->global_names, v);
     value_array_push(&vm->globals, VALUE_FROM_FOREIGN_FUNCTION(function));
 }
 
@@ -485,17 +1525,93 @@ FOREIGN_FUNCTION foreign_cos(size_t arg_count, Value* args) {
     return VALUE_FROM_NUMBER((double)cos(args[0].as_double));
 }
 
-Result vm_compile_and_run(VM* vm, const char* source) {
-    Function* function = function_new();
-    function->chunk->vm = vm;
+// The table of the VM, for lookup (foreign functions have no VM).
+static HAMTFile* vm_table;
+
+// Get the value for a key from the table of the VM, or nil if it is not found
+// (or if there is no table, or not exactly one argument).
+FOREIGN_FUNCTION foreign_lookup(size_t arg_count, Value* args) {
+    if (!vm_table || arg_count != 1) {
+        return VALUE_NIL;
+    }
+    Value value = hamt_file_get(vm_table, args[0]);
+    return VALUE_IS_NONE(value) ? VALUE_NIL : value;
+}
+
+// The VM, for the strings made by slice (foreign functions have no VM).
+static VM* vm_strings;
+
+// Characters of a string from start up to end (not included), without copying
+// them for long substrings; nil if the arguments are not a string and two
+// numbers. The arguments are still on the stack, so the garbage collector
+// keeps the string alive while the substring is added to the VM.
+FOREIGN_FUNCTION foreign_slice(size_t arg_count, Value* args) {
+    if (arg_count != 3 || !VALUE_IS_STRING(args[0]) || !VALUE_IS_NUMBER(args[1]) || !VALUE_IS_NUMBER(args[2])) {
+        return VALUE_NIL;
+    }
+    Value v = value_string_slice(args[0], args[1].as_double, args[2].as_double);
+    return vm_add_string(vm_strings, v, args[0], args[0]);
+}
+
+// Reserve address space for a stack; pages only get backed by memory when
+// they are first touched, so the stacks grow on demand up to their limit
+// without ever moving.
+static void* vm_reserve_stack(size_t size) {
+#ifdef MAP_NORESERVE
+    void* stack = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#else
+    void* stack = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (stack == MAP_FAILED) {
+        fprintf(stderr, "Could not reserve %zu bytes for the stack: %s.\n", size, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return stack;
+}
+
+// vm->backend, vm->jit, vm->frames_max and vm->table are set by the caller.
+void vm_init(VM* vm) {
+    vm->frames = vm_reserve_stack(vm->frames_max * sizeof(Frame));
+    vm->stack = vm_reserve_stack(vm->frames_max * FRAME_SLOTS * sizeof(Value));
+    vm->frame_count = 0;
+    vm->sp = vm->stack;
     hamt_init(&vm->global_scope);
-    hamt_init(&vm->strings);
+    intern_init(&vm->strings);
     value_array_init(&vm->objects);
     value_array_init(&vm->globals);
+    value_array_init(&vm->global_names);
+    value_array_init(&vm->remembered);
+    gc_init(vm);
 
     vm_foreign_function(vm, "clock", foreign_clock);
     vm_foreign_function(vm, "cos", foreign_cos);
+    vm_foreign_function(vm, "lookup", foreign_lookup);
+    vm_foreign_function(vm, "slice", foreign_slice);
+    vm_table = vm->table;
+    vm_strings = vm;
+}
+
+// Run a top-level function.
+Result vm_run_function(VM* vm, Function* function) {
+    vm->c_stack = __builtin_frame_address(0);
+    vm->sp = vm->stack;
+    Frame* frame = &vm->frames[0];
+    frame->function = function;
+    frame->slots = vm->sp;
+    vm->frame_count = 1;
+#ifndef NO_NURSERY
+    string_nursery = &vm->nursery;
+#endif
+    Result result = function->native ? jit_run(vm, frame) :
+        vm->backend == backend_registers ? vm_run_registers(vm) : vm_run(vm);
+    string_nursery = 0;
+    return result;
+}
 
+Result vm_compile_and_run(VM* vm, const char* source) {
+    Function* function = function_new();
+    function->chunk->vm = vm;
+    vm_init(vm);
     if (!compile_function(source, function)) {
         function_free(function);
         return result_compile_error;
@@ -505,12 +1621,7 @@ Result vm_compile_and_run(VM* vm, const char* source) {
     chunk_debug(function->chunk, "Top-level function");
 #endif
 
-    vm->sp = vm->stack;
-    Frame* frame = &vm->frames[vm->frame_count];
-    frame->function = function;
-    frame->slots = vm->sp;
-    vm->frame_count = 1;
-    Result result = vm_run(vm);
+    Result result = vm_run_function(vm, function);
     function_free(function);
     return result;
 }
@@ -518,14 +1629,22 @@ Result vm_compile_and_run(VM* vm, const char* source) {
 void vm_free(VM* vm) {
 #ifdef DEBUG
     hamt_debug(&vm->global_scope);
-    hamt_debug(&vm->strings);
+    intern_debug(&vm->strings);
+#endif
+#ifdef PROFILE
+    vm_profile_report();
 #endif
 
     hamt_free(&vm->global_scope);
-    hamt_free(&vm->strings);
+    intern_free(&vm->strings);
     for (size_t i = 0; i < vm->objects.count; ++i) {
         value_free_object(vm->objects.items[i]);
     }
     value_array_free(&vm->objects);
     value_array_free(&vm->globals);
+    value_array_free(&vm->global_names);
+    value_array_free(&vm->remembered);
+    munmap(vm->frames, vm->frames_max * sizeof(Frame));
+    munmap(vm->stack, vm->frames_max * FRAME_SLOTS * sizeof(Value));
+    gc_free(vm);
 }
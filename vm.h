@@ -7,6 +7,7 @@
 
 #include "array.h"
 #include "hamt.h"
+#include "intern.h"
 #include "value.h"
 
 typedef enum {
@@ -33,6 +34,7 @@ typedef enum {
     op_le,
     op_bars,
     op_quote,
+    op_concat,
     op_print,
     op_pop,
     op_dup,
@@ -45,11 +47,72 @@ typedef enum {
     op_jump_true,
     op_jump_false,
     op_call,
+    op_tail_call,
     op_return,
     op_nop,
+    // Superinstructions (see fuse.c).
+    op_get_local_2,
+    op_get_local_constant,
+    op_set_local_pop,
+    op_pop_2,
+    op_pop_jump,
+    op_jump_false_pop,
+    op_lt_jump_false,
+    op_le_jump_false,
+    op_gt_jump_false,
+    op_ge_jump_false,
+    // Quickened instructions (see vm_run).
+    op_add_nn,
+    op_subtract_nn,
+    op_multiply_nn,
+    op_multiply_ss,
+    op_divide_nn,
+    op_gt_nn,
+    op_ge_nn,
+    op_lt_nn,
+    op_le_nn,
+    op_lt_jump_false_nn,
+    op_le_jump_false_nn,
+    op_gt_jump_false_nn,
+    op_ge_jump_false_nn,
+    // Register instructions (see registers.c).
+    op_r_move,
+    op_r_constant,
+    op_r_negate,
+    op_r_add,
+    op_r_subtract,
+    op_r_multiply,
+    op_r_divide,
+    op_r_exponent,
+    op_r_not,
+    op_r_eq,
+    op_r_ne,
+    op_r_gt,
+    op_r_ge,
+    op_r_lt,
+    op_r_le,
+    op_r_bars,
+    op_r_quote,
+    op_r_concat,
+    op_r_print,
+    op_r_define_global,
+    op_r_get_global,
+    op_r_set_global,
+    op_r_jump,
+    op_r_jump_true,
+    op_r_jump_false,
+    op_r_lt_jump_false,
+    op_r_le_jump_false,
+    op_r_gt_jump_false,
+    op_r_ge_jump_false,
+    op_r_call,
+    op_r_tail_call,
+    op_r_return,
     opcode_count
 } Opcode;
 
+size_t opcode_size(uint8_t);
+
 typedef struct VM VM;
 
 typedef struct Chunk {
@@ -68,14 +131,23 @@ void chunk_free(Chunk*);
 void chunk_debug(Chunk*, const char*);
 #endif
 
-#define FRAMES_MAX 64
-#define STACK_SIZE (FRAMES_MAX * (1 + UINT8_MAX))
+// Operands of register instructions are registers below REGISTERS_MAX, or
+// constants (offset by REGISTERS_MAX) above.
+#define REGISTERS_MAX 0x80
+
+// Default limit on the depth of calls (see VM.frames_max); every frame may
+// use up to FRAME_SLOTS values of the stack.
+#define FRAMES_MAX 0x4000
+#define FRAME_SLOTS (1 + UINT8_MAX)
+// Largest limit for which the size of the stack still fits in a size_t.
+#define FRAMES_MAX_LIMIT (SIZE_MAX / (FRAME_SLOTS * sizeof(Value)))
 
 typedef struct {
     uint8_t index;
     bool initialized;
     bool mutable;
     bool global;
+    bool marked;
 } Var;
 
 typedef struct {
@@ -84,16 +156,53 @@ typedef struct {
     Value* slots;
 } Frame;
 
+typedef enum {
+    backend_stack,
+    backend_registers,
+} Backend;
+
+// Heap size and statistics of the garbage collector (see gc.c); sizes are in
+// bytes and pauses in seconds.
+typedef struct {
+    size_t heap_size;
+    size_t heap_next;
+    size_t heap_peak;
+    size_t collections;
+    size_t objects_allocated;
+    size_t objects_freed;
+    size_t bytes_freed;
+    size_t minor_collections;
+    size_t nursery_bytes;
+    size_t promoted_bytes;
+    double pause_total;
+    double pause_max;
+} GC;
+
 typedef struct VM {
-    Frame frames[FRAMES_MAX];
+    Backend backend;
+    bool jit;
+    // Frame address of vm_run_function, to bound the C stack used by calls
+    // between native functions (see jit_call).
+    char* c_stack;
+    size_t frames_max;
+    Frame* frames;
     size_t frame_count;
-    Value stack[STACK_SIZE];
+    Value* stack;
     Value* sp;
     uint8_t* ip;
     HAMT global_scope;
-    HAMT strings;
+    InternTable strings;
     ValueArray objects;
     ValueArray globals;
+    // Names of the globals, by index.
+    ValueArray global_names;
+    GC gc;
+    Nursery nursery;
+    // Ropes and slices made since the last minor collection, whose parts and
+    // parents may be in the nursery (see gc_collect_nursery).
+    ValueArray remembered;
+    // HAMT file for lookup(), if any.
+    HAMTFile* table;
 } VM;
 
 typedef enum {
@@ -102,8 +211,14 @@ typedef enum {
     result_runtime_error,
 } Result;
 
+void vm_init(VM*);
+Result vm_run_function(VM*, Function*);
 Result vm_compile_and_run(VM*, const char*);
+Result vm_run(VM*);
+Result vm_call_and_run(VM*, uint8_t);
+Result vm_runtime_error(VM*, const char*, ...);
 Value vm_add_object(VM*, Value);
+Value vm_add_string(VM*, Value, Value, Value);
 Var* vm_var_new(VM*, size_t, bool, bool);
 Var* vm_add_global(VM*, Value, bool);
 void vm_free(VM*);